@@ -0,0 +1,785 @@
+// For stat() under -std=c99.
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "memory.h"
+#include "vm.h"
+
+// A cache file sits next to its script, with a "c" appended to the name.
+// All integers are little-endian:
+//
+//   "SDBC", u32 version, u8 build features, u8 optimization level
+//   u64 source hash, i64 source mtime, i64 source size
+//   u64 hash of the body
+//
+// The body is a u32 function count followed by each function, the script
+// first. Functions are written once and referred to by index, so one that
+// sits in several constant pools, like the function an inlining guard
+// checks for, is still a single object once loaded. Code and strings are
+// stored as they are used in memory, strings with a terminating NUL, so
+// the loader can point at them instead of copying.
+
+#define MAGIC "SDBC"
+#define HEADER_SIZE 42
+
+// Compiler settings that change the code it emits.
+#define FEATURE_REGISTER_OPS 0x1
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_INT,
+  CONSTANT_DOUBLE,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION
+} ConstantTag;
+
+// Buffers are malloc'd rather than taken from the collector, which could
+// otherwise run while a freshly compiled function is not yet rooted.
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+
+  ObjFunction** functions;
+  int functionCount;
+  int functionCapacity;
+} Writer;
+
+typedef struct {
+  const uint8_t* bytes;
+  size_t count;
+  size_t position;
+  bool failed;
+} Reader;
+
+typedef struct {
+  void* start;
+  size_t size;
+} Image;
+
+// Functions being loaded, kept alive until the script is returned.
+static ObjFunction** loading = NULL;
+static int loadingCount = 0;
+
+// Mapped files that loaded code and strings may point into. They stay
+// mapped until the VM is freed.
+static Image* images = NULL;
+static int imageCount = 0;
+
+static uint8_t features() {
+  uint8_t features = 0;
+#ifdef REGISTER_OPS
+  features |= FEATURE_REGISTER_OPS;
+#endif
+  return features;
+}
+
+// FNV-1a, widened to 64 bits.
+static uint64_t hashBytes(const uint8_t* bytes, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static char* cachePath(const char* path) {
+  size_t length = strlen(path);
+  char* cache = (char*)malloc(length + 2);
+  if (cache == NULL) return NULL;
+
+  memcpy(cache, path, length);
+  cache[length] = 'c';
+  cache[length + 1] = '\0';
+  return cache;
+}
+
+// The stamp a cache is keyed on besides the optimization level: the hash
+// of [source] and the mtime and size of the file it was read from.
+static bool sourceStamp(const char* path, const char* source,
+                        uint64_t* hash, int64_t* mtime, int64_t* size) {
+  struct stat info;
+  if (stat(path, &info) != 0) return false;
+
+  *hash = hashBytes((const uint8_t*)source, strlen(source));
+  *mtime = (int64_t)info.st_mtime;
+  *size = (int64_t)info.st_size;
+  return true;
+}
+
+static bool writeBytes(Writer* writer, const void* bytes, size_t length) {
+  if (writer->capacity < writer->count + length) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < writer->count + length) capacity *= 2;
+
+    uint8_t* grown = (uint8_t*)realloc(writer->bytes, capacity);
+    if (grown == NULL) return false;
+    writer->bytes = grown;
+    writer->capacity = capacity;
+  }
+
+  memcpy(writer->bytes + writer->count, bytes, length);
+  writer->count += length;
+  return true;
+}
+
+static bool writeInt(Writer* writer, uint64_t value, int size) {
+  uint8_t bytes[8];
+  for (int i = 0; i < size; i++) {
+    bytes[i] = (value >> (8 * i)) & 0xff;
+  }
+  return writeBytes(writer, bytes, size);
+}
+
+static void patchInt(Writer* writer, size_t position, uint64_t value,
+                     int size) {
+  for (int i = 0; i < size; i++) {
+    writer->bytes[position + i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+// The index of [function] in the file, queueing it to be written if this
+// is the first reference to it.
+static int functionIndex(Writer* writer, ObjFunction* function) {
+  for (int i = 0; i < writer->functionCount; i++) {
+    if (writer->functions[i] == function) return i;
+  }
+
+  if (writer->functionCapacity < writer->functionCount + 1) {
+    int capacity = GROW_CAPACITY(writer->functionCapacity);
+    ObjFunction** grown = (ObjFunction**)realloc(
+        writer->functions, sizeof(ObjFunction*) * capacity);
+    if (grown == NULL) return -1;
+    writer->functions = grown;
+    writer->functionCapacity = capacity;
+  }
+
+  writer->functions[writer->functionCount] = function;
+  return writer->functionCount++;
+}
+
+static bool writeString(Writer* writer, ObjString* string) {
+  return writeInt(writer, string->length, 4) &&
+         writeBytes(writer, string->chars, string->length + 1);
+}
+
+static bool writeConstant(Writer* writer, Value value) {
+  if (IS_NIL(value)) return writeInt(writer, CONSTANT_NIL, 1);
+  if (IS_BOOL(value)) {
+    return writeInt(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE,
+                    1);
+  }
+  if (IS_INT(value)) {
+    return writeInt(writer, CONSTANT_INT, 1) &&
+           writeInt(writer, (uint32_t)AS_INT(value), 4);
+  }
+  if (IS_NUMBER(value)) {
+    double number = AS_DOUBLE(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    return writeInt(writer, CONSTANT_DOUBLE, 1) &&
+           writeInt(writer, bits, 8);
+  }
+  if (IS_STRING(value)) {
+    return writeInt(writer, CONSTANT_STRING, 1) &&
+           writeString(writer, AS_STRING(value));
+  }
+  if (IS_FUNCTION(value)) {
+    int index = functionIndex(writer, AS_FUNCTION(value));
+    return index != -1 && writeInt(writer, CONSTANT_FUNCTION, 1) &&
+           writeInt(writer, index, 4);
+  }
+
+  // Nothing else ends up in a constant pool at compile time.
+  return false;
+}
+
+static bool writeFunction(Writer* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (function->lazy != NULL) return false;
+
+  if (!writeInt(writer, function->arity, 4) ||
+      !writeInt(writer, function->upvalueCount, 4) ||
+      !writeInt(writer, function->name != NULL, 1) ||
+      (function->name != NULL && !writeString(writer, function->name))) {
+    return false;
+  }
+
+  if (!writeInt(writer, chunk->count, 4) ||
+      !writeBytes(writer, chunk->code, chunk->count)) {
+    return false;
+  }
+
+  if (!writeInt(writer, chunk->lineCount, 4)) return false;
+  for (int i = 0; i < chunk->lineCount; i++) {
+    if (!writeInt(writer, chunk->lines[i].offset, 4) ||
+        !writeInt(writer, chunk->lines[i].line, 4)) {
+      return false;
+    }
+  }
+
+  if (!writeInt(writer, chunk->cacheCount, 4) ||
+      !writeInt(writer, chunk->constants.count, 4)) {
+    return false;
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (!writeConstant(writer, chunk->constants.values[i])) return false;
+  }
+
+  return true;
+}
+
+// Serializes [function] and every function it refers to. The code must
+// not have run yet, since the VM rewrites instructions as it goes.
+static bool writeBody(Writer* writer, ObjFunction* function) {
+  size_t countPosition = writer->count;
+  if (!writeInt(writer, 0, 4) || functionIndex(writer, function) == -1) {
+    return false;
+  }
+
+  // Writing a function can queue more of them.
+  for (int i = 0; i < writer->functionCount; i++) {
+    if (!writeFunction(writer, writer->functions[i])) return false;
+  }
+
+  patchInt(writer, countPosition, writer->functionCount, 4);
+  return true;
+}
+
+bool saveBytecode(const char* path, const char* source,
+                  ObjFunction* function) {
+  uint64_t sourceHash;
+  int64_t mtime, size;
+  if (!sourceStamp(path, source, &sourceHash, &mtime, &size)) return false;
+
+  Writer writer = {NULL, 0, 0, NULL, 0, 0};
+  bool written = writeBytes(&writer, MAGIC, 4) &&
+                 writeInt(&writer, BYTECODE_VERSION, 4) &&
+                 writeInt(&writer, features(), 1) &&
+                 writeInt(&writer, vm.optimizationLevel, 1) &&
+                 writeInt(&writer, sourceHash, 8) &&
+                 writeInt(&writer, (uint64_t)mtime, 8) &&
+                 writeInt(&writer, (uint64_t)size, 8) &&
+                 writeInt(&writer, 0, 8) &&
+                 writeBody(&writer, function);
+
+  if (written) {
+    patchInt(&writer, HEADER_SIZE - 8,
+             hashBytes(writer.bytes + HEADER_SIZE,
+                       writer.count - HEADER_SIZE), 8);
+
+    // Written under another name and renamed into place, so that a
+    // concurrent run never sees half a file.
+    char* cache = cachePath(path);
+    char* temporary = cache != NULL ? cachePath(cache) : NULL;
+    FILE* file = temporary != NULL ? fopen(temporary, "wb") : NULL;
+
+    written = file != NULL &&
+              fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    if (file != NULL && fclose(file) != 0) written = false;
+
+    if (written) written = rename(temporary, cache) == 0;
+    if (!written && file != NULL) remove(temporary);
+
+    free(cache);
+    free(temporary);
+  }
+
+  free(writer.bytes);
+  free(writer.functions);
+  return written;
+}
+
+static uint64_t readInt(Reader* reader, int size) {
+  if (reader->failed || reader->count - reader->position < (size_t)size) {
+    reader->failed = true;
+    return 0;
+  }
+
+  uint64_t value = 0;
+  for (int i = 0; i < size; i++) {
+    value |= (uint64_t)reader->bytes[reader->position++] << (8 * i);
+  }
+  return value;
+}
+
+// Reads a count of items at least [itemSize] bytes each, failing on any
+// that could not fit in the rest of the file.
+static int readCount(Reader* reader, size_t itemSize) {
+  uint64_t count = readInt(reader, 4);
+  if (count > INT32_MAX ||
+      count * itemSize > reader->count - reader->position) {
+    reader->failed = true;
+    return 0;
+  }
+  return (int)count;
+}
+
+static ObjString* readString(Reader* reader) {
+  int length = readCount(reader, 1);
+  if (reader->failed || reader->position + length >= reader->count ||
+      reader->bytes[reader->position + length] != '\0') {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const char* chars = (const char*)reader->bytes + reader->position;
+  reader->position += length + 1;
+  return borrowString(chars, length);
+}
+
+static Value readConstant(Reader* reader) {
+  switch (readInt(reader, 1)) {
+    case CONSTANT_NIL:   return NIL_VAL;
+    case CONSTANT_FALSE: return BOOL_VAL(false);
+    case CONSTANT_TRUE:  return BOOL_VAL(true);
+    case CONSTANT_INT:   return INT_VAL((int32_t)readInt(reader, 4));
+    case CONSTANT_DOUBLE: {
+      uint64_t bits = readInt(reader, 8);
+      double number;
+      memcpy(&number, &bits, sizeof(double));
+      return NUMBER_VAL(number);
+    }
+    case CONSTANT_STRING: {
+      ObjString* string = readString(reader);
+      return string != NULL ? OBJ_VAL(string) : NIL_VAL;
+    }
+    case CONSTANT_FUNCTION: {
+      uint64_t index = readInt(reader, 4);
+      if (index < (uint64_t)loadingCount) return OBJ_VAL(loading[index]);
+      break;
+    }
+  }
+
+  reader->failed = true;
+  return NIL_VAL;
+}
+
+// The [size]-byte operand starting at [code], high byte first.
+static int readOperand(uint8_t* code, int size) {
+  int value = 0;
+  for (int i = 0; i < size; i++) value = (value << 8) | code[i];
+  return value;
+}
+
+static bool isConstant(Chunk* chunk, int constant) {
+  return constant < chunk->constants.count;
+}
+
+static bool isName(Chunk* chunk, int constant) {
+  return isConstant(chunk, constant) &&
+         IS_STRING(chunk->constants.values[constant]);
+}
+
+static bool isFunction(Chunk* chunk, int constant) {
+  return isConstant(chunk, constant) &&
+         IS_FUNCTION(chunk->constants.values[constant]);
+}
+
+static bool isWideable(uint8_t instruction) {
+  switch (instruction) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_ENUM:
+    case OP_SET_ENUM_VALUE:
+    case OP_METHOD:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP || instruction == OP_GUARD_CALL ||
+         instruction == OP_GUARD_INVOKE ||
+         instruction == OP_LESS_LOCAL_CONST_JUMP;
+}
+
+// The length of the OP_CLOSURE at [offset], or -1 if its function or
+// captures are out of range. Local captures are checked against
+// [slotCount] later, with the other slots.
+static int closureLength(ObjFunction* function, int offset, bool wide) {
+  Chunk* chunk = &function->chunk;
+  int length = wide ? 5 : 2;
+  if (offset + length > chunk->count) return -1;
+
+  int constant = readOperand(&chunk->code[offset + (wide ? 2 : 1)],
+                             wide ? 3 : 1);
+  if (!isFunction(chunk, constant)) return -1;
+
+  ObjFunction* closure = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    if (offset + length >= chunk->count) return -1;
+    uint8_t flags = chunk->code[offset + length];
+    int size = (flags & UPVALUE_WIDE) ? 2 : 1;
+    if (offset + length + 1 + size > chunk->count) return -1;
+
+    int index = readOperand(&chunk->code[offset + length + 1], size);
+    if (!(flags & UPVALUE_LOCAL) && index >= function->upvalueCount) {
+      return -1;
+    }
+    length += 1 + size;
+  }
+
+  return length;
+}
+
+// Checks the constant, inline cache and upvalue operands of the
+// instruction at [code].
+static bool validOperands(ObjFunction* function, uint8_t* code) {
+  Chunk* chunk = &function->chunk;
+  bool wide = code[0] == OP_WIDE;
+  if (wide) code++;
+
+  // Behind OP_WIDE the first operand is three bytes and the rest follow.
+  int first = wide ? 3 : 1;
+  int index = readOperand(&code[1], first);
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+      return isConstant(chunk, code[1]);
+    case OP_CONSTANT_LONG:
+      return isConstant(chunk, readOperand(&code[1], 3));
+
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+    case OP_CLASS:
+    case OP_ENUM:
+    case OP_SET_ENUM_VALUE:
+    case OP_METHOD:
+      return isName(chunk, index);
+
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return isName(chunk, index) &&
+             readOperand(&code[1 + first], 2) < chunk->cacheCount;
+    case OP_INVOKE:
+      return isName(chunk, index) &&
+             readOperand(&code[2 + first], 2) < chunk->cacheCount;
+
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return index < function->upvalueCount;
+
+    case OP_GUARD_CALL:
+      return isFunction(chunk, code[2]);
+    case OP_GUARD_INVOKE:
+      return isName(chunk, code[1]) && isFunction(chunk, code[3]);
+
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUBTRACT_LOCAL_CONST:
+    case OP_LESS_LOCAL_CONST_JUMP:
+      return isConstant(chunk, code[2]);
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      return isConstant(chunk, code[3]);
+
+    default:
+      return true;
+  }
+}
+
+// Checks that the stack slots the instruction at [code] names are below
+// [slotCount].
+static bool validSlots(uint8_t* code, int slotCount) {
+  bool wide = code[0] == OP_WIDE;
+  if (wide) code++;
+
+  switch (code[0]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      return readOperand(&code[1], wide ? 3 : 1) < slotCount;
+
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUBTRACT_LOCAL_CONST:
+    case OP_LESS_LOCAL_CONST_JUMP:
+      return code[1] < slotCount;
+
+    case OP_GET_LOCAL_2:
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      return code[1] < slotCount && code[2] < slotCount;
+
+    case OP_ADD_RRR:
+    case OP_SUBTRACT_RRR:
+    case OP_MULTIPLY_RRR:
+    case OP_DIVIDE_RRR:
+      return code[1] < slotCount && code[2] < slotCount &&
+             code[3] < slotCount;
+
+    default:
+      return true;
+  }
+}
+
+static bool validCaptures(Chunk* chunk, int offset, int length,
+                          int slotCount) {
+  bool wide = chunk->code[offset] == OP_WIDE;
+  for (int at = offset + (wide ? 5 : 2); at < offset + length;) {
+    uint8_t flags = chunk->code[at];
+    int size = (flags & UPVALUE_WIDE) ? 2 : 1;
+    if ((flags & UPVALUE_LOCAL) &&
+        readOperand(&chunk->code[at + 1], size) >= slotCount) {
+      return false;
+    }
+    at += 1 + size;
+  }
+  return true;
+}
+
+// Checks that the code decodes into whole instructions, that every jump
+// lands on one, that every operand indexes something the function has and
+// that the line table covers it all. The body hash already rules out
+// damage to the file; this catches a writer and reader that disagree on
+// the format. Sets the function's stack size, which the slots are checked
+// against.
+static bool validFunction(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count == 0 || chunk->lineCount == 0 ||
+      chunk->lines[0].offset != 0) {
+    return false;
+  }
+  for (int i = 1; i < chunk->lineCount; i++) {
+    if (chunk->lines[i].offset <= chunk->lines[i - 1].offset ||
+        chunk->lines[i].offset >= chunk->count) {
+      return false;
+    }
+  }
+
+  bool* starts = (bool*)calloc(chunk->count, sizeof(bool));
+  if (starts == NULL) return false;
+
+  bool valid = true;
+  int offset = 0;
+  while (valid && offset < chunk->count) {
+    bool wide = chunk->code[offset] == OP_WIDE;
+    if (wide && offset + 1 == chunk->count) {
+      valid = false;
+      break;
+    }
+
+    uint8_t instruction = chunk->code[offset + (wide ? 1 : 0)];
+    if ((wide && !isWideable(instruction)) || instruction > OP_LESS_DOUBLE) {
+      valid = false;
+      break;
+    }
+
+    int length = instruction == OP_CLOSURE
+        ? closureLength(function, offset, wide)
+        : instructionLength(chunk, offset);
+    starts[offset] = true;
+    valid = length != -1 && offset + length <= chunk->count &&
+            validOperands(function, &chunk->code[offset]);
+    offset += length;
+  }
+
+  // Jumps are checked once every instruction start is known, since a loop
+  // can target one that comes later in the walk.
+  for (offset = 0; valid && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (!isJump(code[code[0] == OP_WIDE ? 1 : 0])) continue;
+
+    int target = jumpTarget(chunk, offset);
+    valid = target >= 0 && target < chunk->count && starts[target];
+  }
+  free(starts);
+  if (!valid) return false;
+
+  function->maxSlots = chunkStackSize(chunk, function->arity + 1);
+  if (function->maxSlots == -1) return false;
+  for (offset = 0; offset < chunk->count;) {
+    int length = instructionLength(chunk, offset);
+    uint8_t* code = &chunk->code[offset];
+    if (!validSlots(code, function->maxSlots)) return false;
+    if (code[code[0] == OP_WIDE ? 1 : 0] == OP_CLOSURE &&
+        !validCaptures(chunk, offset, length, function->maxSlots)) {
+      return false;
+    }
+    offset += length;
+  }
+
+  return true;
+}
+
+static void readFunction(Reader* reader, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+
+  uint64_t arity = readInt(reader, 4);
+  uint64_t upvalueCount = readInt(reader, 4);
+  if (arity > 255 || upvalueCount > UINT8_COUNT) reader->failed = true;
+  function->arity = (int)arity;
+  function->upvalueCount = (int)upvalueCount;
+  if (readInt(reader, 1)) function->name = readString(reader);
+
+  int count = readCount(reader, 1);
+  if (reader->failed) return;
+  chunk->code = (uint8_t*)reader->bytes + reader->position;
+  chunk->mapped = true;
+  chunk->capacity = count;
+  chunk->count = count;
+  reader->position += count;
+
+  int lineCount = readCount(reader, 8);
+  if (reader->failed) return;
+  chunk->lines = ALLOCATE(LineStart, lineCount);
+  chunk->lineCapacity = lineCount;
+  chunk->lineCount = lineCount;
+  for (int i = 0; i < lineCount; i++) {
+    chunk->lines[i].offset = (int)readInt(reader, 4);
+    chunk->lines[i].line = (int)readInt(reader, 4);
+  }
+
+  int cacheCount = (int)readInt(reader, 4);
+  if (cacheCount > chunk->count) reader->failed = true;
+  for (int i = 0; i < cacheCount && !reader->failed; i++) {
+    addInlineCache(chunk);
+  }
+
+  int constantCount = readCount(reader, 1);
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    addConstant(chunk, readConstant(reader));
+  }
+}
+
+static ObjFunction* readBody(Reader* reader) {
+  int functionCount = readCount(reader, 1);
+  if (reader->failed || functionCount == 0) return NULL;
+
+  // Every function exists before any is read, so constants can refer to
+  // functions later in the file.
+  loading = (ObjFunction**)malloc(sizeof(ObjFunction*) * functionCount);
+  if (loading == NULL) return NULL;
+  for (int i = 0; i < functionCount; i++) {
+    loading[i] = newFunction();
+    loadingCount++;
+  }
+
+  for (int i = 0; i < functionCount && !reader->failed; i++) {
+    readFunction(reader, loading[i]);
+  }
+
+  // An OP_CLOSURE's length depends on how many upvalues its function
+  // captures, and that function may come later in the file.
+  for (int i = 0; i < functionCount && !reader->failed; i++) {
+    if (!validFunction(loading[i])) reader->failed = true;
+  }
+
+  ObjFunction* script = reader->failed ? NULL : loading[0];
+  free(loading);
+  loading = NULL;
+  loadingCount = 0;
+  return script;
+}
+
+// Maps the file at [path] privately, storing its size in [size]. The
+// mapping is writable because the VM quickens instructions in place.
+static uint8_t* mapFile(const char* path, size_t* size) {
+  int file = open(path, O_RDONLY);
+  if (file == -1) return NULL;
+
+  struct stat info;
+  void* start = MAP_FAILED;
+  if (fstat(file, &info) == 0 && info.st_size > 0) {
+    *size = (size_t)info.st_size;
+    start = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+  }
+  close(file);
+
+  return start == MAP_FAILED ? NULL : (uint8_t*)start;
+}
+
+static bool addImage(void* start, size_t size) {
+  Image* grown = (Image*)realloc(images, sizeof(Image) * (imageCount + 1));
+  if (grown == NULL) return false;
+
+  images = grown;
+  images[imageCount].start = start;
+  images[imageCount].size = size;
+  imageCount++;
+  return true;
+}
+
+ObjFunction* loadBytecode(const char* path, const char* source) {
+  char* cache = cachePath(path);
+  size_t size = 0;
+  uint8_t* bytes = cache != NULL ? mapFile(cache, &size) : NULL;
+  free(cache);
+  if (bytes == NULL) return NULL;
+
+  Reader reader = {bytes, size, 0, false};
+  ObjFunction* function = NULL;
+  bool used = false;
+
+  uint64_t sourceHash;
+  int64_t mtime, sourceSize;
+  if (size >= HEADER_SIZE && memcmp(bytes, MAGIC, 4) == 0 &&
+      sourceStamp(path, source, &sourceHash, &mtime, &sourceSize)) {
+    reader.position = 4;
+    bool fresh = readInt(&reader, 4) == BYTECODE_VERSION &&
+                 readInt(&reader, 1) == features() &&
+                 readInt(&reader, 1) == (uint64_t)vm.optimizationLevel &&
+                 readInt(&reader, 8) == sourceHash &&
+                 readInt(&reader, 8) == (uint64_t)mtime &&
+                 readInt(&reader, 8) == (uint64_t)sourceSize &&
+                 readInt(&reader, 8) == hashBytes(bytes + HEADER_SIZE,
+                                                  size - HEADER_SIZE);
+    // Once reading starts, strings that point into the image may be
+    // interned, so it stays mapped even if the rest fails to load.
+    if (fresh && addImage(bytes, size)) {
+      used = true;
+      function = readBody(&reader);
+    }
+  }
+
+  if (!used) munmap(bytes, size);
+  return function;
+}
+
+void markCacheRoots() {
+  for (int i = 0; i < loadingCount; i++) {
+    markObject((Obj*)loading[i]);
+  }
+}
+
+void freeBytecodeImages() {
+  for (int i = 0; i < imageCount; i++) {
+    munmap(images[i].start, images[i].size);
+  }
+  free(images);
+  images = NULL;
+  imageCount = 0;
+}
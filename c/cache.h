@@ -0,0 +1,29 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "object.h"
+
+// Bumped whenever the instruction set or the file layout changes, so that
+// caches written by an older build are recompiled instead of misread.
+#define BYTECODE_VERSION 3
+
+// Writes [function], compiled from [source], to the cache file for the
+// script at [path]. Returns false if the file could not be written.
+bool saveBytecode(const char* path, const char* source, ObjFunction* function);
+
+// Loads the cached bytecode for [source] at [path]. Returns NULL if there
+// is no cache, or if it is stale, corrupt, or was written by another build
+// or at another optimization level.
+//
+// The file is mapped copy-on-write and the loaded code and strings point
+// straight into it, so processes running the same scripts share one copy
+// in the page cache. A page is only copied once the VM rewrites an
+// instruction on it.
+ObjFunction* loadBytecode(const char* path, const char* source);
+
+void markCacheRoots();
+
+// Unmaps every loaded image. Only safe once the objects are freed.
+void freeBytecodeImages();
+
+#endif
@@ -4,16 +4,67 @@
 #include "memory.h"
 #include "vm.h"
 
+static const uint8_t operandBytes[UINT8_COUNT] = {
+  [OP_CONSTANT] = 1,
+  [OP_CONSTANT_LONG] = 3,
+  [OP_GET_LOCAL] = 1,
+  [OP_SET_LOCAL] = 1,
+  [OP_GET_GLOBAL] = 1,
+  [OP_DEFINE_GLOBAL] = 1,
+  [OP_SET_GLOBAL] = 1,
+  [OP_GET_UPVALUE] = 1,
+  [OP_SET_UPVALUE] = 1,
+  [OP_GET_PROPERTY] = 3,
+  [OP_SET_PROPERTY] = 3,
+  [OP_GET_SUPER] = 1,
+  [OP_JUMP] = 2,
+  [OP_JUMP_IF_FALSE] = 2,
+  [OP_LOOP] = 2,
+  [OP_CALL] = 1,
+  [OP_TAIL_CALL] = 1,
+  [OP_INVOKE] = 4,
+  [OP_SUPER_INVOKE] = 2,
+  [OP_CLOSURE] = 1,
+  [OP_CLASS] = 1,
+  [OP_ENUM] = 1,
+  [OP_SET_ENUM_VALUE] = 1,
+  [OP_METHOD] = 1,
+  [OP_UNPACK_LIST] = 1,
+  [OP_NEW_DICT] = 1,
+  [OP_GUARD_CALL] = 4,
+  [OP_GUARD_INVOKE] = 5,
+  [OP_GET_LOCAL_2] = 2,
+  [OP_SET_LOCAL_POP] = 1,
+  [OP_ADD_LOCAL_CONST] = 2,
+  [OP_SUBTRACT_LOCAL_CONST] = 2,
+  [OP_LESS_LOCAL_CONST_JUMP] = 4,
+  [OP_ADD_RRR] = 3,
+  [OP_SUBTRACT_RRR] = 3,
+  [OP_MULTIPLY_RRR] = 3,
+  [OP_DIVIDE_RRR] = 3,
+  [OP_ADD_RRK] = 3,
+  [OP_SUBTRACT_RRK] = 3,
+  [OP_MULTIPLY_RRK] = 3,
+  [OP_DIVIDE_RRK] = 3,
+};
+
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->mapped = false;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
   initValueArray(&chunk->constants);
 }
 void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  if (!chunk->mapped) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -23,18 +74,295 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code,
         oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines,
-        oldCapacity, chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
+  addLine(chunk, chunk->count, line);
   chunk->count++;
 }
 
+void addLine(Chunk* chunk, int offset, int line) {
+  if (chunk->lineCount > 0 &&
+      chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+        oldCapacity, chunk->lineCapacity);
+  }
+
+  LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = offset;
+  lineStart->line = line;
+}
+
+int getLine(Chunk* chunk, int offset) {
+  // Binary search for the last run that starts at or before [offset].
+  int start = 0;
+  int end = chunk->lineCount - 1;
+
+  while (start < end) {
+    int mid = (start + end + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      start = mid;
+    } else {
+      end = mid - 1;
+    }
+  }
+
+  return chunk->lines[start].line;
+}
+
+void truncateChunk(Chunk* chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
 int addConstant(Chunk* chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
   return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+        oldCapacity, chunk->cacheCapacity);
+  }
+
+  InlineCache* cache = &chunk->caches[chunk->cacheCount];
+  cache->count = 0;
+  cache->megamorphic = false;
+  return chunk->cacheCount++;
+}
+
+// Net change in stack depth for instructions whose effect does not depend
+// on their operands. See stackEffect().
+static const int8_t stackEffects[UINT8_COUNT] = {
+  [OP_CONSTANT] = 1,
+  [OP_CONSTANT_LONG] = 1,
+  [OP_NIL] = 1,
+  [OP_TRUE] = 1,
+  [OP_FALSE] = 1,
+  [OP_POP] = -1,
+  [OP_GET_LOCAL] = 1,
+  [OP_GET_GLOBAL] = 1,
+  [OP_DEFINE_GLOBAL] = -1,
+  [OP_GET_UPVALUE] = 1,
+  [OP_SET_PROPERTY] = -1,
+  [OP_GET_SUPER] = -1,
+  [OP_EQUAL] = -1,
+  [OP_GREATER] = -1,
+  [OP_LESS] = -1,
+  [OP_ADD] = -1,
+  [OP_SUBTRACT] = -1,
+  [OP_MULTIPLY] = -1,
+  [OP_DIVIDE] = -1,
+  [OP_PRINT] = -1,
+  [OP_CLOSURE] = 1,
+  [OP_CLOSE_UPVALUE] = -1,
+  [OP_CLASS] = 1,
+  [OP_ENUM] = 1,
+  [OP_SET_ENUM_VALUE] = -1,
+  [OP_INHERIT] = -1,
+  [OP_METHOD] = -1,
+  [OP_SUBSCRIPT] = -1,
+  [OP_NEW_LIST] = 1,
+  [OP_SUBSCRIPT_ASSIGN] = -2,
+  [OP_SUBSCRIPT_PUSH] = 1,
+  [OP_ADD_LIST] = -1,
+  [OP_GUARD_CALL] = -1,
+  [OP_GET_LOCAL_2] = 2,
+  [OP_SET_LOCAL_POP] = -1,
+  [OP_ADD_LOCAL_CONST] = 1,
+  [OP_SUBTRACT_LOCAL_CONST] = 1,
+};
+
+static int stackEffect(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+
+  // Behind OP_WIDE, operands after the first are two bytes further on.
+  // Jumps, whose first operand is only one byte further, have no others.
+  int wide = 0;
+  if (code[0] == OP_WIDE) {
+    code++;
+    wide = 2;
+  }
+
+  switch (code[0]) {
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -code[1];
+    case OP_INVOKE:
+      return -code[2 + wide];
+    case OP_SUPER_INVOKE:
+      return -code[2 + wide] - 1;
+    case OP_UNPACK_LIST:
+      return code[1] - 1;
+    case OP_NEW_DICT:
+      return 1 - 2 * code[1];
+    default:
+      return stackEffects[genericInstruction(code[0])];
+  }
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  bool wide = code[0] == OP_WIDE;
+  if (wide) code++;
+
+  // A prefix adds itself and what makes the first operand three bytes.
+  int length = 1 + operandBytes[code[0]];
+  if (wide) {
+    bool jump = code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE ||
+                code[0] == OP_LOOP;
+    length += jump ? 2 : 3;
+  }
+
+  if (code[0] == OP_CLOSURE) {
+    int constant = wide ? (code[1] << 16) | (code[2] << 8) | code[3]
+                        : code[1];
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+
+    for (int i = 0; i < function->upvalueCount; i++) {
+      length += (chunk->code[offset + length] & UPVALUE_WIDE) ? 3 : 2;
+    }
+  }
+
+  return length;
+}
+
+// Where the jump at [offset] lands. Every jump keeps its offset in its
+// last operand bytes, counted from the end of the instruction.
+int jumpTarget(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  int end = offset + instructionLength(chunk, offset);
+  int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+
+  uint8_t instruction = code[0];
+  if (instruction == OP_WIDE) {
+    jump |= chunk->code[end - 3] << 16;
+    instruction = code[1];
+  }
+
+  return instruction == OP_LOOP ? end - jump : end + jump;
+}
+
+// The instruction a quickened form was specialized from. Anything else is
+// returned unchanged.
+uint8_t genericInstruction(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD_INT:
+    case OP_ADD_DOUBLE:
+    case OP_ADD_STRING:
+      return OP_ADD;
+    case OP_SUBTRACT_INT:
+    case OP_SUBTRACT_DOUBLE:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_INT:
+    case OP_MULTIPLY_DOUBLE:
+      return OP_MULTIPLY;
+    case OP_DIVIDE_DOUBLE:
+      return OP_DIVIDE;
+    case OP_GREATER_INT:
+    case OP_GREATER_DOUBLE:
+      return OP_GREATER;
+    case OP_LESS_INT:
+    case OP_LESS_DOUBLE:
+      return OP_LESS;
+    default:
+      return instruction;
+  }
+}
+
+// Returns the most values a call frame running [chunk] has on the stack at
+// once, counting the [entryDepth] slots for the callee and its arguments,
+// or -1 if some instruction would pop the callee's slot. Each jump target
+// is reached with the same depth from every path, so one visit per
+// instruction is enough.
+int chunkStackSize(Chunk* chunk, int entryDepth) {
+  int* depths = ALLOCATE(int, chunk->count);
+  int* worklist = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+  int pending = 0;
+  depths[0] = entryDepth;
+  worklist[pending++] = 0;
+  int maxDepth = entryDepth;
+
+#define REACH(target, depth)                                          \
+    do {                                                              \
+      int at = (target);                                              \
+      if (at < chunk->count && depths[at] == -1) {                    \
+        depths[at] = (depth);                                         \
+        worklist[pending++] = at;                                     \
+      }                                                               \
+    } while (false)
+
+  while (pending > 0) {
+    int offset = worklist[--pending];
+    uint8_t* code = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    int depth = depths[offset] + stackEffect(chunk, offset);
+    if (depth > maxDepth) maxDepth = depth;
+    if (depth < 1) {
+      maxDepth = -1;
+      break;
+    }
+
+    switch (code[0] == OP_WIDE ? code[1] : code[0]) {
+      case OP_JUMP:
+        REACH(jumpTarget(chunk, offset), depth);
+        break;
+
+      case OP_JUMP_IF_FALSE:
+        REACH(jumpTarget(chunk, offset), depth);
+        REACH(next, depth);
+        break;
+
+      case OP_LOOP:
+        REACH(jumpTarget(chunk, offset), depth);
+        break;
+
+      case OP_LESS_LOCAL_CONST_JUMP:
+        // Leaves false on the stack for the code it jumps to.
+        REACH(jumpTarget(chunk, offset), depth + 1);
+        if (depth + 1 > maxDepth) maxDepth = depth + 1;
+        REACH(next, depth);
+        break;
+
+      case OP_GUARD_CALL:
+        // Only the inlined body loses the callee.
+        REACH(jumpTarget(chunk, offset), depth + 1);
+        REACH(next, depth);
+        break;
+
+      case OP_GUARD_INVOKE:
+        REACH(jumpTarget(chunk, offset), depth);
+        REACH(next, depth);
+        break;
+
+      case OP_RETURN:
+        break;
+
+      default:
+        REACH(next, depth);
+        break;
+    }
+  }
+
+#undef REACH
+
+  FREE_ARRAY(int, depths, chunk->count);
+  FREE_ARRAY(int, worklist, chunk->count);
+  return maxDepth;
+}
@@ -12,6 +12,9 @@ typedef enum {
 
   OP_CONSTANT,
 
+  // OP_CONSTANT with a three-byte index, for chunks with more than 256
+  // constants.
+  OP_CONSTANT_LONG,
 
   OP_NIL,
   OP_TRUE,
@@ -79,6 +82,9 @@ typedef enum {
   OP_CALL,
 
 
+  OP_TAIL_CALL,
+
+
   OP_INVOKE,
 
 
@@ -109,12 +115,102 @@ typedef enum {
   OP_SUBSCRIPT_ASSIGN,
   OP_SUBSCRIPT_PUSH,
   OP_ADD_LIST,
-  OP_NEW_DICT
+  OP_NEW_DICT,
+
+  // Prefix that makes the first operand of the next instruction three
+  // bytes, high byte first, for constant indices and slots past one byte
+  // and jump offsets past two. Only instructions whose first operand is
+  // one of those take it, and never the fused or quickened forms.
+  OP_WIDE,
+
+  // Guards in front of a call the compiler inlined. Each falls through into
+  // the inlined body when the callee is the function that was inlined, and
+  // otherwise jumps to the full call that follows the body.
+  OP_GUARD_CALL,
+  OP_GUARD_INVOKE,
+
+  // Superinstructions. The compiler never emits these directly; the
+  // peephole pass in optimizer.c fuses common sequences into them.
+  OP_GET_LOCAL_2,
+  OP_SET_LOCAL_POP,
+  OP_ADD_LOCAL_CONST,
+  OP_SUBTRACT_LOCAL_CONST,
+  OP_LESS_LOCAL_CONST_JUMP,
+
+  // Three-address register forms, also produced by the peephole pass when
+  // REGISTER_OPS is defined. Operands are a destination slot and two
+  // source slots (_RRR) or a source slot and a constant (_RRK).
+  OP_ADD_RRR,
+  OP_SUBTRACT_RRR,
+  OP_MULTIPLY_RRR,
+  OP_DIVIDE_RRR,
+  OP_ADD_RRK,
+  OP_SUBTRACT_RRK,
+  OP_MULTIPLY_RRK,
+  OP_DIVIDE_RRK,
+
+  // Quickened forms. With QUICKENING defined, the VM rewrites a generic
+  // arithmetic or comparison instruction into one of these after seeing
+  // its operand types, and back again once they stop matching.
+  OP_ADD_INT,
+  OP_ADD_DOUBLE,
+  OP_ADD_STRING,
+  OP_SUBTRACT_INT,
+  OP_SUBTRACT_DOUBLE,
+  OP_MULTIPLY_INT,
+  OP_MULTIPLY_DOUBLE,
+  OP_DIVIDE_DOUBLE,
+  OP_GREATER_INT,
+  OP_GREATER_DOUBLE,
+  OP_LESS_INT,
+  OP_LESS_DOUBLE
 
 } OpCode;
 
 
 
+// Flags in the first byte of each upvalue an OP_CLOSURE captures. A wide
+// local slot takes a second index byte.
+#define UPVALUE_LOCAL 0x1
+#define UPVALUE_WIDE  0x2
+
+// Number of receivers a call site remembers before it goes megamorphic.
+#define INLINE_CACHE_WAYS 4
+
+typedef struct {
+  // Receiver class the entry was filled for. Invoke caches key on it; field
+  // caches keep it so the shapes they point into stay alive.
+  ObjClass* klass;
+
+  // Receiver shape a field cache matches, and the slot of the field in it.
+  Shape* shape;
+  int slot;
+
+  // For OP_SET_PROPERTY sites that add a field: the shape after the add.
+  Shape* transition;
+
+  // Method resolved for [klass] by OP_INVOKE.
+  ObjClosure* method;
+} CacheEntry;
+
+
+// Per-instruction cache for OP_GET_PROPERTY, OP_SET_PROPERTY and
+// OP_INVOKE. Each of those carries a 16-bit index into Chunk.caches.
+typedef struct {
+  int count;
+  bool megamorphic;
+  CacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
+
+
+// Start of a run of bytecode that all comes from the same source line.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
+
 typedef struct {
 
   int count;
@@ -122,11 +218,23 @@ typedef struct {
 
   uint8_t* code;
 
-  int* lines;
+  // Set when [code] points into a mapped bytecode image rather than a
+  // buffer of its own.
+  bool mapped;
+
+  // Line table, one entry per change of line, in offset order.
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;
 
 
   ValueArray constants;
 
+
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
+
 } Chunk;
 
 
@@ -141,7 +249,34 @@ void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
 
+// Records that the code from [offset] on comes from [line]. Offsets must
+// be added in order.
+void addLine(Chunk* chunk, int offset, int line);
+
+
+int getLine(Chunk* chunk, int offset);
+
+
+// Drops the code from [count] on, along with its lines.
+void truncateChunk(Chunk* chunk, int count);
+
+
 int addConstant(Chunk* chunk, Value value);
 
 
+int addInlineCache(Chunk* chunk);
+
+
+int instructionLength(Chunk* chunk, int offset);
+
+
+int jumpTarget(Chunk* chunk, int offset);
+
+
+uint8_t genericInstruction(uint8_t instruction);
+
+
+int chunkStackSize(Chunk* chunk, int entryDepth);
+
+
 #endif
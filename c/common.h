@@ -11,6 +11,54 @@
 
 #define NAN_BOXING
 
+// Threaded dispatch through a table of label addresses in run(). Needs the
+// GCC/Clang labels-as-values extension; build with -DNO_COMPUTED_GOTO (or
+// `make DISPATCH=switch`) to use the portable switch loop instead.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Let the peephole pass rewrite arithmetic between locals into
+// three-address instructions that read and write frame slots in place.
+// Build with -DNO_REGISTER_OPS (or `make REGISTER_OPS=off`) to run pure
+// stack code, e.g. to compare the two on the benchmarks.
+#ifndef NO_REGISTER_OPS
+#define REGISTER_OPS
+#endif
+
+// Rewrite arithmetic and comparison instructions in place into forms
+// specialized for the operand types seen at run time (see OP_ADD_INT and
+// friends in chunk.h). Build with -DNO_QUICKENING (or `make
+// QUICKENING=off`) to always run the generic instructions.
+#ifndef NO_QUICKENING
+#define QUICKENING
+#endif
+
+// Baseline JIT that compiles hot functions to machine code (jit.c). It
+// emits x86-64 for the System V ABI and relies on NaN boxing, so it is
+// only built there; -DNO_JIT (or `make JIT=off`) leaves it out, and
+// `--no-jit` turns it off for a single run.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// Collect objects that survived a collection only in full collections,
+// and everything newer more often in minor ones (see memory.c). Build
+// with -DNO_GENERATIONAL_GC (or `make GC=full`) to trace the whole heap
+// every time.
+#ifndef NO_GENERATIONAL_GC
+#define GENERATIONAL_GC
+#endif
+
+// Allocate small objects from pages of same-sized cells (slab.c) rather
+// than one malloc() each. Build with -DNO_SLAB_ALLOCATOR (or `make
+// ALLOC=malloc`) to use malloc() for them too, e.g. so that AddressSanitizer
+// catches uses of freed objects.
+#ifndef NO_SLAB_ALLOCATOR
+#define SLAB_ALLOCATOR
+#endif
+
 
 #define DEBUG_PRINT_CODE
 
@@ -26,6 +74,7 @@
 
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 
 #endif
@@ -5,13 +5,19 @@
 #include <string.h>
 #include "common.h"
 #include "compiler.h"
+#include "ir.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// Largest constant index and jump offset the wide encodings can hold.
+#define MAX_CONSTANT 0xffffff
+#define MAX_JUMP 0xffffff
+
 typedef struct {
   Token current;
   Token previous;
@@ -48,7 +54,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
@@ -64,12 +70,38 @@ typedef struct Compiler {
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
 
   Upvalue upvalues[UINT8_COUNT];
 
   int scopeDepth;
+
+  // Code offset just past the last OP_CALL, so returnStatement() can tell
+  // when the returned value is the result of a call.
+  int lastCall;
+
+  // Start of the last literal from emitLiteral(), and the last offset a
+  // forward jump was patched to land on. literalAt() uses them to tell when
+  // an operand or condition is nothing but a literal.
+  int lastLiteral;
+  int lastJumpTarget;
+
+  // IR of the expression that starts the body, and the offset its code
+  // ends at, kept so that function() can offer it to the inliner.
+  Expr* inlineBody;
+  int inlineBodyEnd;
+
+  // Forward jumps too long for their offset, widened by relaxJumps() once
+  // the function is done.
+  LongJump* longJumps;
+  int longJumpCount;
+  int longJumpCapacity;
+
+  // For a body compileLazily() is compiling, the variables it captures.
+  // There is no enclosing compiler left to resolve them in.
+  LazyBody* lazy;
 } Compiler;
 
 
@@ -93,6 +125,11 @@ Compiler* current = NULL;
 
 ClassCompiler* currentClass = NULL;
 
+// The source being compiled, and a copy of it that lazily compiled
+// bodies keep while they wait. NULL when bodies are compiled right away.
+static const char* sourceStart = NULL;
+static ObjString* lazySource = NULL;
+
 
 
 
@@ -101,6 +138,15 @@ static Chunk* currentChunk() {
   return &current->function->chunk;
 }
 
+static void growLocals(Compiler* compiler) {
+  if (compiler->localCapacity < compiler->localCount + 1) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity,
+                                  compiler->localCapacity);
+  }
+}
+
 
 
 
@@ -183,13 +229,19 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 
 
 static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+  int offset = currentChunk()->count - loopStart + 3;
+  if (offset <= UINT16_MAX) {
+    emitByte(OP_LOOP);
+    emitBytes((offset >> 8) & 0xff, offset & 0xff);
+    return;
+  }
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  offset += 2;
+  if (offset > MAX_JUMP) error("Loop body too large.");
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitBytes(OP_WIDE, OP_LOOP);
+  emitByte((offset >> 16) & 0xff);
+  emitBytes((offset >> 8) & 0xff, offset & 0xff);
 }
 
 
@@ -215,59 +267,215 @@ static void emitReturn() {
 }
 
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant > MAX_CONSTANT) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+
+// Emits [instruction] with [arg], a constant or slot, as its first
+// operand, behind OP_WIDE if it needs more than one byte.
+static void emitWithArg(uint8_t instruction, int arg) {
+  if (arg <= UINT8_MAX) {
+    emitBytes(instruction, arg);
+    return;
+  }
+
+  emitBytes(OP_WIDE, instruction);
+  emitByte((arg >> 16) & 0xff);
+  emitBytes((arg >> 8) & 0xff, arg & 0xff);
+}
+
+
+static void emitInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one chunk.");
+    return;
+  }
+
+  emitByte((cache >> 8) & 0xff);
+  emitByte(cache & 0xff);
 }
 
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int constant = makeConstant(value);
+  if (constant <= UINT8_MAX) {
+    emitBytes(OP_CONSTANT, constant);
+    return;
+  }
+
+  emitBytes(OP_CONSTANT_LONG, (constant >> 16) & 0xff);
+  emitBytes((constant >> 8) & 0xff, constant & 0xff);
+}
+
+
+// The constant an OP_CONSTANT or OP_CONSTANT_LONG at [offset] loads.
+static int constantOperand(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  if (code[0] == OP_CONSTANT) return code[1];
+  return (code[1] << 16) | (code[2] << 8) | code[3];
 }
 
 
 static void patchJump(int offset) {
-  
-  int jump = currentChunk()->count - offset - 2;
+  Chunk* chunk = currentChunk();
+  int jump = chunk->count - offset - 2;
+  current->lastJumpTarget = chunk->count;
+
+  if (jump <= UINT16_MAX) {
+    chunk->code[offset] = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
+    return;
+  }
+
+  // Widening it now would move code that other jumps already point past.
+  if (jump > MAX_JUMP - 2) error("Too much code to jump over.");
+
+  if (current->longJumpCapacity < current->longJumpCount + 1) {
+    int oldCapacity = current->longJumpCapacity;
+    current->longJumpCapacity = GROW_CAPACITY(oldCapacity);
+    current->longJumps = GROW_ARRAY(LongJump, current->longJumps,
+                                    oldCapacity, current->longJumpCapacity);
+  }
+
+  LongJump* longJump = &current->longJumps[current->longJumpCount++];
+  longJump->operand = offset;
+  longJump->target = chunk->count;
+}
+
+
+static void emitLiteral(Value value) {
+  current->lastLiteral = currentChunk()->count;
+
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+  }
+}
+
 
-  if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+// Whether the code from [start] to the end is a single literal that no
+// jump lands inside of. If so, stores its value in [value].
+static bool literalAt(int start, Value* value) {
+  Chunk* chunk = currentChunk();
+  if (start < 0 || start != current->lastLiteral ||
+      start < current->lastJumpTarget) {
+    return false;
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  switch (chunk->code[start]) {
+    case OP_NIL:   *value = NIL_VAL; break;
+    case OP_FALSE: *value = BOOL_VAL(false); break;
+    case OP_TRUE:  *value = BOOL_VAL(true); break;
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      if (start + instructionLength(chunk, start) != chunk->count) {
+        return false;
+      }
+      *value = chunk->constants.values[constantOperand(chunk, start)];
+      return true;
+    default:
+      return false;
+  }
+
+  return start + 1 == chunk->count;
 }
 
 
+// Drops the code from [offset] on, like a branch that can never run.
+static void discardCode(int offset) {
+  truncateChunk(currentChunk(), offset);
+
+  if (current->lastCall > offset) current->lastCall = -1;
+  if (current->lastLiteral >= offset) current->lastLiteral = -1;
+  if (current->lastJumpTarget > offset) current->lastJumpTarget = offset;
+  if (current->inlineBodyEnd > offset) current->inlineBody = NULL;
+
+  while (current->longJumpCount > 0 &&
+         current->longJumps[current->longJumpCount - 1].operand >= offset) {
+    current->longJumpCount--;
+  }
+}
 
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+// Replaces the one or two literals from [start] on with one for [value],
+// the result of folding them. Each literal added its own constant, so
+// those are dropped too when they are still at the end of the pool.
+static void replaceLiterals(int start, Value value) {
+  Chunk* chunk = currentChunk();
+
+  int constants[2];
+  int constantCount = 0;
+  for (int offset = start; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_CONSTANT || instruction == OP_CONSTANT_LONG) {
+      constants[constantCount++] = constantOperand(chunk, offset);
+    }
+  }
+
+  while (constantCount > 0 &&
+         constants[constantCount - 1] == chunk->constants.count - 1) {
+    chunk->constants.count--;
+    constantCount--;
+  }
+
+  discardCode(start);
+  emitLiteral(value);
+}
+
+
+
+
+
+
+// Starts compiling a new function, or the body of [function], a function
+// compiled lazily, if it is not NULL.
+static void initCompiler(Compiler* compiler, FunctionType type,
+                         ObjFunction* function) {
 
   compiler->enclosing = current;
 
   compiler->function = NULL;
   compiler->type = type;
 
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
-
-  compiler->function = newFunction();
+  compiler->lastCall = -1;
+  compiler->lastLiteral = -1;
+  compiler->lastJumpTarget = -1;
+  compiler->inlineBody = NULL;
+  compiler->inlineBodyEnd = -1;
+  compiler->longJumps = NULL;
+  compiler->longJumpCount = 0;
+  compiler->longJumpCapacity = 0;
+  compiler->lazy = NULL;
+
+  compiler->function = function != NULL ? function : newFunction();
 
   current = compiler;
 
 
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && function == NULL) {
     current->function->name = copyString(parser.previous.start,
                                          parser.previous.length);
   }
 
 
 
+  growLocals(current);
   Local* local = &current->locals[current->localCount++];
   local->depth = 0;
 
@@ -289,13 +497,28 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 
 
 
+// Drops the compiler of the function just finished and returns that.
+static ObjFunction* popCompiler() {
+  ObjFunction* function = current->function;
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  FREE_ARRAY(LongJump, current->longJumps, current->longJumpCapacity);
+  current = current->enclosing;
+  return function;
+}
+
 static ObjFunction* endCompiler() {
 
   emitReturn();
 
   ObjFunction* function = current->function;
 
-
+  if (!parser.hadError) {
+    if (current->longJumpCount > 0) {
+      relaxJumps(currentChunk(), current->longJumps, current->longJumpCount);
+    }
+    optimizeChunk(currentChunk());
+    function->maxSlots = chunkStackSize(currentChunk(), function->arity + 1);
+  }
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
@@ -310,9 +533,7 @@ static ObjFunction* endCompiler() {
 
 
 
-  current = current->enclosing;
-
-  return function;
+  return popCompiler();
 
 }
 
@@ -354,7 +575,7 @@ static void parsePrecedence(Precedence precedence);
 
 
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyString(name->start,
                                          name->length)));
 }
@@ -383,7 +604,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 
-static int addUpvalue(Compiler* compiler, uint8_t index,
+static int addUpvalue(Compiler* compiler, uint16_t index,
                       bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
@@ -409,21 +630,37 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
 }
 
 
+// Finds [name] among the variables captured by a lazily compiled body.
+static int resolveLazyUpvalue(LazyBody* lazy, Token* name) {
+  for (int i = 0; i < lazy->upvalueCount; i++) {
+    ObjString* upvalue = lazy->upvalueNames[i];
+    if (upvalue->length == name->length &&
+        memcmp(upvalue->chars, name->start, name->length) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+  if (compiler->enclosing == NULL) {
+    return compiler->lazy != NULL ? resolveLazyUpvalue(compiler->lazy, name)
+                                  : -1;
+  }
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
 
     compiler->enclosing->locals[local].isCaptured = true;
 
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, local, true);
   }
 
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, upvalue, false);
   }
 
 
@@ -431,11 +668,13 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
 
+  growLocals(current);
+
   Local* local = &current->locals[current->localCount++];
   local->name = name;
 
@@ -462,7 +701,7 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
@@ -478,13 +717,13 @@ static void markInitialized() {
       current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitWithArg(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -513,12 +752,7 @@ static void and_(bool canAssign) {
   patchJump(endJump);
 }
 
-static void binary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
-
-  ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
-
+static void emitBinaryOp(TokenType operatorType) {
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
     case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
@@ -535,33 +769,58 @@ static void binary(bool canAssign) {
   }
 }
 
+static void binary(bool canAssign) {
+  TokenType operatorType = parser.previous.type;
+
+  Value left;
+  int leftStart = current->lastLiteral;
+  bool constantLeft = literalAt(leftStart, &left);
+
+  ParseRule* rule = getRule(operatorType);
+  int rightStart = currentChunk()->count;
+  parsePrecedence((Precedence)(rule->precedence + 1));
+
+  Value right, result;
+  if (constantLeft && literalAt(rightStart, &right) &&
+      foldBinary(operatorType, left, right, &result)) {
+    replaceLiterals(leftStart, result);
+    return;
+  }
+
+  emitBinaryOp(operatorType);
+}
+
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
   emitBytes(OP_CALL, argCount);
+  current->lastCall = currentChunk()->count;
 }
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitWithArg(OP_SET_PROPERTY, name);
+    emitInlineCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitWithArg(OP_INVOKE, name);
     emitByte(argCount);
+    emitInlineCache();
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitWithArg(OP_GET_PROPERTY, name);
+    emitInlineCache();
   }
 }
 
 static void literal(bool canAssign) {
 
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+    case TOKEN_FALSE: emitLiteral(BOOL_VAL(false)); break;
+    case TOKEN_NIL: emitLiteral(NIL_VAL); break;
+    case TOKEN_TRUE: emitLiteral(BOOL_VAL(true)); break;
     default:
       return; 
   }
@@ -572,10 +831,17 @@ static void grouping(bool canAssign) {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
+static Value numberValue() {
   double value = strtod(parser.previous.start, NULL);
 
-  emitConstant(NUMBER_VAL(value));
+  if (value <= INT32_MAX && value == (int32_t)value) {
+    return INT_VAL((int32_t)value);
+  }
+  return NUMBER_VAL(value);
+}
+
+static void number(bool canAssign) {
+  emitLiteral(numberValue());
 }
 
 static void or_(bool canAssign) {
@@ -590,30 +856,38 @@ static void or_(bool canAssign) {
 }
 
 static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+  emitLiteral(OBJ_VAL(copyString(parser.previous.start + 1,
+                                 parser.previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+// Finds the instructions that load and store [name] and returns the slot
+// they take, or -1 for a global, which takes its name as a constant.
+static int resolveVariable(Token* name, uint8_t* getOp, uint8_t* setOp) {
+  int arg = resolveLocal(current, name);
   if (arg != -1) {
-    getOp = OP_GET_LOCAL;
-    setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
-    getOp = OP_GET_UPVALUE;
-    setOp = OP_SET_UPVALUE;
+    *getOp = OP_GET_LOCAL;
+    *setOp = OP_SET_LOCAL;
+  } else if ((arg = resolveUpvalue(current, name)) != -1) {
+    *getOp = OP_GET_UPVALUE;
+    *setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
-    getOp = OP_GET_GLOBAL;
-    setOp = OP_SET_GLOBAL;
+    *getOp = OP_GET_GLOBAL;
+    *setOp = OP_SET_GLOBAL;
   }
 
+  return arg;
+}
+
+static void namedVariable(Token name, bool canAssign) {
+  uint8_t getOp, setOp;
+  int arg = resolveVariable(&name, &getOp, &setOp);
+  if (arg == -1) arg = identifierConstant(&name);
+
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitWithArg(setOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitWithArg(getOp, arg);
   }
 }
 
@@ -639,7 +913,7 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   
   namedVariable(syntheticToken("this"), false);
@@ -649,11 +923,11 @@ static void super_(bool canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitWithArg(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitWithArg(OP_GET_SUPER, name);
   }
 
 }
@@ -701,13 +975,23 @@ static void unary(bool canAssign) {
 
   TokenType operatorType = parser.previous.type;
 
-  
+  int operandStart = currentChunk()->count;
 
 
   parsePrecedence(PREC_UNARY);
 
+  Value operand;
+  if (literalAt(operandStart, &operand)) {
+    if (operatorType == TOKEN_BANG) {
+      replaceLiterals(operandStart, BOOL_VAL(isFalseyLiteral(operand)));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      replaceLiterals(operandStart, negateNumber(operand));
+      return;
+    }
+  }
 
-  
   switch (operatorType) {
 
     case TOKEN_BANG: emitByte(OP_NOT); break;
@@ -811,8 +1095,558 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
+typedef Expr* (*PrefixExprFn)(bool canAssign);
+typedef Expr* (*InfixExprFn)(Expr* left, bool canAssign);
+
+// Builders of expression IR, for every token with a rule in rules[]. They
+// parse exactly what the matching emitting rule does.
+typedef struct {
+  PrefixExprFn prefix;
+  InfixExprFn infix;
+} ExprRule;
+
+static Expr* parseExpr(Precedence precedence);
+
+static Expr* literalExpr(Value value) {
+  Expr* expr = newExpr(EXPR_LITERAL, parser.previous.line);
+  expr->constant = value;
+  return expr;
+}
+
+static Expr* variableExpr(Token name, bool canAssign) {
+  uint8_t getOp, setOp;
+  int line = parser.previous.line;
+  int arg = resolveVariable(&name, &getOp, &setOp);
+
+  Expr* expr;
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expr = newExpr(EXPR_ASSIGN, 0);
+    expr->instruction = setOp;
+    expr->value = parseExpr(PREC_ASSIGNMENT);
+    line = parser.previous.line;
+  } else {
+    expr = newExpr(EXPR_VARIABLE, 0);
+    expr->instruction = getOp;
+  }
+
+  expr->line = line;
+  if (arg == -1) {
+    expr->constant = OBJ_VAL(copyString(name.start, name.length));
+  } else {
+    expr->arg = arg;
+  }
+  return expr;
+}
+
+static void argumentsExpr(Expr* expr) {
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      addExprArg(expr, parseExpr(PREC_ASSIGNMENT));
+
+      if (expr->argCount == 256) {
+        error("Can't have more than 255 arguments.");
+      }
+    } while (match(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+}
+
+static Expr* groupingExpr(bool canAssign) {
+  Expr* expr = parseExpr(PREC_ASSIGNMENT);
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+  return expr;
+}
+
+static Expr* literalTokenExpr(bool canAssign) {
+  switch (parser.previous.type) {
+    case TOKEN_FALSE: return literalExpr(BOOL_VAL(false));
+    case TOKEN_TRUE:  return literalExpr(BOOL_VAL(true));
+    default:          return literalExpr(NIL_VAL);
+  }
+}
+
+static Expr* numberExpr(bool canAssign) {
+  return literalExpr(numberValue());
+}
+
+static Expr* stringExpr(bool canAssign) {
+  // The node is what keeps the string alive until it is emitted.
+  Expr* expr = literalExpr(NIL_VAL);
+  expr->constant = OBJ_VAL(copyString(parser.previous.start + 1,
+                                      parser.previous.length - 2));
+  return expr;
+}
+
+static Expr* namedExpr(bool canAssign) {
+  return variableExpr(parser.previous, canAssign);
+}
+
+static Expr* thisExpr(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return literalExpr(NIL_VAL);
+  }
+
+  return variableExpr(parser.previous, false);
+}
+
+static Expr* superExpr(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+
+  Expr* expr = newExpr(EXPR_GET_SUPER, 0);
+  expr->constant = OBJ_VAL(copyString(parser.previous.start,
+                                      parser.previous.length));
+  expr->left = variableExpr(syntheticToken("this"), false);
+
+  if (match(TOKEN_LEFT_PAREN)) {
+    expr->type = EXPR_SUPER_INVOKE;
+    argumentsExpr(expr);
+  }
+
+  expr->right = variableExpr(syntheticToken("super"), false);
+  expr->line = parser.previous.line;
+  return expr;
+}
+
+static Expr* unaryExpr(bool canAssign) {
+  TokenType operatorType = parser.previous.type;
+
+  Expr* operand = parseExpr(PREC_UNARY);
+  Expr* expr = newExpr(EXPR_UNARY, parser.previous.line);
+  expr->token = operatorType;
+  expr->left = operand;
+  return expr;
+}
+
+static Expr* listExpr(bool canAssign) {
+  Expr* expr = newExpr(EXPR_LIST, parser.previous.line);
+
+  do {
+    if (check(TOKEN_RIGHT_BRACKET)) {
+      break;
+    }
+
+    addExprArg(expr, parseExpr(PREC_ASSIGNMENT));
+  } while (match(TOKEN_COMMA));
+
+  consume(TOKEN_RIGHT_BRACKET, "Expected closing ']'");
+  return expr;
+}
+
+static Expr* dictExpr(bool canAssign) {
+  Expr* expr = newExpr(EXPR_DICT, 0);
+
+  do {
+    if (check(TOKEN_RIGHT_BRACE)) {
+      break;
+    }
+
+    addExprArg(expr, parseExpr(PREC_ASSIGNMENT));
+    consume(TOKEN_COLON, "Expect ':'");
+    addExprArg(expr, parseExpr(PREC_ASSIGNMENT));
+  } while (match(TOKEN_COMMA));
+
+  expr->line = parser.previous.line;
+  consume(TOKEN_RIGHT_BRACE, "Expected closing '}'");
+  return expr;
+}
+
+static Expr* binaryExpr(Expr* left, bool canAssign) {
+  TokenType operatorType = parser.previous.type;
+
+  ParseRule* rule = getRule(operatorType);
+  Expr* right = parseExpr((Precedence)(rule->precedence + 1));
+
+  Expr* expr = newExpr(EXPR_BINARY, parser.previous.line);
+  expr->token = operatorType;
+  expr->left = left;
+  expr->right = right;
+  return expr;
+}
+
+static Expr* logicalExpr(Expr* left, bool canAssign) {
+  bool isAnd = parser.previous.type == TOKEN_AND;
+  Expr* expr = newExpr(isAnd ? EXPR_AND : EXPR_OR, parser.previous.line);
+  expr->left = left;
+  expr->right = parseExpr(isAnd ? PREC_AND : PREC_OR);
+  return expr;
+}
+
+static Expr* callExpr(Expr* left, bool canAssign) {
+  Expr* expr = newExpr(EXPR_CALL, 0);
+  expr->left = left;
+  argumentsExpr(expr);
+  expr->line = parser.previous.line;
+  return expr;
+}
+
+static Expr* dotExpr(Expr* left, bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+
+  Expr* expr = newExpr(EXPR_GET_PROPERTY, 0);
+  expr->left = left;
+  expr->constant = OBJ_VAL(copyString(parser.previous.start,
+                                      parser.previous.length));
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expr->type = EXPR_SET_PROPERTY;
+    expr->value = parseExpr(PREC_ASSIGNMENT);
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    expr->type = EXPR_INVOKE;
+    argumentsExpr(expr);
+  }
+
+  expr->line = parser.previous.line;
+  return expr;
+}
+
+static Expr* subscriptExpr(Expr* left, bool canAssign) {
+  Expr* expr = newExpr(EXPR_SUBSCRIPT, 0);
+  expr->left = left;
+  expr->right = parseExpr(PREC_ASSIGNMENT);
+  consume(TOKEN_RIGHT_BRACKET, "Expected closing ']'");
+
+  if (match(TOKEN_EQUAL)) {
+    expr->type = EXPR_SUBSCRIPT_ASSIGN;
+    expr->value = parseExpr(PREC_ASSIGNMENT);
+  }
+
+  expr->line = parser.previous.line;
+  return expr;
+}
+
+ExprRule exprRules[] = {
+  [TOKEN_LEFT_PAREN]    = {groupingExpr,     callExpr},
+  [TOKEN_LEFT_BRACE]    = {dictExpr,         NULL},
+  [TOKEN_LEFT_BRACKET]  = {listExpr,         subscriptExpr},
+  [TOKEN_DOT]           = {NULL,             dotExpr},
+  [TOKEN_MINUS]         = {unaryExpr,        binaryExpr},
+  [TOKEN_PLUS]          = {NULL,             binaryExpr},
+  [TOKEN_SLASH]         = {NULL,             binaryExpr},
+  [TOKEN_STAR]          = {NULL,             binaryExpr},
+  [TOKEN_BANG]          = {unaryExpr,        NULL},
+  [TOKEN_BANG_EQUAL]    = {NULL,             binaryExpr},
+  [TOKEN_EQUAL_EQUAL]   = {NULL,             binaryExpr},
+  [TOKEN_GREATER]       = {NULL,             binaryExpr},
+  [TOKEN_GREATER_EQUAL] = {NULL,             binaryExpr},
+  [TOKEN_LESS]          = {NULL,             binaryExpr},
+  [TOKEN_LESS_EQUAL]    = {NULL,             binaryExpr},
+  [TOKEN_IDENTIFIER]    = {namedExpr,        NULL},
+  [TOKEN_STRING]        = {stringExpr,       NULL},
+  [TOKEN_NUMBER]        = {numberExpr,       NULL},
+  [TOKEN_AND]           = {NULL,             logicalExpr},
+  [TOKEN_FALSE]         = {literalTokenExpr, NULL},
+  [TOKEN_NIL]           = {literalTokenExpr, NULL},
+  [TOKEN_OR]            = {NULL,             logicalExpr},
+  [TOKEN_SUPER]         = {superExpr,        NULL},
+  [TOKEN_THIS]          = {thisExpr,         NULL},
+  [TOKEN_TRUE]          = {literalTokenExpr, NULL},
+  [TOKEN_EOF]           = {NULL,             NULL},
+};
+
+// parsePrecedence() for the IR. Precedences come from the same rules[].
+static Expr* parseExpr(Precedence precedence) {
+  advance();
+  PrefixExprFn prefixRule = exprRules[parser.previous.type].prefix;
+  if (prefixRule == NULL) {
+    error("Expect expression.");
+    return literalExpr(NIL_VAL);
+  }
+
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  Expr* expr = prefixRule(canAssign);
+
+  while (precedence <= getRule(parser.current.type)->precedence) {
+    advance();
+    expr = exprRules[parser.previous.type].infix(expr, canAssign);
+  }
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    error("Invalid assignment target.");
+  }
+
+  return expr;
+}
+
+static void emitExpr(Expr* expr);
+
+// Line of the call whose inlined body is being emitted, or -1.
+static int inlinedLine = -1;
+
+// Tags what is emitted next with the line of [expr]. Code from an inlined
+// body takes the line of the call instead, so that errors point there.
+static void setLine(Expr* expr) {
+  parser.previous.line = inlinedLine != -1 ? inlinedLine : expr->line;
+}
+
+static void emitExprArgs(Expr* expr) {
+  for (int i = 0; i < expr->argCount; i++) {
+    emitExpr(expr->args[i]);
+  }
+}
+
+// The operand of a variable: its slot, or its name for a global.
+static int variableOperand(Expr* expr) {
+  if (expr->instruction == OP_GET_GLOBAL ||
+      expr->instruction == OP_SET_GLOBAL) {
+    return makeConstant(expr->constant);
+  }
+
+  return expr->arg;
+}
+
+// The call or invoke of [expr] once its operands are on the stack. [name]
+// is the constant of the method name.
+static void emitFullCall(Expr* expr, int name) {
+  if (expr->type == EXPR_INLINE_INVOKE) {
+    emitWithArg(OP_INVOKE, name);
+    emitByte(expr->argCount);
+    emitInlineCache();
+  } else {
+    emitBytes(OP_CALL, expr->argCount);
+    current->lastCall = currentChunk()->count;
+  }
+}
+
+// Emits the guard, the inlined body and the full call the guard falls back
+// to. Both leave the result where the call would.
+static void emitInlinedCall(Expr* expr) {
+  emitExpr(expr->left);
+  emitExprArgs(expr);
+  setLine(expr);
+
+  // The guards have no wide form, so past the first 256 constants the
+  // call is left as it is.
+  int function = makeConstant(OBJ_VAL(expr->function));
+  int name = expr->type == EXPR_INLINE_INVOKE
+      ? makeConstant(expr->constant) : 0;
+  if (function > UINT8_MAX || name > UINT8_MAX) {
+    emitFullCall(expr, name);
+    return;
+  }
+
+  if (expr->type == EXPR_INLINE_INVOKE) {
+    emitBytes(OP_GUARD_INVOKE, name);
+    emitBytes(expr->argCount, function);
+  } else {
+    emitBytes(OP_GUARD_CALL, expr->argCount);
+    emitByte(function);
+  }
+  emitBytes(0xff, 0xff);
+  int guard = currentChunk()->count - 2;
+
+  inlinedLine = expr->line;
+  emitExpr(expr->value);
+  inlinedLine = -1;
+  if (expr->bodyIsStatement) emitBytes(OP_POP, OP_NIL);
+
+  int endJump = emitJump(OP_JUMP);
+  patchJump(guard);
+  emitFullCall(expr, name);
+  patchJump(endJump);
+}
+
+// Bytecode backend for the IR. Operands are emitted first, in the order
+// the single-pass compiler would, so both produce the same code for an
+// expression no pass has touched.
+static void emitExpr(Expr* expr) {
+  switch (expr->type) {
+    case EXPR_LITERAL:
+      setLine(expr);
+      emitLiteral(expr->constant);
+      return;
+
+    case EXPR_VARIABLE:
+      setLine(expr);
+      emitWithArg(expr->instruction, variableOperand(expr));
+      return;
+
+    case EXPR_ASSIGN:
+      emitExpr(expr->value);
+      setLine(expr);
+      emitWithArg(expr->instruction, variableOperand(expr));
+      return;
+
+    case EXPR_UNARY:
+      emitExpr(expr->left);
+      setLine(expr);
+      emitByte(expr->token == TOKEN_BANG ? OP_NOT : OP_NEGATE);
+      return;
+
+    case EXPR_BINARY:
+      emitExpr(expr->left);
+      emitExpr(expr->right);
+      setLine(expr);
+      emitBinaryOp(expr->token);
+      return;
+
+    case EXPR_AND: {
+      emitExpr(expr->left);
+      setLine(expr);
+      int endJump = emitJump(OP_JUMP_IF_FALSE);
+      emitByte(OP_POP);
+      emitExpr(expr->right);
+      patchJump(endJump);
+      return;
+    }
+
+    case EXPR_OR: {
+      emitExpr(expr->left);
+      setLine(expr);
+      int elseJump = emitJump(OP_JUMP_IF_FALSE);
+      int endJump = emitJump(OP_JUMP);
+      patchJump(elseJump);
+      emitByte(OP_POP);
+      emitExpr(expr->right);
+      patchJump(endJump);
+      return;
+    }
+
+    case EXPR_CALL:
+      emitExpr(expr->left);
+      emitExprArgs(expr);
+      setLine(expr);
+      emitBytes(OP_CALL, expr->argCount);
+      current->lastCall = currentChunk()->count;
+      return;
+
+    case EXPR_GET_PROPERTY:
+      emitExpr(expr->left);
+      setLine(expr);
+      emitWithArg(OP_GET_PROPERTY, makeConstant(expr->constant));
+      emitInlineCache();
+      return;
+
+    case EXPR_SET_PROPERTY:
+      emitExpr(expr->left);
+      emitExpr(expr->value);
+      setLine(expr);
+      emitWithArg(OP_SET_PROPERTY, makeConstant(expr->constant));
+      emitInlineCache();
+      return;
+
+    case EXPR_INVOKE:
+      emitExpr(expr->left);
+      emitExprArgs(expr);
+      setLine(expr);
+      emitWithArg(OP_INVOKE, makeConstant(expr->constant));
+      emitByte(expr->argCount);
+      emitInlineCache();
+      return;
+
+    case EXPR_GET_SUPER:
+      emitExpr(expr->left);
+      emitExpr(expr->right);
+      setLine(expr);
+      emitWithArg(OP_GET_SUPER, makeConstant(expr->constant));
+      return;
+
+    case EXPR_SUPER_INVOKE:
+      emitExpr(expr->left);
+      emitExprArgs(expr);
+      emitExpr(expr->right);
+      setLine(expr);
+      emitWithArg(OP_SUPER_INVOKE, makeConstant(expr->constant));
+      emitByte(expr->argCount);
+      return;
+
+    case EXPR_SUBSCRIPT:
+      emitExpr(expr->left);
+      emitExpr(expr->right);
+      setLine(expr);
+      emitByte(OP_SUBSCRIPT);
+      return;
+
+    case EXPR_SUBSCRIPT_ASSIGN:
+      emitExpr(expr->left);
+      emitExpr(expr->right);
+      emitExpr(expr->value);
+      setLine(expr);
+      emitByte(OP_SUBSCRIPT_ASSIGN);
+      return;
+
+    case EXPR_LIST:
+      setLine(expr);
+      emitByte(OP_NEW_LIST);
+      for (int i = 0; i < expr->argCount; i++) {
+        emitExpr(expr->args[i]);
+        emitByte(OP_ADD_LIST);
+      }
+      return;
+
+    case EXPR_DICT:
+      emitExprArgs(expr);
+      setLine(expr);
+      emitBytes(OP_NEW_DICT, expr->argCount / 2);
+      return;
+
+    case EXPR_PUSHED:
+      return;
+
+    case EXPR_INLINE_CALL:
+    case EXPR_INLINE_INVOKE:
+      emitInlinedCall(expr);
+      return;
+  }
+}
+
 static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);
+  if (vm.optimizationLevel == 0) {
+    parsePrecedence(PREC_ASSIGNMENT);
+    return;
+  }
+
+  // An expression at the very start of a function or method may turn out
+  // to be its whole body.
+  bool mayBeBody = vm.optimizationLevel >= 2 &&
+                   currentChunk()->count == 0 &&
+                   (current->type == TYPE_FUNCTION ||
+                    current->type == TYPE_METHOD);
+
+  Expr* expr = optimizeExpr(parseExpr(PREC_ASSIGNMENT),
+                            vm.optimizationLevel);
+
+  // The backend borrows the previous token to tag what it emits with the
+  // line of each node. Its errors name no token, since parsing has moved
+  // on from them. Put it back for the rest of the statement.
+  Token previous = parser.previous;
+  parser.previous.type = TOKEN_ERROR;
+  emitExpr(expr);
+  parser.previous = previous;
+
+  if (mayBeBody) {
+    keepExprs();
+    current->inlineBody = expr;
+    current->inlineBodyEnd = currentChunk()->count;
+  } else {
+    freeExprs();
+  }
+}
+
+// Offers the body of the function being compiled to the inliner if it is
+// one small `return` or expression statement that captures nothing.
+static void offerInlineBody() {
+  Chunk* chunk = currentChunk();
+  int end = current->inlineBodyEnd;
+  if (parser.hadError || current->inlineBody == NULL ||
+      current->function->upvalueCount > 0 ||
+      end > INLINE_MAX_CODE || chunk->count != end + 1) {
+    return;
+  }
+
+  uint8_t last = chunk->code[end];
+  if (last != OP_RETURN && last != OP_POP) return;
+
+  addInlineCandidate(current->function, current->inlineBody,
+                     current->type == TYPE_METHOD, last == OP_RETURN);
 }
 
 static void block() {
@@ -823,11 +1657,9 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
-
+// Compiles the parameters of the current function, up to the brace that
+// opens its body.
+static void parameterList() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
   if (!check(TOKEN_RIGHT_PAREN)) {
@@ -837,7 +1669,7 @@ static void function(FunctionType type) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
       
-      uint8_t paramConstant = parseVariable(
+      int paramConstant = parseVariable(
           "Expect parameter name.");
       defineVariable(paramConstant);
     } while (match(TOKEN_COMMA));
@@ -846,21 +1678,107 @@ static void function(FunctionType type) {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+}
 
-  ObjFunction* function = endCompiler();
+// Makes the body of the current function capture [name] if it is a
+// variable of an enclosing function.
+static void captureName(Token* name) {
+  LazyBody* lazy = current->function->lazy;
+  if (resolveLocal(current, name) != -1) return;
+
+  int index = resolveUpvalue(current, name);
+  if (index < lazy->upvalueCount) return;
+
+  if (lazy->upvalueCapacity < lazy->upvalueCount + 1) {
+    int oldCapacity = lazy->upvalueCapacity;
+    lazy->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    lazy->upvalueNames = GROW_ARRAY(ObjString*, lazy->upvalueNames,
+                                    oldCapacity, lazy->upvalueCapacity);
+  }
+
+  ObjString* string = copyString(name->start, name->length);
+  lazy->upvalueNames[lazy->upvalueCount++] = string;
+}
+
+// Skips the body of the current function, up to its closing brace, for
+// compileLazily() to compile on the first call. The closure is still
+// created here, so every name in the body that resolves to a variable of
+// an enclosing function is captured, whether or not the code that
+// mentions it ever runs. [start] and [line] are where the parameter list
+// begins.
+static void skipBody(FunctionType type, int start, int line) {
+  LazyBody* lazy = ALLOCATE(LazyBody, 1);
+  lazy->source = lazySource;
+  lazy->start = start;
+  lazy->line = line;
+  lazy->type = (uint8_t)type;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  lazy->upvalueNames = NULL;
+  lazy->upvalueCount = 0;
+  lazy->upvalueCapacity = 0;
+  current->function->lazy = lazy;
+
+  int depth = 1;
+  TokenType previous = TOKEN_LEFT_BRACE;
+  while (!check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE)) {
+      depth++;
+    } else if (check(TOKEN_RIGHT_BRACE)) {
+      if (--depth == 0) break;
+    } else if ((check(TOKEN_IDENTIFIER) && previous != TOKEN_DOT) ||
+               check(TOKEN_THIS)) {
+      captureName(&parser.current);
+    } else if (check(TOKEN_SUPER)) {
+      Token token = syntheticToken("this");
+      captureName(&token);
+      token = syntheticToken("super");
+      captureName(&token);
+    }
+
+    previous = parser.current.type;
+    advance();
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type, NULL);
+  beginScope();
+
+  const char* start = parser.current.start;
+  int line = parser.current.line;
+  parameterList();
+
+  ObjFunction* function;
+  if (lazySource != NULL) {
+    skipBody(type, (int)(start - sourceStart), line);
+    function = popCompiler();
+  } else {
+    block();
+    offerInlineBody();
+    function = endCompiler();
+  }
 
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  emitWithArg(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    Upvalue* upvalue = &compiler.upvalues[i];
+    uint8_t flags = upvalue->isLocal ? UPVALUE_LOCAL : 0;
+    if (upvalue->index > UINT8_MAX) {
+      emitBytes(flags | UPVALUE_WIDE, upvalue->index >> 8);
+    } else {
+      emitByte(flags);
+    }
+    emitByte(upvalue->index & 0xff);
   }
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
 
   FunctionType type = TYPE_METHOD;
 
@@ -870,17 +1788,17 @@ static void method() {
   }
   
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitWithArg(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
 
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
+  emitWithArg(OP_CLASS, nameConstant);
   defineVariable(nameConstant);
 
   ClassCompiler classCompiler;
@@ -929,10 +1847,10 @@ static void classDeclaration() {
 
 static void enumDeclaration() {
     // check for enum name
-    uint8_t nameConstant = parseVariable("Expect enum name.");
+    int nameConstant = parseVariable("Expect enum name.");
 
     // emit enum op with name
-    emitBytes(OP_ENUM, nameConstant);
+    emitWithArg(OP_ENUM, nameConstant);
 
     // check for '{' before block
     consume(TOKEN_LEFT_BRACE, "Expect '{' before enum body.");
@@ -945,11 +1863,11 @@ static void enumDeclaration() {
         }
 
         consume(TOKEN_IDENTIFIER, "Expect enum value identifier.");
-        uint8_t name = identifierConstant(&parser.previous);
+        int name = identifierConstant(&parser.previous);
 
         consume(TOKEN_EQUAL, "Expect '=' after enum value identifier.");
         expression();
-        emitBytes(OP_SET_ENUM_VALUE, name);
+        emitWithArg(OP_SET_ENUM_VALUE, name);
 
     } while(match(TOKEN_COMMA));
 
@@ -958,7 +1876,7 @@ static void enumDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -983,7 +1901,7 @@ static void varDeclaration() {
 
     if (current->scopeDepth == 0) {
       for (int i = varCount - 1; i >= 0; --i) {
-        uint8_t ident = identifierConstant(&vars[i]);
+        int ident = identifierConstant(&vars[i]);
         defineVariable(ident);
       }
     } else {
@@ -993,7 +1911,7 @@ static void varDeclaration() {
       }
     }
   } else {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
       expression();
@@ -1026,14 +1944,22 @@ static void forStatement() {
   }
 
   int loopStart = currentChunk()->count;
+  int conditionStart = loopStart;
 
   int exitJump = -1;
+  bool neverRuns = false;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    Value condition;
+    if (literalAt(conditionStart, &condition)) {
+      discardCode(conditionStart);
+      neverRuns = isFalseyLiteral(condition);
+    } else {
+      exitJump = emitJump(OP_JUMP_IF_FALSE);
+      emitByte(OP_POP);
+    }
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) {
@@ -1058,14 +1984,35 @@ static void forStatement() {
     emitByte(OP_POP);
   }
 
+  if (neverRuns) discardCode(conditionStart);
+
   endScope();
 }
 
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  int conditionStart = currentChunk()->count;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  // With a literal condition only one branch can run. The other is still
+  // compiled, for its errors, and then dropped.
+  Value condition;
+  if (literalAt(conditionStart, &condition)) {
+    bool taken = !isFalseyLiteral(condition);
+    discardCode(conditionStart);
+
+    statement();
+    if (!taken) discardCode(conditionStart);
+
+    if (match(TOKEN_ELSE)) {
+      int elseStart = currentChunk()->count;
+      statement();
+      if (taken) discardCode(elseStart);
+    }
+    return;
+  }
+
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
   statement();
@@ -1107,6 +2054,12 @@ static void returnStatement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // A call that produces the return value can reuse this frame. The
+    // OP_RETURN stays for paths that jump past the call, like in `a or f()`.
+    if (current->lastCall == currentChunk()->count) {
+      currentChunk()->code[current->lastCall - 2] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -1121,6 +2074,18 @@ static void whileStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  Value condition;
+  if (literalAt(loopStart, &condition)) {
+    discardCode(loopStart);
+    statement();
+    emitLoop(loopStart);
+
+    // A loop that never runs is dropped only now, once emitLoop() has had
+    // its say about the size of the body.
+    if (isFalseyLiteral(condition)) discardCode(loopStart);
+    return;
+  }
+
   int exitJump = emitJump(OP_JUMP_IF_FALSE);
 
   emitByte(OP_POP);
@@ -1228,13 +2193,16 @@ static void statement() {
 ObjFunction* compile(const char* source) {
 
   initScanner(source);
+  sourceStart = source;
+  lazySource = vm.lazyCompile ? copyString(source, (int)strlen(source))
+                              : NULL;
 
 
   Compiler compiler;
 
 
 
-  initCompiler(&compiler, TYPE_SCRIPT);
+  initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
 
 
@@ -1258,14 +2226,80 @@ ObjFunction* compile(const char* source) {
 
 
   ObjFunction* function = endCompiler();
+  freeInlineCandidates();
+  lazySource = NULL;
   return parser.hadError ? NULL : function;
 
 }
 
+bool compileLazily(ObjFunction* function) {
+  LazyBody* lazy = function->lazy;
+  int arity = function->arity;
+
+  sourceStart = lazy->source->chars;
+  lazySource = lazy->source;
+  initScannerAt(sourceStart + lazy->start, lazy->line);
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.name = syntheticToken("");
+  classCompiler.hasSuperclass = lazy->hasSuperclass;
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  parser.hadError = false;
+  parser.panicMode = false;
+  advance();
+
+  Compiler compiler;
+  initCompiler(&compiler, (FunctionType)lazy->type, function);
+
+  // The body compiles into [function] as if nothing were around it. Its
+  // captured variables resolve through [lazy], and functions nested in it
+  // are left for their own first call in turn.
+  compiler.lazy = lazy;
+  function->lazy = NULL;
+  function->arity = 0;
+  beginScope();
+  parameterList();
+  block();
+  endCompiler();
+
+  freeInlineCandidates();
+  currentClass = NULL;
+  lazySource = NULL;
+
+  if (parser.hadError) {
+    freeChunk(&function->chunk);
+    function->arity = arity;
+    function->lazy = lazy;
+    return false;
+  }
+
+  freeLazyBody(lazy);
+  return true;
+}
+
+void markLazyBody(LazyBody* lazy) {
+  markObject((Obj*)lazy->source);
+  for (int i = 0; i < lazy->upvalueCount; i++) {
+    markObject((Obj*)lazy->upvalueNames[i]);
+  }
+}
+
+void freeLazyBody(LazyBody* lazy) {
+  FREE_ARRAY(ObjString*, lazy->upvalueNames, lazy->upvalueCapacity);
+  FREE(LazyBody, lazy);
+}
+
 void markCompilerRoots() {
+  markExprs();
+
+  markObject((Obj*)lazySource);
+
   Compiler* compiler = current;
   while (compiler != NULL) {
     markObject((Obj*)compiler->function);
+    if (compiler->lazy != NULL) markLazyBody(compiler->lazy);
     compiler = compiler->enclosing;
   }
 }
@@ -6,6 +6,13 @@
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+
+// Compiles the body of [function], which was left for its first call. On
+// a compile error the errors are reported and it stays uncompiled.
+bool compileLazily(ObjFunction* function);
+
+void markLazyBody(LazyBody* lazy);
+void freeLazyBody(LazyBody* lazy);
 void markCompilerRoots();
 
 #endif
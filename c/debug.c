@@ -40,6 +40,34 @@ static int invokeInstruction(const char* name, Chunk* chunk,
 }
 
 
+static uint16_t readCacheIndex(Chunk* chunk, int offset) {
+  return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+
+static int propertyInstruction(const char* name, Chunk* chunk,
+                               int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = readCacheIndex(chunk, offset + 2);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' [cache %d]\n", cache);
+  return offset + 4;
+}
+
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = readCacheIndex(chunk, offset + 3);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' [cache %d]\n", cache);
+  return offset + 5;
+}
+
+
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -64,14 +92,151 @@ static int jumpInstruction(const char* name, int sign,
 }
 
 
+static int twoByteInstruction(const char* name, Chunk* chunk,
+                              int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+
+static int localConstantJumpInstruction(const char* name, Chunk* chunk,
+                                        int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' %4d -> %d\n", offset, offset + 5 + jump);
+  return offset + 5;
+}
+
+
+static int guardInstruction(const char* name, Chunk* chunk, int offset) {
+  bool isInvoke = chunk->code[offset] == OP_GUARD_INVOKE;
+  int length = isInvoke ? 6 : 5;
+  uint8_t argCount = chunk->code[offset + length - 4];
+  uint8_t constant = chunk->code[offset + length - 3];
+  uint16_t jump = readCacheIndex(chunk, offset + length - 2);
+  printf("%-16s (%d args) ", name, argCount);
+  if (isInvoke) {
+    printValue(chunk->constants.values[chunk->code[offset + 1]]);
+    printf(" ");
+  }
+  printValue(chunk->constants.values[constant]);
+  printf(" %4d -> %d\n", offset, offset + length + jump);
+  return offset + length;
+}
+
+
+static int registerInstruction(const char* name, Chunk* chunk,
+                               int offset) {
+  uint8_t dest = chunk->code[offset + 1];
+  uint8_t left = chunk->code[offset + 2];
+  uint8_t right = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d\n", name, dest, left, right);
+  return offset + 4;
+}
+
+
+static int registerConstantInstruction(const char* name, Chunk* chunk,
+                                       int offset) {
+  uint8_t dest = chunk->code[offset + 1];
+  uint8_t left = chunk->code[offset + 2];
+  uint8_t constant = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d '", name, dest, left, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+
+static int longConstantInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+  int constant = (chunk->code[offset + 1] << 16) |
+                 (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+
+static const char* wideName(uint8_t instruction) {
+  switch (instruction) {
+    case OP_GET_LOCAL:      return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:      return "OP_SET_LOCAL";
+    case OP_GET_GLOBAL:     return "OP_GET_GLOBAL";
+    case OP_DEFINE_GLOBAL:  return "OP_DEFINE_GLOBAL";
+    case OP_SET_GLOBAL:     return "OP_SET_GLOBAL";
+    case OP_GET_PROPERTY:   return "OP_GET_PROPERTY";
+    case OP_SET_PROPERTY:   return "OP_SET_PROPERTY";
+    case OP_GET_SUPER:      return "OP_GET_SUPER";
+    case OP_INVOKE:         return "OP_INVOKE";
+    case OP_SUPER_INVOKE:   return "OP_SUPER_INVOKE";
+    case OP_CLOSURE:        return "OP_CLOSURE";
+    case OP_CLASS:          return "OP_CLASS";
+    case OP_ENUM:           return "OP_ENUM";
+    case OP_SET_ENUM_VALUE: return "OP_SET_ENUM_VALUE";
+    case OP_METHOD:         return "OP_METHOD";
+    case OP_JUMP:           return "OP_JUMP";
+    case OP_JUMP_IF_FALSE:  return "OP_JUMP_IF_FALSE";
+    case OP_LOOP:           return "OP_LOOP";
+    default:                return "OP_UNKNOWN";
+  }
+}
+
+
+// An instruction behind OP_WIDE, shown with its wide first operand. The
+// operands after it are left out.
+static int wideInstruction(Chunk* chunk, int offset) {
+  uint8_t instruction = chunk->code[offset + 1];
+  int operand = (chunk->code[offset + 2] << 16) |
+                (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("W %-14s ", wideName(instruction));
+
+  switch (instruction) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+      printf("%4d -> %d\n", offset, jumpTarget(chunk, offset));
+      break;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      printf("%4d\n", operand);
+      break;
+    default:
+      printf("%4d '", operand);
+      printValue(chunk->constants.values[operand]);
+      printf("'\n");
+      break;
+  }
+
+  return offset + instructionLength(chunk, offset);
+}
+
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
 
   if (offset > 0 &&
-      chunk->lines[offset] == chunk->lines[offset - 1]) {
+      getLine(chunk, offset) == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", getLine(chunk, offset));
   }
 
   
@@ -80,6 +245,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
     case OP_CONSTANT:
       return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
 
 
     case OP_NIL:
@@ -120,9 +287,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
 
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
 
 
     case OP_GET_SUPER:
@@ -171,15 +338,25 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
 
 
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
 
 
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
 
+    case OP_WIDE:
+      return wideInstruction(chunk, offset);
+
+    case OP_GUARD_CALL:
+      return guardInstruction("OP_GUARD_CALL", chunk, offset);
+    case OP_GUARD_INVOKE:
+      return guardInstruction("OP_GUARD_INVOKE", chunk, offset);
+
 
     case OP_CLOSURE: {
       offset++;
@@ -192,10 +369,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       ObjFunction* function = AS_FUNCTION(
           chunk->constants.values[constant]);
       for (int j = 0; j < function->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
+        int start = offset;
+        int flags = chunk->code[offset++];
         int index = chunk->code[offset++];
+        if (flags & UPVALUE_WIDE) index = (index << 8) | chunk->code[offset++];
         printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
+               start, flags & UPVALUE_LOCAL ? "local" : "upvalue", index);
       }
       
 
@@ -220,6 +399,63 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
 
+    case OP_GET_LOCAL_2:
+      return twoByteInstruction("OP_GET_LOCAL_2", chunk, offset);
+
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+
+    case OP_ADD_LOCAL_CONST:
+      return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+
+    case OP_SUBTRACT_LOCAL_CONST:
+      return localConstantInstruction("OP_SUB_LOCAL_CONST", chunk, offset);
+
+    case OP_LESS_LOCAL_CONST_JUMP:
+      return localConstantJumpInstruction("OP_LESS_LOCAL_JUMP", chunk,
+                                          offset);
+
+    case OP_ADD_RRR:
+      return registerInstruction("OP_ADD_RRR", chunk, offset);
+    case OP_SUBTRACT_RRR:
+      return registerInstruction("OP_SUBTRACT_RRR", chunk, offset);
+    case OP_MULTIPLY_RRR:
+      return registerInstruction("OP_MULTIPLY_RRR", chunk, offset);
+    case OP_DIVIDE_RRR:
+      return registerInstruction("OP_DIVIDE_RRR", chunk, offset);
+    case OP_ADD_RRK:
+      return registerConstantInstruction("OP_ADD_RRK", chunk, offset);
+    case OP_SUBTRACT_RRK:
+      return registerConstantInstruction("OP_SUBTRACT_RRK", chunk, offset);
+    case OP_MULTIPLY_RRK:
+      return registerConstantInstruction("OP_MULTIPLY_RRK", chunk, offset);
+    case OP_DIVIDE_RRK:
+      return registerConstantInstruction("OP_DIVIDE_RRK", chunk, offset);
+    case OP_ADD_INT:
+      return simpleInstruction("OP_ADD_INT", offset);
+    case OP_ADD_DOUBLE:
+      return simpleInstruction("OP_ADD_DOUBLE", offset);
+    case OP_ADD_STRING:
+      return simpleInstruction("OP_ADD_STRING", offset);
+    case OP_SUBTRACT_INT:
+      return simpleInstruction("OP_SUBTRACT_INT", offset);
+    case OP_SUBTRACT_DOUBLE:
+      return simpleInstruction("OP_SUBTRACT_DOUBLE", offset);
+    case OP_MULTIPLY_INT:
+      return simpleInstruction("OP_MULTIPLY_INT", offset);
+    case OP_MULTIPLY_DOUBLE:
+      return simpleInstruction("OP_MULTIPLY_DOUBLE", offset);
+    case OP_DIVIDE_DOUBLE:
+      return simpleInstruction("OP_DIVIDE_DOUBLE", offset);
+    case OP_GREATER_INT:
+      return simpleInstruction("OP_GREATER_INT", offset);
+    case OP_GREATER_DOUBLE:
+      return simpleInstruction("OP_GREATER_DOUBLE", offset);
+    case OP_LESS_INT:
+      return simpleInstruction("OP_LESS_INT", offset);
+    case OP_LESS_DOUBLE:
+      return simpleInstruction("OP_LESS_DOUBLE", offset);
+
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
@@ -0,0 +1,389 @@
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+
+// A pass rewrites an expression tree and returns its new root. Passes may
+// reuse or drop nodes but never free them; they all go in freeExprs().
+typedef Expr* (*PassFn)(Expr* expr);
+
+typedef struct {
+  // Lowest optimization level that runs the pass.
+  int level;
+  PassFn run;
+} Pass;
+
+// A function whose body can replace calls to it.
+typedef struct {
+  ObjFunction* function;
+  Expr* body;
+  bool isMethod;
+  bool returnsValue;
+} InlineCandidate;
+
+static Expr* exprs = NULL;
+
+// Nodes of candidate bodies, which outlive the expression they came from.
+static Expr* keptExprs = NULL;
+
+static InlineCandidate* candidates = NULL;
+static int candidateCount = 0;
+static int candidateCapacity = 0;
+
+Expr* newExpr(ExprType type, int line) {
+  Expr* expr = ALLOCATE(Expr, 1);
+  expr->type = type;
+  expr->line = line;
+  expr->token = TOKEN_EOF;
+  expr->instruction = 0;
+  expr->arg = 0;
+  expr->constant = NIL_VAL;
+  expr->left = NULL;
+  expr->right = NULL;
+  expr->value = NULL;
+  expr->args = NULL;
+  expr->argCount = 0;
+  expr->argCapacity = 0;
+  expr->function = NULL;
+  expr->bodyIsStatement = false;
+
+  expr->next = exprs;
+  exprs = expr;
+  return expr;
+}
+
+void addExprArg(Expr* expr, Expr* arg) {
+  if (expr->argCapacity < expr->argCount + 1) {
+    int oldCapacity = expr->argCapacity;
+    expr->argCapacity = GROW_CAPACITY(oldCapacity);
+    expr->args = GROW_ARRAY(Expr*, expr->args, oldCapacity,
+                            expr->argCapacity);
+  }
+
+  expr->args[expr->argCount++] = arg;
+}
+
+static void freeExprList(Expr** list) {
+  while (*list != NULL) {
+    Expr* next = (*list)->next;
+    FREE_ARRAY(Expr*, (*list)->args, (*list)->argCapacity);
+    FREE(Expr, *list);
+    *list = next;
+  }
+}
+
+void freeExprs() {
+  freeExprList(&exprs);
+}
+
+// Moves every live node to the kept list, which freeInlineCandidates()
+// empties at the end of the compile.
+void keepExprs() {
+  while (exprs != NULL) {
+    Expr* next = exprs->next;
+    exprs->next = keptExprs;
+    keptExprs = exprs;
+    exprs = next;
+  }
+}
+
+// Literals and names are not in any constant pool until they are emitted,
+// so the collector finds them here.
+void markExprs() {
+  for (Expr* expr = exprs; expr != NULL; expr = expr->next) {
+    markValue(expr->constant);
+  }
+  for (Expr* expr = keptExprs; expr != NULL; expr = expr->next) {
+    markValue(expr->constant);
+  }
+  for (int i = 0; i < candidateCount; i++) {
+    markObject((Obj*)candidates[i].function);
+  }
+}
+
+// The inlined body runs on the operands the call site pushed, so it must
+// start by reading exactly those, in the order they were pushed. Walks
+// [expr] in emission order, turning each read of parameter slot [*next]
+// into EXPR_PUSHED, and fails on anything else that happens before the
+// last one, [last], is claimed. Bodies that touch other locals, upvalues
+// or super are never taken.
+static bool claimParameters(Expr* expr, int* next, int last) {
+#define CLAIM(child) \
+    do { if (!claimParameters(child, next, last)) return false; } while (false)
+#define EVENT() do { if (*next <= last) return false; } while (false)
+
+  switch (expr->type) {
+    case EXPR_LITERAL:
+      EVENT();
+      return true;
+
+    case EXPR_VARIABLE:
+      if (expr->instruction == OP_GET_GLOBAL) {
+        EVENT();
+        return true;
+      }
+      if (expr->instruction != OP_GET_LOCAL || expr->arg != *next) {
+        return false;
+      }
+      expr->type = EXPR_PUSHED;
+      (*next)++;
+      return true;
+
+    case EXPR_ASSIGN:
+      if (expr->instruction != OP_SET_GLOBAL) return false;
+      CLAIM(expr->value);
+      EVENT();
+      return true;
+
+    case EXPR_UNARY:
+    case EXPR_GET_PROPERTY:
+      CLAIM(expr->left);
+      EVENT();
+      return true;
+
+    case EXPR_BINARY:
+    case EXPR_SUBSCRIPT:
+      CLAIM(expr->left);
+      CLAIM(expr->right);
+      EVENT();
+      return true;
+
+    case EXPR_AND:
+    case EXPR_OR:
+      CLAIM(expr->left);
+      EVENT();
+      CLAIM(expr->right);
+      return true;
+
+    case EXPR_SET_PROPERTY:
+    case EXPR_SUBSCRIPT_ASSIGN:
+      CLAIM(expr->left);
+      if (expr->right != NULL) CLAIM(expr->right);
+      CLAIM(expr->value);
+      EVENT();
+      return true;
+
+    case EXPR_CALL:
+    case EXPR_INVOKE:
+    case EXPR_DICT:
+      if (expr->left != NULL) CLAIM(expr->left);
+      for (int i = 0; i < expr->argCount; i++) CLAIM(expr->args[i]);
+      EVENT();
+      return true;
+
+    case EXPR_LIST:
+      EVENT();
+      for (int i = 0; i < expr->argCount; i++) CLAIM(expr->args[i]);
+      return true;
+
+    default:
+      return false;
+  }
+
+#undef CLAIM
+#undef EVENT
+}
+
+void addInlineCandidate(ObjFunction* function, Expr* body, bool isMethod,
+                        bool returnsValue) {
+  // Slot zero holds the receiver of a method, but the callee of a function,
+  // which the guard drops.
+  int next = isMethod ? 0 : 1;
+
+  // Every operand the call pushed has to be used, or the ones left over
+  // would end up as the result.
+  if (!claimParameters(body, &next, function->arity) ||
+      next != function->arity + 1) {
+    return;
+  }
+
+  if (candidateCapacity < candidateCount + 1) {
+    int oldCapacity = candidateCapacity;
+    candidateCapacity = GROW_CAPACITY(oldCapacity);
+    candidates = GROW_ARRAY(InlineCandidate, candidates, oldCapacity,
+                            candidateCapacity);
+  }
+
+  InlineCandidate* candidate = &candidates[candidateCount++];
+  candidate->function = function;
+  candidate->body = body;
+  candidate->isMethod = isMethod;
+  candidate->returnsValue = returnsValue;
+}
+
+void freeInlineCandidates() {
+  FREE_ARRAY(InlineCandidate, candidates, candidateCapacity);
+  candidates = NULL;
+  candidateCount = 0;
+  candidateCapacity = 0;
+  freeExprList(&keptExprs);
+}
+
+bool isFalseyLiteral(Value value) {
+  return IS_NIL(value) ||
+         (IS_BOOL(value) && !AS_BOOL(value)) ||
+         (IS_NUMBER(value) && AS_NUMBER(value) == 0) ||
+         (IS_STRING(value) && AS_STRING(value)->length == 0);
+}
+
+// Evaluates binary operator [token] on two literals the way the VM would,
+// storing the result in [result]. Returns false for operands the VM
+// rejects, so that the error still happens at runtime.
+bool foldBinary(TokenType token, Value a, Value b, Value* result) {
+  switch (token) {
+    case TOKEN_BANG_EQUAL:
+      *result = BOOL_VAL(!valuesEqual(a, b));
+      return true;
+    case TOKEN_EQUAL_EQUAL:
+      *result = BOOL_VAL(valuesEqual(a, b));
+      return true;
+    case TOKEN_GREATER:       return greaterNumbers(a, b, result);
+    case TOKEN_LESS:          return lessNumbers(a, b, result);
+    case TOKEN_GREATER_EQUAL:
+      if (!lessNumbers(a, b, result)) return false;
+      *result = BOOL_VAL(!AS_BOOL(*result));
+      return true;
+    case TOKEN_LESS_EQUAL:
+      if (!greaterNumbers(a, b, result)) return false;
+      *result = BOOL_VAL(!AS_BOOL(*result));
+      return true;
+    case TOKEN_PLUS:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+      }
+      return addNumbers(a, b, result);
+    case TOKEN_MINUS:         return subtractNumbers(a, b, result);
+    case TOKEN_STAR:          return multiplyNumbers(a, b, result);
+    case TOKEN_SLASH:         return divideNumbers(a, b, result);
+    default:
+      return false;
+  }
+}
+
+static Expr* toLiteral(Expr* expr, Value value) {
+  expr->type = EXPR_LITERAL;
+  expr->constant = value;
+  return expr;
+}
+
+// Evaluates operators on literals bottom-up, so that folding one operand
+// can make its parent foldable. Unlike the folding the single-pass
+// compiler does, this also sees through `and` and `or` with a literal on
+// the left.
+static Expr* foldConstants(Expr* expr) {
+  if (expr->left != NULL) expr->left = foldConstants(expr->left);
+  if (expr->right != NULL) expr->right = foldConstants(expr->right);
+  if (expr->value != NULL) expr->value = foldConstants(expr->value);
+  for (int i = 0; i < expr->argCount; i++) {
+    expr->args[i] = foldConstants(expr->args[i]);
+  }
+
+  Expr* left = expr->left;
+  Expr* right = expr->right;
+  Value result;
+
+  switch (expr->type) {
+    case EXPR_UNARY:
+      if (left->type != EXPR_LITERAL) break;
+      if (expr->token == TOKEN_BANG) {
+        return toLiteral(expr, BOOL_VAL(isFalseyLiteral(left->constant)));
+      }
+      if (expr->token == TOKEN_MINUS && IS_NUMBER(left->constant)) {
+        return toLiteral(expr, negateNumber(left->constant));
+      }
+      break;
+
+    case EXPR_BINARY:
+      if (left->type == EXPR_LITERAL && right->type == EXPR_LITERAL &&
+          foldBinary(expr->token, left->constant, right->constant,
+                     &result)) {
+        return toLiteral(expr, result);
+      }
+      break;
+
+    case EXPR_AND:
+      if (left->type != EXPR_LITERAL) break;
+      return isFalseyLiteral(left->constant) ? left : right;
+
+    case EXPR_OR:
+      if (left->type != EXPR_LITERAL) break;
+      return isFalseyLiteral(left->constant) ? right : left;
+
+    default:
+      break;
+  }
+
+  return expr;
+}
+
+// The latest candidate named [name] that takes [argCount] arguments. A
+// later definition usually replaces an earlier one, and the guard catches
+// the cases where it does not.
+static InlineCandidate* findCandidate(Value name, int argCount,
+                                      bool isMethod) {
+  if (!IS_STRING(name)) return NULL;
+
+  for (int i = candidateCount - 1; i >= 0; i--) {
+    InlineCandidate* candidate = &candidates[i];
+    if (candidate->isMethod == isMethod &&
+        candidate->function->arity == argCount &&
+        candidate->function->name == AS_STRING(name)) {
+      return candidate;
+    }
+  }
+
+  return NULL;
+}
+
+// Replaces calls to globals and invokes of methods that have a candidate
+// with the candidate's body, behind a guard that checks the callee.
+static Expr* inlineCalls(Expr* expr) {
+  if (expr->left != NULL) expr->left = inlineCalls(expr->left);
+  if (expr->right != NULL) expr->right = inlineCalls(expr->right);
+  if (expr->value != NULL) expr->value = inlineCalls(expr->value);
+  for (int i = 0; i < expr->argCount; i++) {
+    expr->args[i] = inlineCalls(expr->args[i]);
+  }
+
+  InlineCandidate* candidate = NULL;
+  if (expr->type == EXPR_CALL && expr->left->type == EXPR_VARIABLE &&
+      expr->left->instruction == OP_GET_GLOBAL) {
+    candidate = findCandidate(expr->left->constant, expr->argCount, false);
+    if (candidate != NULL) expr->type = EXPR_INLINE_CALL;
+  } else if (expr->type == EXPR_INVOKE) {
+    candidate = findCandidate(expr->constant, expr->argCount, true);
+    if (candidate != NULL) expr->type = EXPR_INLINE_INVOKE;
+  }
+
+  if (candidate != NULL) {
+    expr->function = candidate->function;
+    expr->value = candidate->body;
+    expr->bodyIsStatement = !candidate->returnsValue;
+  }
+
+  return expr;
+}
+
+static Pass passes[] = {
+  {1, foldConstants},
+  {2, inlineCalls},
+};
+
+// Runs every pass enabled at [level] over [expr], in order.
+Expr* optimizeExpr(Expr* expr, int level) {
+  for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+    if (level >= passes[i].level) expr = passes[i].run(expr);
+  }
+
+  return expr;
+}
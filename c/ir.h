@@ -0,0 +1,100 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "common.h"
+#include "object.h"
+#include "scanner.h"
+
+typedef enum {
+  EXPR_LITERAL,
+  EXPR_VARIABLE,
+  EXPR_ASSIGN,
+  EXPR_UNARY,
+  EXPR_BINARY,
+  EXPR_AND,
+  EXPR_OR,
+  EXPR_CALL,
+  EXPR_GET_PROPERTY,
+  EXPR_SET_PROPERTY,
+  EXPR_INVOKE,
+  EXPR_GET_SUPER,
+  EXPR_SUPER_INVOKE,
+  EXPR_SUBSCRIPT,
+  EXPR_SUBSCRIPT_ASSIGN,
+  EXPR_LIST,
+  EXPR_DICT,
+
+  // A parameter of an inlined body, already on the stack where the call
+  // site pushed it.
+  EXPR_PUSHED,
+  EXPR_INLINE_CALL,
+  EXPR_INLINE_INVOKE
+} ExprType;
+
+// Largest function body, in bytes of bytecode, that gets inlined.
+#define INLINE_MAX_CODE 16
+
+// A node of expression IR. Variables are resolved while parsing, so a node
+// carries the instruction it loads or stores with and the slot it uses.
+// Literals and the names of globals, properties, invokes and super wait in
+// [constant] until emission to enter the constant pool, so that folded
+// operands never take up a slot and inlined bodies can be emitted into
+// any chunk.
+typedef struct Expr {
+  ExprType type;
+
+  // Line the instruction for this node is reported on.
+  int line;
+
+  // Operator token of unary and binary nodes.
+  TokenType token;
+
+  // Get or set instruction of variables, and the slot of locals and
+  // upvalues.
+  uint8_t instruction;
+  int arg;
+
+  Value constant;
+
+  // Operand of unary nodes, left operand of binary and logical ones, the
+  // callee, or the receiver of a property, invoke or subscript. For super
+  // nodes, the `this` and `super` variables.
+  struct Expr* left;
+  struct Expr* right;
+
+  // Value stored by assignments, or the body of an inlined call.
+  struct Expr* value;
+
+  // Arguments of calls and invokes, elements of lists, and the keys and
+  // values of dicts in turn.
+  struct Expr** args;
+  int argCount;
+  int argCapacity;
+
+  // Function an inlined call guards on, and whether its body is an
+  // expression statement rather than a returned value.
+  ObjFunction* function;
+  bool bodyIsStatement;
+
+  // Every node lives until freeExprs() on this list.
+  struct Expr* next;
+} Expr;
+
+Expr* newExpr(ExprType type, int line);
+void addExprArg(Expr* expr, Expr* arg);
+void freeExprs();
+void keepExprs();
+void markExprs();
+
+// Offers [body], the only expression of [function], to the inliner. It is
+// taken if it reads the parameters before anything else, in order.
+void addInlineCandidate(ObjFunction* function, Expr* body,
+                        bool isMethod, bool returnsValue);
+void freeInlineCandidates();
+
+Expr* optimizeExpr(Expr* expr, int level);
+
+bool isFalseyLiteral(Value value);
+bool foldBinary(TokenType token, Value a, Value b, Value* result);
+
+#endif
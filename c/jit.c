@@ -0,0 +1,1500 @@
+// For MAP_ANONYMOUS under -std=c99.
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+// A template JIT: each bytecode instruction becomes a fixed sequence of
+// x86-64 code. Values stay in memory exactly where the interpreter keeps
+// them, so compiled code can be entered at any instruction and can hand a
+// frame back to the interpreter at any instruction. Only the stack top is
+// cached in a register. Instructions with a common fast path (arithmetic,
+// comparisons, locals, cached fields) are emitted inline behind type guards;
+// everything else calls one of the jit* helpers in vm.c. Calls to functions
+// that are compiled too push the frame inline and go straight to their code.
+//
+// Register assignment, all callee-saved:
+//
+//   rbx  frame->slots
+//   r12  stack top
+//   r13  constant table
+//   r14  QNAN, for number checks
+//   r15  the CallFrame, for recording ip
+
+typedef enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+#define SLOTS     RBX
+#define SP        R12
+#define CONSTANTS R13
+#define QNAN_BITS R14
+#define FRAME     R15
+
+typedef enum {
+  CC_O = 0x0,
+  CC_B = 0x2,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_S = 0x8,
+  CC_L = 0xc,
+  CC_GE = 0xd,
+  CC_LE = 0xe,
+  CC_G = 0xf,
+} Condition;
+
+// Jump targets that are not bytecode offsets.
+#define EXIT_BAIL    -1
+#define EXIT_SUSPEND -2
+#define EXIT_ERROR   -3
+#define EXIT_RETURN  -4
+#define EXIT_COUNT    4
+
+typedef struct {
+  int at;
+  int target;
+} Fixup;
+
+typedef struct {
+  ObjFunction* function;
+
+  uint8_t* code;
+  int count;
+  int capacity;
+
+  Fixup* fixups;
+  int fixupCount;
+  int fixupCapacity;
+
+  // Native offset of each bytecode instruction, or -1.
+  int* labels;
+} Assembler;
+
+typedef JitStatus (*JitEntry)(CallFrame* frame, Value* stackTop,
+                              Value* constants, void* target);
+
+static void emit8(Assembler* as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = realloc(as->code, as->capacity);
+    if (as->code == NULL) exit(1);
+  }
+
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit8(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit8(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emitRex(Assembler* as, int reg, int rm) {
+  emit8(as, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// The ModRM byte (plus SIB and displacement) for [base + disp].
+static void emitAddress(Assembler* as, int reg, int base, int32_t disp) {
+  int mod;
+  if (disp == 0 && (base & 7) != RBP) {
+    mod = 0;
+  } else if (disp >= -128 && disp <= 127) {
+    mod = 1;
+  } else {
+    mod = 2;
+  }
+
+  emit8(as, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (base & 7)));
+  if ((base & 7) == RSP) emit8(as, 0x24);
+
+  if (mod == 1) {
+    emit8(as, (uint8_t)disp);
+  } else if (mod == 2) {
+    emit32(as, (uint32_t)disp);
+  }
+}
+
+// <opcode> reg, [base + disp] with a 64-bit operand size.
+static void emitMemory(Assembler* as, uint8_t opcode, int reg, int base,
+                       int32_t disp) {
+  emitRex(as, reg, base);
+  emit8(as, opcode);
+  emitAddress(as, reg, base, disp);
+}
+
+// The same with a 32-bit operand size.
+static void emitMemory32(Assembler* as, uint8_t opcode, int reg, int base,
+                         int32_t disp) {
+  if (reg >= R8 || base >= R8) {
+    emit8(as, 0x40 | ((reg >> 3) << 2) | (base >> 3));
+  }
+  emit8(as, opcode);
+  emitAddress(as, reg, base, disp);
+}
+
+// cmp [base + disp], imm8 on a 32-bit or 64-bit operand.
+static void emitCompareMemory(Assembler* as, bool wide, int base,
+                              int32_t disp, int8_t value) {
+  if (wide) {
+    emitRex(as, 0, base);
+  } else if (base >= R8) {
+    emit8(as, 0x41);
+  }
+  emit8(as, 0x83);
+  emitAddress(as, 7, base, disp);
+  emit8(as, (uint8_t)value);
+}
+
+// cmp byte [base + disp], imm8 for the low eight registers.
+static void emitCompareByte(Assembler* as, int base, int32_t disp,
+                            int8_t value) {
+  emit8(as, 0x80);
+  emitAddress(as, 7, base, disp);
+  emit8(as, (uint8_t)value);
+}
+
+// <opcode> reg, [base + index * 8] for the low eight registers.
+static void emitIndexed(Assembler* as, uint8_t opcode, int reg, int base,
+                        int index) {
+  emit8(as, 0x48);
+  emit8(as, opcode);
+  emit8(as, (uint8_t)((reg << 3) | RSP));
+  emit8(as, (uint8_t)(0xc0 | (index << 3) | base));
+}
+
+static void emitLoad(Assembler* as, int reg, int base, int32_t disp) {
+  emitMemory(as, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Assembler* as, int base, int32_t disp, int reg) {
+  emitMemory(as, 0x89, reg, base, disp);
+}
+
+// <opcode> rm, reg between two 64-bit registers.
+static void emitRegisters(Assembler* as, uint8_t opcode, int rm, int reg) {
+  emitRex(as, reg, rm);
+  emit8(as, opcode);
+  emit8(as, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// The same on the low 32 bits, for the low eight registers.
+static void emitRegisters32(Assembler* as, uint8_t opcode, int rm, int reg) {
+  emit8(as, opcode);
+  emit8(as, (uint8_t)(0xc0 | (reg << 3) | rm));
+}
+
+#define MOV 0x89
+#define ADD 0x01
+#define SUB 0x29
+#define AND 0x21
+#define OR  0x09
+#define XOR 0x31
+#define CMP 0x39
+
+static void emitMoveImmediate(Assembler* as, int reg, uint64_t value) {
+  emitRex(as, 0, reg);
+  emit8(as, (uint8_t)(0xb8 | (reg & 7)));
+  emit64(as, value);
+}
+
+static void emitAddImmediate(Assembler* as, int reg, int8_t value) {
+  emitRex(as, 0, reg);
+  emit8(as, 0x83);
+  emit8(as, (uint8_t)(0xc0 | (reg & 7)));
+  emit8(as, (uint8_t)value);
+}
+
+static void emitPush(Assembler* as, int reg) {
+  emitStore(as, SP, 0, reg);
+  emitAddImmediate(as, SP, 8);
+}
+
+static void emitPop(Assembler* as, int reg) {
+  emitAddImmediate(as, SP, -8);
+  emitLoad(as, reg, SP, 0);
+}
+
+static void emitPeek(Assembler* as, int reg, int distance) {
+  emitLoad(as, reg, SP, -8 * (distance + 1));
+}
+
+static void emitLocal(Assembler* as, int reg, int slot) {
+  emitLoad(as, reg, SLOTS, 8 * slot);
+}
+
+static void emitConstant(Assembler* as, int reg, int constant) {
+  emitLoad(as, reg, CONSTANTS, 8 * constant);
+}
+
+// movq xmm, reg and back.
+static void emitToDouble(Assembler* as, int xmm, int reg) {
+  emit8(as, 0x66);
+  emitRex(as, xmm, reg);
+  emit8(as, 0x0f);
+  emit8(as, 0x6e);
+  emit8(as, (uint8_t)(0xc0 | (xmm << 3) | (reg & 7)));
+}
+
+static void emitFromDouble(Assembler* as, int reg, int xmm) {
+  emit8(as, 0x66);
+  emitRex(as, xmm, reg);
+  emit8(as, 0x0f);
+  emit8(as, 0x7e);
+  emit8(as, (uint8_t)(0xc0 | (xmm << 3) | (reg & 7)));
+}
+
+// cvtsi2sd xmm, reg32.
+static void emitIntToDouble(Assembler* as, int xmm, int reg) {
+  emit8(as, 0xf2);
+  if (reg >= R8) emit8(as, 0x41);
+  emit8(as, 0x0f);
+  emit8(as, 0x2a);
+  emit8(as, (uint8_t)(0xc0 | (xmm << 3) | (reg & 7)));
+}
+
+// addsd/subsd/mulsd/divsd xmm0, xmm1.
+static void emitDoubleOp(Assembler* as, uint8_t opcode) {
+  emit8(as, 0xf2);
+  emit8(as, 0x0f);
+  emit8(as, opcode);
+  emit8(as, 0xc1);
+}
+
+// ucomisd xmmA, xmmB.
+static void emitDoubleCompare(Assembler* as, int a, int b) {
+  emit8(as, 0x66);
+  emit8(as, 0x0f);
+  emit8(as, 0x2e);
+  emit8(as, (uint8_t)(0xc0 | (a << 3) | b));
+}
+
+// setcc al, then turns al into a Lox boolean in rax.
+static void emitBoolFromFlags(Assembler* as, Condition cc) {
+  emit8(as, 0x0f);
+  emit8(as, 0x90 | cc);
+  emit8(as, 0xc0);
+  emit8(as, 0x0f);  // movzx eax, al
+  emit8(as, 0xb6);
+  emit8(as, 0xc0);
+  emitMoveImmediate(as, RCX, FALSE_VAL);
+  emitRegisters(as, OR, RAX, RCX);
+}
+
+static void addFixup(Assembler* as, int target) {
+  if (as->fixupCapacity < as->fixupCount + 1) {
+    as->fixupCapacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+    as->fixups = realloc(as->fixups, sizeof(Fixup) * as->fixupCapacity);
+    if (as->fixups == NULL) exit(1);
+  }
+
+  as->fixups[as->fixupCount].at = as->count;
+  as->fixups[as->fixupCount].target = target;
+  as->fixupCount++;
+  emit32(as, 0);
+}
+
+// Jumps to a bytecode offset or one of the EXIT_ labels.
+static void emitJumpTo(Assembler* as, int target) {
+  emit8(as, 0xe9);
+  addFixup(as, target);
+}
+
+static void emitBranchTo(Assembler* as, Condition cc, int target) {
+  emit8(as, 0x0f);
+  emit8(as, 0x80 | cc);
+  addFixup(as, target);
+}
+
+// Forward jumps within an instruction's template, patched by patchHere().
+static int emitJump(Assembler* as) {
+  emit8(as, 0xe9);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static int emitBranch(Assembler* as, Condition cc) {
+  emit8(as, 0x0f);
+  emit8(as, 0x80 | cc);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void patchHere(Assembler* as, int at) {
+  int32_t offset = as->count - (at + 4);
+  memcpy(&as->code[at], &offset, 4);
+}
+
+static void emitStoreIp(Assembler* as, uint8_t* ip) {
+  emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)ip);
+  emitStore(as, FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+// Leaves compiled code so the interpreter resumes at [ip].
+static void emitBail(Assembler* as, uint8_t* ip) {
+  emitStoreIp(as, ip);
+  emitJumpTo(as, EXIT_BAIL);
+}
+
+// Branches with [cc] after "cmp value & QNAN, QNAN": CC_E if [reg] is
+// not a double, CC_NE if it is. Clobbers rdx.
+static int emitDoubleCheck(Assembler* as, int reg, Condition cc) {
+  emitRegisters(as, MOV, RDX, reg);
+  emitRegisters(as, AND, RDX, QNAN_BITS);
+  emitRegisters(as, CMP, RDX, QNAN_BITS);
+  return emitBranch(as, cc);
+}
+
+// Branches with CC_NE unless [reg] is a tagged int. Clobbers rdx.
+static int emitNotInt(Assembler* as, int reg) {
+  emitRegisters(as, MOV, RDX, reg);
+  emit8(as, 0x48);  // shr rdx, 32
+  emit8(as, 0xc1);
+  emit8(as, 0xea);
+  emit8(as, 32);
+  emit8(as, 0x81);  // cmp edx, imm32
+  emit8(as, 0xfa);
+  emit32(as, (uint32_t)((QNAN | TAG_INT) >> 32));
+  return emitBranch(as, CC_NE);
+}
+
+// Turns the int payload in eax into a tagged int in rax. Clobbers rcx.
+static void emitBoxInt(Assembler* as) {
+  emitMoveImmediate(as, RCX, QNAN | TAG_INT);
+  emitRegisters(as, OR, RAX, RCX);
+}
+
+// Loads the number in [reg] into [xmm], converting ints. Returns the
+// branch taken when it is not a number. Clobbers rdx.
+static int emitToNumber(Assembler* as, int xmm, int reg) {
+  int notInt = emitNotInt(as, reg);
+  emitIntToDouble(as, xmm, reg);
+  int done = emitJump(as);
+
+  patchHere(as, notInt);
+  int notNumber = emitDoubleCheck(as, reg, CC_E);
+  emitToDouble(as, xmm, reg);
+  patchHere(as, done);
+  return notNumber;
+}
+
+// Calls a helper in vm.c. The stack top is written back first and re-read
+// afterwards, and [ip] is recorded so errors and stack traces point at
+// the right line.
+static void emitCall(Assembler* as, uint8_t* ip, void (*helper)(void)) {
+  emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitStore(as, RAX, 0, SP);
+  emitStoreIp(as, ip);
+
+  emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+  emit8(as, 0xff);  // call rax
+  emit8(as, 0xd0);
+
+  emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitLoad(as, SP, RCX, 0);
+}
+
+// Leaves with JIT_ERROR if the helper just called returned false.
+static void emitCheck(Assembler* as) {
+  emit8(as, 0x84);  // test al, al
+  emit8(as, 0xc0);
+  emitBranchTo(as, CC_E, EXIT_ERROR);
+}
+
+// After jitCall or jitInvoke, leaves with JIT_ERROR on NULL and suspends
+// the frame if the callee still has to run in the interpreter. Growing the
+// frame array also moves this frame, which suspends it too.
+static void emitCallCheck(Assembler* as) {
+  emitRegisters(as, 0x85, RAX, RAX);  // test rax, rax
+  emitBranchTo(as, CC_E, EXIT_ERROR);
+  emitRegisters(as, CMP, RAX, FRAME);
+  emitBranchTo(as, CC_NE, EXIT_SUSPEND);
+
+  // The call may have moved the value stack.
+  emitLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+#define HELPER(function) ((void (*)(void))(function))
+
+// Arguments a call can pass and still go straight to compiled code, so
+// that the callee's slots are in reach of an 8-bit displacement.
+#define DIRECT_CALL_MAX_ARGS 15
+
+// Most branches to the generic call a direct call site has.
+#define DIRECT_CALL_CHECKS 10
+
+// Code that keeps failing its guards is slower than the interpreter. It
+// cannot be freed while activations of it may still be running, so it is
+// only switched off.
+static void countBailout(JitCode* jit) {
+  if (++jit->bailouts == JIT_MAX_BAILOUTS) jit->disabled = true;
+}
+
+// Counts a bailout of the compiled code whose frame is on top, which a
+// direct call reports to its caller instead of to jitRun().
+static void calleeBailed() {
+  countBailout(vm.frames[vm.frameCount - 1].closure->function->jit);
+}
+
+// add dword [r8 + disp], imm8.
+static void emitAddVm32(Assembler* as, int32_t disp, int8_t value) {
+  emit8(as, 0x41);
+  emit8(as, 0x83);
+  emitAddress(as, 0, R8, disp);
+  emit8(as, (uint8_t)value);
+}
+
+// Calls the closure in rax by pushing its frame and running its compiled
+// code from here, without going through jitCall, call() and jitRun(). This
+// is what makes compiling short functions pay. Anything the fast path does
+// not handle (an uncompiled or disabled callee, an arity mismatch, a full
+// frame array or value stack, deep nesting) takes one of the branches
+// added to [slow], which the caller sends to the generic call.
+static void emitDirectCall(Assembler* as, int argCount, uint8_t* next,
+                           int slow[DIRECT_CALL_CHECKS], int* checkCount) {
+  int checks = *checkCount;
+
+  // rsi = function, r11 = its compiled code.
+  emitLoad(as, RSI, RAX, offsetof(ObjClosure, function));
+  emitLoad(as, R11, RSI, offsetof(ObjFunction, jit));
+  emitRegisters(as, 0x85, R11, R11);  // test r11, r11
+  slow[checks++] = emitBranch(as, CC_E);
+  emitCompareMemory(as, false, RSI, offsetof(ObjFunction, arity), argCount);
+  slow[checks++] = emitBranch(as, CC_NE);
+  emit8(as, 0x41);                    // cmp byte [r11 + disabled], 0
+  emitCompareByte(as, R11 & 7, offsetof(JitCode, disabled), 0);
+  slow[checks++] = emitBranch(as, CC_NE);
+
+  // The room call() would check for: a free CallFrame, below the depth
+  // limits, and the callee's slots within the value stack.
+  emitMoveImmediate(as, R8, (uint64_t)(uintptr_t)&vm);
+  emitMemory32(as, 0x8b, RDX, R8, offsetof(VM, frameCount));
+  emitMemory32(as, 0x3b, RDX, R8, offsetof(VM, frameCapacity));
+  slow[checks++] = emitBranch(as, CC_GE);
+  emitMemory32(as, 0x3b, RDX, R8, offsetof(VM, maxFrames));
+  slow[checks++] = emitBranch(as, CC_GE);
+  emitMemory32(as, 0x8b, RCX, R8, offsetof(VM, jitDepth));
+  emit8(as, 0x81);                    // cmp ecx, JIT_MAX_DEPTH
+  emit8(as, 0xf9);
+  emit32(as, JIT_MAX_DEPTH);
+  slow[checks++] = emitBranch(as, CC_GE);
+
+  // r9 = the callee's slots, r10 = the end of the room it needs.
+  emitRegisters(as, MOV, R9, SP);
+  emitAddImmediate(as, R9, (int8_t)(-8 * (argCount + 1)));
+  emitMemory(as, 0x63, R10, RSI, offsetof(ObjFunction, maxSlots));
+  emit8(as, 0x49);                    // shl r10, 3
+  emit8(as, 0xc1);
+  emit8(as, 0xe2);
+  emit8(as, 3);
+  emitRegisters(as, ADD, R10, R9);
+  emitAddImmediate(as, R10, 8 * STACK_RESERVE);
+  emitMemory(as, 0x63, RCX, R8, offsetof(VM, stackCapacity));
+  emit8(as, 0x48);                    // shl rcx, 3
+  emit8(as, 0xc1);
+  emit8(as, 0xe1);
+  emit8(as, 3);
+  emitMemory(as, 0x03, RCX, R8, offsetof(VM, stack));
+  emitRegisters(as, CMP, R10, RCX);
+  slow[checks++] = emitBranch(as, CC_A);
+
+  // rdx = &vm.frames[vm.frameCount].
+  emit8(as, 0x48);                    // imul rdx, rdx, sizeof(CallFrame)
+  emit8(as, 0x6b);
+  emit8(as, 0xd2);
+  emit8(as, sizeof(CallFrame));
+  emitMemory(as, 0x03, RDX, R8, offsetof(VM, frames));
+  emitStore(as, RDX, offsetof(CallFrame, closure), RAX);
+  emitLoad(as, RCX, RSI, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+  emitStore(as, RDX, offsetof(CallFrame, ip), RCX);
+  emitStore(as, RDX, offsetof(CallFrame, slots), R9);
+  emitAddVm32(as, offsetof(VM, frameCount), 1);
+  emitAddVm32(as, offsetof(VM, jitDepth), 1);
+
+  // If the callee leaves its frame to the interpreter, this one resumes
+  // after the call too.
+  emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)next);
+  emitStore(as, FRAME, offsetof(CallFrame, ip), RCX);
+
+  // Enter the callee as jitRun() would, at its first instruction.
+  emitRegisters(as, MOV, RDI, RDX);
+  emitLoad(as, RDX, RSI, offsetof(ObjFunction, chunk) +
+           offsetof(Chunk, constants) + offsetof(ValueArray, values));
+  emitRegisters(as, MOV, RSI, SP);
+  emitLoad(as, RCX, R11, offsetof(JitCode, entries));
+  emitMemory32(as, 0x8b, RCX, RCX, 0);
+  emitMemory(as, 0x03, RCX, R11, offsetof(JitCode, code));
+  emitLoad(as, RAX, R11, offsetof(JitCode, code));
+  emit8(as, 0xff);                    // call rax
+  emit8(as, 0xd0);
+
+  emitMoveImmediate(as, R8, (uint64_t)(uintptr_t)&vm);
+  emitAddVm32(as, offsetof(VM, jitDepth), -1);
+  emitLoad(as, SP, R8, offsetof(VM, stackTop));
+
+  emitRegisters32(as, 0x85, RAX, RAX);  // test eax, eax
+  int returned = emitBranch(as, CC_E);
+  emit8(as, 0x83);                    // cmp eax, JIT_ERROR
+  emit8(as, 0xf8);
+  emit8(as, JIT_ERROR);
+  emitBranchTo(as, CC_E, EXIT_ERROR);
+  emit8(as, 0x83);                    // cmp eax, JIT_BAILED
+  emit8(as, 0xf8);
+  emit8(as, JIT_BAILED);
+  emitBranchTo(as, CC_NE, EXIT_SUSPEND);
+  emitCall(as, next, HELPER(calleeBailed));
+  emitJumpTo(as, EXIT_SUSPEND);
+
+  // The callee may have moved the value stack.
+  patchHere(as, returned);
+  emitLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+
+  *checkCount = checks;
+}
+
+static ObjString* constantString(Assembler* as, int constant) {
+  return AS_STRING(as->function->chunk.constants.values[constant]);
+}
+
+static ObjFunction* constantFunction(Assembler* as, int constant) {
+  return AS_FUNCTION(as->function->chunk.constants.values[constant]);
+}
+
+static InlineCache* inlineCache(Assembler* as, uint8_t* operands) {
+  return &as->function->chunk.caches[(operands[0] << 8) | operands[1]];
+}
+
+// Bails out unless [reg] holds an instance, leaving the ObjInstance* in rdx.
+// Clobbers rcx.
+static void emitInstanceGuard(Assembler* as, int reg, uint8_t* ip) {
+  emitMoveImmediate(as, RCX, SIGN_BIT | QNAN);
+  emitRegisters(as, MOV, RDX, reg);
+  emitRegisters(as, AND, RDX, RCX);
+  emitRegisters(as, CMP, RDX, RCX);
+  int isObject = emitBranch(as, CC_E);
+  emitBail(as, ip);
+  patchHere(as, isObject);
+
+  emitMoveImmediate(as, RCX, ~(SIGN_BIT | QNAN));
+  emitRegisters(as, MOV, RDX, reg);
+  emitRegisters(as, AND, RDX, RCX);
+
+  emitCompareMemory(as, false, RDX, offsetof(Obj, type), OBJ_INSTANCE);
+  int isInstance = emitBranch(as, CC_E);
+  emitBail(as, ip);
+  patchHere(as, isInstance);
+}
+
+// rax <op> rcx for two numbers, leaving the result in rax. Non-numbers jump
+// to the returned branches, which the caller patches. Two ints are worked
+// on in 32 bits, falling back to doubles wherever the interpreter does.
+static void emitArithmetic(Assembler* as, OpCode op, int branches[2]) {
+  int notInt[2];
+  notInt[0] = emitNotInt(as, RAX);
+  notInt[1] = emitNotInt(as, RCX);
+
+  int fallback[2] = { -1, -1 };
+  if (op == OP_DIVIDE) {
+    // Only exact quotients by a positive divisor stay ints.
+    emitRegisters32(as, 0x85, RCX, RCX);  // test ecx, ecx
+    fallback[0] = emitBranch(as, CC_LE);
+    emitRegisters(as, MOV, RSI, RAX);
+    emit8(as, 0x99);  // cdq
+    emit8(as, 0xf7);  // idiv ecx
+    emit8(as, 0xf9);
+    emitRegisters32(as, 0x85, RDX, RDX);
+    int exact = emitBranch(as, CC_E);
+    emitRegisters(as, MOV, RAX, RSI);
+    fallback[1] = emitJump(as);
+    patchHere(as, exact);
+  } else {
+    emitRegisters32(as, MOV, RDX, RAX);
+    if (op == OP_ADD) {
+      emitRegisters32(as, ADD, RDX, RCX);
+    } else if (op == OP_SUBTRACT) {
+      emitRegisters32(as, SUB, RDX, RCX);
+    } else {
+      emit8(as, 0x0f);  // imul edx, ecx
+      emit8(as, 0xaf);
+      emit8(as, 0xd1);
+    }
+    fallback[0] = emitBranch(as, CC_O);
+
+    if (op == OP_MULTIPLY) {
+      // A zero product is -0 if either factor was negative.
+      emitRegisters32(as, 0x85, RDX, RDX);
+      int nonZero = emitBranch(as, CC_NE);
+      emitRegisters32(as, MOV, RDX, RAX);
+      emitRegisters32(as, OR, RDX, RCX);
+      fallback[1] = emitBranch(as, CC_S);
+      emitRegisters32(as, XOR, RDX, RDX);
+      patchHere(as, nonZero);
+    }
+    emitRegisters32(as, MOV, RAX, RDX);
+  }
+  emitBoxInt(as);
+  int done = emitJump(as);
+
+  patchHere(as, notInt[0]);
+  patchHere(as, notInt[1]);
+  for (int i = 0; i < 2; i++) {
+    if (fallback[i] != -1) patchHere(as, fallback[i]);
+  }
+
+  branches[0] = emitToNumber(as, 0, RAX);
+  branches[1] = emitToNumber(as, 1, RCX);
+  switch (op) {
+    case OP_ADD:      emitDoubleOp(as, 0x58); break;
+    case OP_SUBTRACT: emitDoubleOp(as, 0x5c); break;
+    case OP_MULTIPLY: emitDoubleOp(as, 0x59); break;
+    case OP_DIVIDE:   emitDoubleOp(as, 0x5e); break;
+    default: break;
+  }
+  emitFromDouble(as, RAX, 0);
+  patchHere(as, done);
+}
+
+// Stack arithmetic: pops two operands and pushes the result.
+static void emitBinary(Assembler* as, OpCode op, uint8_t* ip,
+                       uint8_t* next) {
+  emitPeek(as, RAX, 1);
+  emitPeek(as, RCX, 0);
+
+  int slow[2];
+  emitArithmetic(as, op, slow);
+  emitStore(as, SP, -16, RAX);
+  emitAddImmediate(as, SP, -8);
+  int done = emitJump(as);
+
+  patchHere(as, slow[0]);
+  patchHere(as, slow[1]);
+  if (op == OP_ADD) {
+    emitCall(as, next, HELPER(jitAdd));
+    emitCheck(as);
+  } else {
+    emitBail(as, ip);
+  }
+
+  patchHere(as, done);
+}
+
+// Three-address form: slots[dest] = slots[left] <op> [right], where the
+// right operand has been loaded into rcx.
+static void emitRegisterOp(Assembler* as, OpCode op, uint8_t* ip,
+                           uint8_t* next, int dest) {
+  int slow[2];
+  emitArithmetic(as, op, slow);
+  emitStore(as, SLOTS, 8 * dest, RAX);
+  int done = emitJump(as);
+
+  patchHere(as, slow[0]);
+  patchHere(as, slow[1]);
+  if (op == OP_ADD) {
+    emitPush(as, RAX);
+    emitPush(as, RCX);
+    emitCall(as, next, HELPER(jitAdd));
+    emitCheck(as);
+    emitPop(as, RAX);
+    emitStore(as, SLOTS, 8 * dest, RAX);
+  } else {
+    emitBail(as, ip);
+  }
+
+  patchHere(as, done);
+}
+
+// Pushes the result of comparing rax with rcx. Bails out on non-numbers.
+static void emitComparison(Assembler* as, OpCode op, uint8_t* ip) {
+  int notInt[2];
+  notInt[0] = emitNotInt(as, RAX);
+  notInt[1] = emitNotInt(as, RCX);
+  emitRegisters32(as, CMP, RAX, RCX);
+  emitBoolFromFlags(as, op == OP_GREATER ? CC_G : CC_L);
+  int intDone = emitJump(as);
+
+  patchHere(as, notInt[0]);
+  patchHere(as, notInt[1]);
+  int notNumber[2];
+  notNumber[0] = emitToNumber(as, 0, RAX);
+  notNumber[1] = emitToNumber(as, 1, RCX);
+  if (op == OP_GREATER) {
+    emitDoubleCompare(as, 0, 1);
+  } else {
+    emitDoubleCompare(as, 1, 0);
+  }
+  emitBoolFromFlags(as, CC_A);
+  int done = emitJump(as);
+
+  patchHere(as, notNumber[0]);
+  patchHere(as, notNumber[1]);
+  emitBail(as, ip);
+
+  patchHere(as, intDone);
+  patchHere(as, done);
+}
+
+static void emitEqual(Assembler* as) {
+  emitPeek(as, RAX, 1);
+  emitPeek(as, RCX, 0);
+
+  // Bits decide unless a double is involved, which compares numerically
+  // against any other number.
+  int doubleA = emitDoubleCheck(as, RAX, CC_NE);
+  int doubleB = emitDoubleCheck(as, RCX, CC_NE);
+  int bits = emitJump(as);
+
+  patchHere(as, doubleA);
+  patchHere(as, doubleB);
+  int bitsA = emitToNumber(as, 0, RAX);
+  int bitsB = emitToNumber(as, 1, RCX);
+  emitDoubleCompare(as, 0, 1);
+  emit8(as, 0x0f);  // sete al
+  emit8(as, 0x94);
+  emit8(as, 0xc0);
+  emit8(as, 0x0f);  // setnp cl
+  emit8(as, 0x9b);
+  emit8(as, 0xc1);
+  emit8(as, 0x20);  // and al, cl
+  emit8(as, 0xc8);
+  int store = emitJump(as);
+
+  patchHere(as, bits);
+  patchHere(as, bitsA);
+  patchHere(as, bitsB);
+  emitRegisters(as, CMP, RAX, RCX);
+  emit8(as, 0x0f);  // sete al
+  emit8(as, 0x94);
+  emit8(as, 0xc0);
+
+  patchHere(as, store);
+  emit8(as, 0x0f);  // movzx eax, al
+  emit8(as, 0xb6);
+  emit8(as, 0xc0);
+  emitMoveImmediate(as, RCX, FALSE_VAL);
+  emitRegisters(as, OR, RAX, RCX);
+  emitStore(as, SP, -16, RAX);
+  emitAddImmediate(as, SP, -8);
+}
+
+// Branches to the returned jump if storing the value on top of the stack
+// into the object in [reg] needs the write barrier, because the object is
+// old and the value a young object. Clobbers rax and rcx.
+static int emitBarrierCheck(Assembler* as, int reg) {
+  emitCompareByte(as, reg, offsetof(Obj, isMarked), 0);
+  int youngObject = emitBranch(as, CC_E);
+
+  emitPeek(as, RAX, 0);
+  emitMoveImmediate(as, RCX, SIGN_BIT | QNAN);
+  emitRegisters(as, AND, RAX, RCX);
+  emitRegisters(as, CMP, RAX, RCX);
+  int notObject = emitBranch(as, CC_NE);
+
+  emitPeek(as, RAX, 0);
+  emitMoveImmediate(as, RCX, ~(SIGN_BIT | QNAN));
+  emitRegisters(as, AND, RAX, RCX);
+  emitCompareByte(as, RAX, offsetof(Obj, isMarked), 0);
+  int youngValue = emitBranch(as, CC_E);
+
+  patchHere(as, youngObject);
+  patchHere(as, notObject);
+  return youngValue;
+}
+
+// Branches to the returned jump unless the first entry of [cache] is for
+// the shape of the instance in rdx. Leaves the cache in rcx.
+static int emitShapeCheck(Assembler* as, InlineCache* cache, int* empty) {
+  emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)cache);
+  emitCompareMemory(as, false, RCX, offsetof(InlineCache, count), 0);
+  *empty = emitBranch(as, CC_E);
+
+  emitLoad(as, RAX, RDX, offsetof(ObjInstance, shape));
+  emitMemory(as, 0x3b, RAX, RCX,
+             offsetof(InlineCache, entries) + offsetof(CacheEntry, shape));
+  return emitBranch(as, CC_NE);
+}
+
+// Loads the field of the instance in rdx at the slot cached in rcx into
+// rax, leaving the field array in rdx.
+static void emitCachedSlot(Assembler* as) {
+  emitMemory(as, 0x63, RAX, RCX,
+             offsetof(InlineCache, entries) + offsetof(CacheEntry, slot));
+  emitLoad(as, RDX, RDX, offsetof(ObjInstance, fields));
+}
+
+// Reads a field through the instance's inline cache when its first entry
+// matches, otherwise through the full lookup in jitGetProperty.
+static void emitGetProperty(Assembler* as, uint8_t* ip, uint8_t* next) {
+  InlineCache* cache = inlineCache(as, &ip[2]);
+
+  int empty;
+  int miss = emitShapeCheck(as, cache, &empty);
+  emitCachedSlot(as);
+  emitIndexed(as, 0x8b, RAX, RDX, RAX);
+  emitStore(as, SP, -8, RAX);
+  int done = emitJump(as);
+
+  patchHere(as, empty);
+  patchHere(as, miss);
+  emitMoveImmediate(as, RDI, (uint64_t)(uintptr_t)constantString(as, ip[1]));
+  emitMoveImmediate(as, RSI, (uint64_t)(uintptr_t)cache);
+  emitCall(as, next, HELPER(jitGetProperty));
+  emitCheck(as);
+
+  patchHere(as, done);
+}
+
+// Stores to an existing field through the inline cache. Adding a field
+// changes the instance's shape, which is left to jitSetProperty, as are
+// stores that need the write barrier.
+static void emitSetProperty(Assembler* as, uint8_t* ip, uint8_t* next) {
+  InlineCache* cache = inlineCache(as, &ip[2]);
+
+  int barrier = emitBarrierCheck(as, RDX);
+  int empty;
+  int miss = emitShapeCheck(as, cache, &empty);
+  emitCompareMemory(as, true, RCX, offsetof(InlineCache, entries) +
+                    offsetof(CacheEntry, transition), 0);
+  int transition = emitBranch(as, CC_NE);
+
+  emitCachedSlot(as);
+  emitPeek(as, RCX, 0);
+  emitIndexed(as, 0x89, RCX, RDX, RAX);
+  emitStore(as, SP, -16, RCX);
+  emitAddImmediate(as, SP, -8);
+  int done = emitJump(as);
+
+  patchHere(as, barrier);
+  patchHere(as, empty);
+  patchHere(as, miss);
+  patchHere(as, transition);
+  emitMoveImmediate(as, RDI, (uint64_t)(uintptr_t)constantString(as, ip[1]));
+  emitMoveImmediate(as, RSI, (uint64_t)(uintptr_t)cache);
+  emitCall(as, next, HELPER(jitSetProperty));
+
+  patchHere(as, done);
+}
+
+// Calls the callee [argCount] slots down the stack, directly if it is a
+// closure, otherwise through jitCall.
+static void emitCallValue(Assembler* as, int argCount, uint8_t* next) {
+  int slow[DIRECT_CALL_CHECKS];
+  int checks = 0;
+  int done = -1;
+
+  if (argCount <= DIRECT_CALL_MAX_ARGS) {
+    emitPeek(as, RAX, argCount);
+    emitMoveImmediate(as, RCX, SIGN_BIT | QNAN);
+    emitRegisters(as, MOV, RDX, RAX);
+    emitRegisters(as, AND, RDX, RCX);
+    emitRegisters(as, CMP, RDX, RCX);
+    slow[checks++] = emitBranch(as, CC_NE);
+
+    emitMoveImmediate(as, RCX, ~(SIGN_BIT | QNAN));
+    emitRegisters(as, AND, RAX, RCX);
+    emitCompareMemory(as, false, RAX, offsetof(Obj, type), OBJ_CLOSURE);
+    slow[checks++] = emitBranch(as, CC_NE);
+
+    emitDirectCall(as, argCount, next, slow, &checks);
+    done = emitJump(as);
+  }
+
+  for (int i = 0; i < checks; i++) patchHere(as, slow[i]);
+  emitMoveImmediate(as, RDI, argCount);
+  emitCall(as, next, HELPER(jitCall));
+  emitCallCheck(as);
+
+  if (done != -1) patchHere(as, done);
+}
+
+// Calls a method on an instance, directly if the first entry of the
+// site's inline cache is for the receiver's class, otherwise through
+// jitInvoke.
+static void emitInvoke(Assembler* as, uint8_t* ip, uint8_t* next) {
+  int argCount = ip[2];
+  InlineCache* cache = inlineCache(as, &ip[3]);
+  emitPeek(as, RAX, argCount);
+  emitInstanceGuard(as, RAX, ip);
+
+  int slow[DIRECT_CALL_CHECKS];
+  int checks = 0;
+  int done = -1;
+
+  if (argCount <= DIRECT_CALL_MAX_ARGS) {
+    emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)cache);
+    emitCompareMemory(as, false, RCX, offsetof(InlineCache, count), 0);
+    slow[checks++] = emitBranch(as, CC_E);
+
+    emitLoad(as, RAX, RDX, offsetof(ObjInstance, klass));
+    emitMemory(as, 0x3b, RAX, RCX,
+               offsetof(InlineCache, entries) + offsetof(CacheEntry, klass));
+    slow[checks++] = emitBranch(as, CC_NE);
+
+    emitLoad(as, RAX, RCX,
+             offsetof(InlineCache, entries) + offsetof(CacheEntry, method));
+    emitDirectCall(as, argCount, next, slow, &checks);
+    done = emitJump(as);
+  }
+
+  for (int i = 0; i < checks; i++) patchHere(as, slow[i]);
+  emitMoveImmediate(as, RDI, (uint64_t)(uintptr_t)constantString(as, ip[1]));
+  emitMoveImmediate(as, RSI, argCount);
+  emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)cache);
+  emitCall(as, next, HELPER(jitInvoke));
+  emitCallCheck(as);
+
+  if (done != -1) patchHere(as, done);
+}
+
+// Pops the frame inline unless it has upvalues to close.
+static void emitReturn(Assembler* as, uint8_t* next) {
+  emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+  emitLoad(as, RCX, RCX, 0);
+  emitRegisters(as, 0x85, RCX, RCX);  // test rcx, rcx
+  int noUpvalues = emitBranch(as, CC_E);
+  emitLoad(as, RAX, RCX, offsetof(ObjUpvalue, location));
+  emitRegisters(as, CMP, RAX, SLOTS);
+  int belowFrame = emitBranch(as, CC_B);
+
+  emitCall(as, next, HELPER(jitReturn));
+  emitJumpTo(as, EXIT_RETURN);
+
+  patchHere(as, noUpvalues);
+  patchHere(as, belowFrame);
+  emitPeek(as, RAX, 0);
+  emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.frameCount);
+  emit8(as, 0x83);                      // sub dword [rcx], 1
+  emit8(as, 0x29);
+  emit8(as, 0x01);
+  emitRegisters(as, MOV, SP, SLOTS);
+  emitBranchTo(as, CC_E, EXIT_RETURN);  // Returned from the script.
+  emitPush(as, RAX);
+  emitJumpTo(as, EXIT_RETURN);
+}
+
+static bool isSupported(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_INVOKE:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_GET_LOCAL_2:
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUBTRACT_LOCAL_CONST:
+    case OP_LESS_LOCAL_CONST_JUMP:
+    case OP_GUARD_CALL:
+    case OP_GUARD_INVOKE:
+    case OP_ADD_RRR:
+    case OP_SUBTRACT_RRR:
+    case OP_MULTIPLY_RRR:
+    case OP_DIVIDE_RRR:
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void emitPrologue(Assembler* as) {
+  emit8(as, 0x55);                      // push rbp
+  emit8(as, 0x53);                      // push rbx
+  emit8(as, 0x41); emit8(as, 0x54);     // push r12
+  emit8(as, 0x41); emit8(as, 0x55);     // push r13
+  emit8(as, 0x41); emit8(as, 0x56);     // push r14
+  emit8(as, 0x41); emit8(as, 0x57);     // push r15
+  emitAddImmediate(as, RSP, -8);        // keep calls 16-byte aligned
+
+  emitRegisters(as, MOV, FRAME, RDI);
+  emitLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+  emitRegisters(as, MOV, SP, RSI);
+  emitRegisters(as, MOV, CONSTANTS, RDX);
+  emitMoveImmediate(as, QNAN_BITS, QNAN);
+
+  emit8(as, 0xff);                      // jmp rcx
+  emit8(as, 0xe1);
+}
+
+// Each exit sets the status returned to jitRun, in EXIT_ order, and falls
+// into the shared epilogue.
+static void emitEpilogue(Assembler* as, int exits[EXIT_COUNT]) {
+  JitStatus statuses[EXIT_COUNT] = {
+    JIT_BAILED, JIT_SUSPENDED, JIT_ERROR, JIT_RETURNED
+  };
+
+  int done[EXIT_COUNT - 1];
+  for (int i = 0; i < EXIT_COUNT; i++) {
+    exits[i] = as->count;
+    emit8(as, 0xb8);                    // mov eax, status
+    emit32(as, statuses[i]);
+    if (i < EXIT_COUNT - 1) done[i] = emitJump(as);
+  }
+
+  for (int i = 0; i < EXIT_COUNT - 1; i++) patchHere(as, done[i]);
+  emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitStore(as, RCX, 0, SP);
+  emitAddImmediate(as, RSP, 8);
+  emit8(as, 0x41); emit8(as, 0x5f);     // pop r15
+  emit8(as, 0x41); emit8(as, 0x5e);     // pop r14
+  emit8(as, 0x41); emit8(as, 0x5d);     // pop r13
+  emit8(as, 0x41); emit8(as, 0x5c);     // pop r12
+  emit8(as, 0x5b);                      // pop rbx
+  emit8(as, 0x5d);                      // pop rbp
+  emit8(as, 0xc3);                      // ret
+}
+
+static void emitInstruction(Assembler* as, int offset, int length) {
+  uint8_t* code = as->function->chunk.code;
+  uint8_t* ip = &code[offset];
+  uint8_t* next = ip + length;
+
+  // Quickened instructions use the generic templates, which have their own
+  // type guards.
+  uint8_t instruction = genericInstruction(ip[0]);
+  switch (instruction) {
+    case OP_CONSTANT:
+      emitConstant(as, RAX, ip[1]);
+      emitPush(as, RAX);
+      break;
+
+    case OP_CONSTANT_LONG:
+      emitConstant(as, RAX, (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+      emitPush(as, RAX);
+      break;
+
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE: {
+      Value value = ip[0] == OP_NIL ? NIL_VAL
+                  : ip[0] == OP_TRUE ? TRUE_VAL : FALSE_VAL;
+      emitMoveImmediate(as, RAX, value);
+      emitPush(as, RAX);
+      break;
+    }
+
+    case OP_POP:
+      emitAddImmediate(as, SP, -8);
+      break;
+
+    case OP_GET_LOCAL:
+      emitLocal(as, RAX, ip[1]);
+      emitPush(as, RAX);
+      break;
+
+    case OP_SET_LOCAL:
+      emitPeek(as, RAX, 0);
+      emitStore(as, SLOTS, 8 * ip[1], RAX);
+      break;
+
+    case OP_GET_GLOBAL:
+      emitMoveImmediate(as, RDI, (uint64_t)(uintptr_t)constantString(as, ip[1]));
+      emitCall(as, next, HELPER(jitGetGlobal));
+      emitCheck(as);
+      break;
+
+    case OP_DEFINE_GLOBAL:
+      emitMoveImmediate(as, RDI, (uint64_t)(uintptr_t)constantString(as, ip[1]));
+      emitCall(as, next, HELPER(jitDefineGlobal));
+      break;
+
+    case OP_SET_GLOBAL:
+      emitMoveImmediate(as, RDI, (uint64_t)(uintptr_t)constantString(as, ip[1]));
+      emitCall(as, next, HELPER(jitSetGlobal));
+      emitCheck(as);
+      break;
+
+    case OP_GET_UPVALUE:
+      emitLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+      emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+      emitLoad(as, RAX, RAX, 8 * ip[1]);
+      emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+      emitLoad(as, RCX, RAX, 0);
+      emitPush(as, RCX);
+      break;
+
+    case OP_SET_UPVALUE: {
+      emitLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+      emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+      emitLoad(as, RDX, RAX, 8 * ip[1]);
+      int barrier = emitBarrierCheck(as, RDX);
+      emitLoad(as, RAX, RDX, offsetof(ObjUpvalue, location));
+      emitPeek(as, RCX, 0);
+      emitStore(as, RAX, 0, RCX);
+      int done = emitJump(as);
+
+      patchHere(as, barrier);
+      emitMoveImmediate(as, RDI, ip[1]);
+      emitCall(as, next, HELPER(jitSetUpvalue));
+
+      patchHere(as, done);
+      break;
+    }
+
+    case OP_GET_PROPERTY:
+      emitPeek(as, RAX, 0);
+      emitInstanceGuard(as, RAX, ip);
+      emitGetProperty(as, ip, next);
+      break;
+
+    case OP_SET_PROPERTY:
+      emitPeek(as, RAX, 1);
+      emitInstanceGuard(as, RAX, ip);
+      emitSetProperty(as, ip, next);
+      break;
+
+    case OP_EQUAL:
+      emitEqual(as);
+      break;
+
+    case OP_GREATER:
+    case OP_LESS:
+      emitPeek(as, RAX, 1);
+      emitPeek(as, RCX, 0);
+      emitComparison(as, instruction, ip);
+      emitStore(as, SP, -16, RAX);
+      emitAddImmediate(as, SP, -8);
+      break;
+
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      emitBinary(as, instruction, ip, next);
+      break;
+
+    case OP_NOT:
+      emitCall(as, next, HELPER(jitNot));
+      break;
+
+    case OP_NEGATE: {
+      // Zero and INT32_MIN have no negated int, so they leave too.
+      emitPeek(as, RAX, 0);
+      int notInt = emitNotInt(as, RAX);
+      emitRegisters32(as, MOV, RDX, RAX);
+      emit8(as, 0xf7);  // neg edx
+      emit8(as, 0xda);
+      int zero = emitBranch(as, CC_E);
+      int overflow = emitBranch(as, CC_O);
+      emitRegisters32(as, MOV, RAX, RDX);
+      emitBoxInt(as);
+      emitStore(as, SP, -8, RAX);
+      int intDone = emitJump(as);
+
+      patchHere(as, notInt);
+      int notNumber = emitDoubleCheck(as, RAX, CC_E);
+      emitMoveImmediate(as, RCX, SIGN_BIT);
+      emitRegisters(as, XOR, RAX, RCX);
+      emitStore(as, SP, -8, RAX);
+      int done = emitJump(as);
+      patchHere(as, notNumber);
+      patchHere(as, zero);
+      patchHere(as, overflow);
+      emitBail(as, ip);
+      patchHere(as, intDone);
+      patchHere(as, done);
+      break;
+    }
+
+    case OP_PRINT:
+      emitCall(as, next, HELPER(jitPrint));
+      break;
+
+    case OP_JUMP:
+      emitJumpTo(as, jumpTarget(&as->function->chunk, offset));
+      break;
+
+    case OP_JUMP_IF_FALSE: {
+      int target = jumpTarget(&as->function->chunk, offset);
+      emitPeek(as, RAX, 0);
+      emitMoveImmediate(as, RCX, TRUE_VAL);
+      emitRegisters(as, CMP, RAX, RCX);
+      int isTrue = emitBranch(as, CC_E);
+      emitMoveImmediate(as, RCX, FALSE_VAL);
+      emitRegisters(as, CMP, RAX, RCX);
+      emitBranchTo(as, CC_E, target);
+
+      emitRegisters(as, MOV, RDI, RAX);
+      emitCall(as, next, HELPER(jitIsFalsey));
+      emit8(as, 0x84);  // test al, al
+      emit8(as, 0xc0);
+      emitBranchTo(as, CC_NE, target);
+      patchHere(as, isTrue);
+      break;
+    }
+
+    case OP_LOOP:
+      emitJumpTo(as, jumpTarget(&as->function->chunk, offset));
+      break;
+
+    case OP_CALL:
+      emitCallValue(as, ip[1], next);
+      break;
+
+    case OP_TAIL_CALL:
+      // The frame now belongs to the callee, so the interpreter takes over.
+      emitMoveImmediate(as, RDI, ip[1]);
+      emitCall(as, next, HELPER(jitTailCall));
+      emitCheck(as);
+      emitJumpTo(as, EXIT_SUSPEND);
+      break;
+
+    case OP_INVOKE:
+      emitInvoke(as, ip, next);
+      break;
+
+    case OP_GUARD_CALL:
+    case OP_GUARD_INVOKE: {
+      int target = jumpTarget(&as->function->chunk, offset);
+      if (instruction == OP_GUARD_CALL) {
+        emitMoveImmediate(as, RDI, ip[1]);
+        emitMoveImmediate(as, RSI,
+                          (uint64_t)(uintptr_t)constantFunction(as, ip[2]));
+        emitCall(as, next, HELPER(jitGuardCall));
+      } else {
+        emitMoveImmediate(as, RDI,
+                          (uint64_t)(uintptr_t)constantString(as, ip[1]));
+        emitMoveImmediate(as, RSI, ip[2]);
+        emitMoveImmediate(as, RDX,
+                          (uint64_t)(uintptr_t)constantFunction(as, ip[3]));
+        emitCall(as, next, HELPER(jitGuardInvoke));
+      }
+      emit8(as, 0x84);  // test al, al
+      emit8(as, 0xc0);
+      emitBranchTo(as, CC_E, target);
+      break;
+    }
+
+    case OP_CLOSE_UPVALUE:
+      emitCall(as, next, HELPER(jitCloseUpvalue));
+      break;
+
+    case OP_RETURN:
+      emitReturn(as, next);
+      break;
+
+    case OP_GET_LOCAL_2:
+      emitLocal(as, RAX, ip[1]);
+      emitPush(as, RAX);
+      emitLocal(as, RAX, ip[2]);
+      emitPush(as, RAX);
+      break;
+
+    case OP_SET_LOCAL_POP:
+      emitPop(as, RAX);
+      emitStore(as, SLOTS, 8 * ip[1], RAX);
+      break;
+
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUBTRACT_LOCAL_CONST: {
+      emitLocal(as, RAX, ip[1]);
+      emitConstant(as, RCX, ip[2]);
+
+      OpCode op = ip[0] == OP_ADD_LOCAL_CONST ? OP_ADD : OP_SUBTRACT;
+      int slow[2];
+      emitArithmetic(as, op, slow);
+      emitPush(as, RAX);
+      int done = emitJump(as);
+
+      patchHere(as, slow[0]);
+      patchHere(as, slow[1]);
+      if (op == OP_ADD) {
+        emitPush(as, RAX);
+        emitPush(as, RCX);
+        emitCall(as, next, HELPER(jitAdd));
+        emitCheck(as);
+      } else {
+        emitBail(as, ip);
+      }
+      patchHere(as, done);
+      break;
+    }
+
+    case OP_LESS_LOCAL_CONST_JUMP: {
+      int target = jumpTarget(&as->function->chunk, offset);
+      emitLocal(as, RAX, ip[1]);
+      emitConstant(as, RCX, ip[2]);
+      emitComparison(as, OP_LESS, ip);
+
+      emitMoveImmediate(as, RCX, TRUE_VAL);
+      emitRegisters(as, CMP, RAX, RCX);
+      int isLess = emitBranch(as, CC_E);
+      emitPush(as, RAX);
+      emitJumpTo(as, target);
+      patchHere(as, isLess);
+      break;
+    }
+
+    case OP_ADD_RRR:
+    case OP_SUBTRACT_RRR:
+    case OP_MULTIPLY_RRR:
+    case OP_DIVIDE_RRR:
+      emitLocal(as, RAX, ip[2]);
+      emitLocal(as, RCX, ip[3]);
+      emitRegisterOp(as, OP_ADD + (ip[0] - OP_ADD_RRR), ip, next, ip[1]);
+      break;
+
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      emitLocal(as, RAX, ip[2]);
+      emitConstant(as, RCX, ip[3]);
+      emitRegisterOp(as, OP_ADD + (ip[0] - OP_ADD_RRK), ip, next, ip[1]);
+      break;
+  }
+}
+
+static void freeAssembler(Assembler* as) {
+  free(as->code);
+  free(as->fixups);
+  free(as->labels);
+}
+
+bool jitCompile(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+
+  bool leaf = true;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = genericInstruction(chunk->code[offset]);
+    if (!isSupported(instruction)) {
+      function->hotness = -1;
+      return false;
+    }
+
+    if (instruction == OP_LOOP || instruction == OP_CALL ||
+        instruction == OP_TAIL_CALL || instruction == OP_INVOKE) {
+      leaf = false;
+    }
+  }
+
+  Assembler as;
+  as.function = function;
+  as.code = NULL;
+  as.count = 0;
+  as.capacity = 0;
+  as.fixups = NULL;
+  as.fixupCount = 0;
+  as.fixupCapacity = 0;
+  as.labels = malloc(sizeof(int) * (chunk->count + 1));
+  if (as.labels == NULL) exit(1);
+  for (int i = 0; i <= chunk->count; i++) as.labels[i] = -1;
+
+  emitPrologue(&as);
+
+  for (int offset = 0; offset < chunk->count;) {
+    int length = instructionLength(chunk, offset);
+    as.labels[offset] = as.count;
+    emitInstruction(&as, offset, length);
+    offset += length;
+  }
+
+  int exits[EXIT_COUNT];
+  emitEpilogue(&as, exits);
+
+  for (int i = 0; i < as.fixupCount; i++) {
+    Fixup* fixup = &as.fixups[i];
+    int target = fixup->target >= 0 ? as.labels[fixup->target]
+                                    : exits[-fixup->target - 1];
+    int32_t jump = target - (fixup->at + 4);
+    memcpy(&as.code[fixup->at], &jump, 4);
+  }
+
+  void* memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    freeAssembler(&as);
+    function->hotness = -1;
+    return false;
+  }
+
+  memcpy(memory, as.code, as.count);
+  mprotect(memory, as.count, PROT_READ | PROT_EXEC);
+
+  JitCode* jit = malloc(sizeof(JitCode));
+  if (jit == NULL) exit(1);
+  jit->code = memory;
+  jit->size = as.count;
+  jit->entries = malloc(sizeof(uint32_t) * chunk->count);
+  if (jit->entries == NULL) exit(1);
+  for (int i = 0; i < chunk->count; i++) {
+    jit->entries[i] = (uint32_t)as.labels[i];
+  }
+  jit->entryCount = chunk->count;
+  jit->bailouts = 0;
+  jit->disabled = false;
+  jit->leaf = leaf;
+
+  freeAssembler(&as);
+  function->jit = jit;
+  return true;
+}
+
+void jitFree(ObjFunction* function) {
+  JitCode* jit = function->jit;
+  if (jit == NULL) return;
+
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+  function->jit = NULL;
+}
+
+JitStatus jitRun(CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  JitCode* jit = function->jit;
+
+  int offset = (int)(frame->ip - function->chunk.code);
+  JitEntry entry = (JitEntry)(void*)jit->code;
+  vm.jitDepth++;
+  JitStatus status = entry(frame, vm.stackTop,
+                           function->chunk.constants.values,
+                           jit->code + jit->entries[offset]);
+  vm.jitDepth--;
+
+  if (status == JIT_BAILED) countBailout(jit);
+  return status;
+}
+
+#endif
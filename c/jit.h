@@ -0,0 +1,108 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+#include "vm.h"
+
+// Calls and loop back-edges a function runs before it is compiled.
+#define JIT_HOT_THRESHOLD 1000
+
+// Bailouts after which compiled code is no longer entered.
+#define JIT_MAX_BAILOUTS 1000
+
+// Compiled code calling compiled code nests on the C stack. Past this depth
+// calls go to the interpreter instead.
+#define JIT_MAX_DEPTH 200
+
+typedef enum {
+  // The function returned and its frame was popped.
+  JIT_RETURNED,
+
+  // A type guard failed. The frame is still on top with its ip pointing at
+  // the instruction to interpret next.
+  JIT_BAILED,
+
+  // A call pushed a frame the interpreter has to run. The compiled frame
+  // is below it, to be resumed by the interpreter after the call.
+  JIT_SUSPENDED,
+
+  // A runtime error was reported and the stack reset.
+  JIT_ERROR
+} JitStatus;
+
+struct JitCode {
+  uint8_t* code;
+  size_t size;
+
+  // Native code offset for each bytecode offset that starts an instruction.
+  uint32_t* entries;
+  int entryCount;
+
+  int bailouts;
+  bool disabled;
+
+  // Whether the function neither loops nor calls. Entering compiled code
+  // from the interpreter costs more than running a few instructions, so
+  // such functions run compiled only when compiled code calls them.
+  bool leaf;
+};
+
+
+bool jitCompile(ObjFunction* function);
+
+
+void jitFree(ObjFunction* function);
+
+
+JitStatus jitRun(CallFrame* frame);
+
+
+// Counts a call of [function] or a loop back-edge in it and reports
+// whether compiled code for it can be entered, compiling it once it gets
+// hot.
+static inline bool jitReady(ObjFunction* function) {
+  if (function->jit != NULL) return !function->jit->disabled;
+  if (!vm.jitEnabled || function->hotness < 0) return false;
+  if (++function->hotness < JIT_HOT_THRESHOLD) return false;
+  return jitCompile(function);
+}
+
+
+// Counts a call of [function] from the interpreter and reports whether to
+// run it compiled.
+static inline bool jitCallReady(ObjFunction* function) {
+  if (vm.jitDepth >= JIT_MAX_DEPTH || !jitReady(function)) return false;
+  return !function->jit->leaf;
+}
+
+
+// Runtime entry points for compiled code, defined in vm.c. Each works on
+// vm.stackTop, which compiled code syncs before calling. Those returning
+// bool report false after a runtime error, except the guards, which report
+// whether to run the inlined body. The calls return the frame now on top
+// or NULL.
+bool jitGetGlobal(ObjString* name);
+void jitDefineGlobal(ObjString* name);
+bool jitSetGlobal(ObjString* name);
+bool jitGetProperty(ObjString* name, InlineCache* cache);
+void jitSetProperty(ObjString* name, InlineCache* cache);
+void jitSetUpvalue(int slot);
+bool jitAdd();
+void jitNot();
+bool jitIsFalsey(Value value);
+void jitPrint();
+CallFrame* jitCall(int argCount);
+bool jitGuardCall(int argCount, ObjFunction* function);
+bool jitGuardInvoke(ObjString* name, int argCount, ObjFunction* function);
+bool jitTailCall(int argCount);
+CallFrame* jitInvoke(ObjString* name, int argCount, InlineCache* cache);
+void jitCloseUpvalue();
+void jitReturn();
+
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,8 +8,12 @@
 
 #include "common.h"
 
+#include "cache.h"
+
 #include "chunk.h"
 
+#include "compiler.h"
+
 
 #include "debug.h"
 
@@ -70,7 +75,11 @@ static char* readFile(const char* path) {
 
 static void runFile(const char* path) {
   char* source = readFile(path);
-  InterpretResult result = interpret(source);
+
+  // A fresh cache from --compile saves compiling the source again.
+  ObjFunction* function = loadBytecode(path, source);
+  InterpretResult result = function != NULL ? interpretFunction(function)
+                                            : interpret(source);
   free(source); 
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
@@ -78,16 +87,84 @@ static void runFile(const char* path) {
 }
 
 
+static void compileFile(const char* path) {
+  char* source = readFile(path);
+  ObjFunction* function = compile(source);
+  if (function == NULL) exit(65);
+
+  if (!saveBytecode(path, source, function)) {
+    fprintf(stderr, "Could not write bytecode for \"%s\".\n", path);
+    exit(74);
+  }
+  free(source);
+}
+
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [-O<level>] [--no-jit] [--lazy]"
+                  " [--gc-pause <microseconds>] [--gc-thread]"
+                  " [--max-depth <frames>] [path]\n"
+                  "       clox [-O<level>] --compile <path>...\n");
+  exit(64);
+}
+
+// Parses the whole of [arg] as a count no smaller than [min].
+static int parseCount(const char* arg, int min) {
+  char* end;
+  long count = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || count < min || count > INT_MAX) {
+    usage();
+  }
+  return (int)count;
+}
+
+
 int main(int argc, const char* argv[]) {
   initVM();
 
-  if (argc == 1) {
+  const char* path = NULL;
+  int firstPath = 0;
+  bool compileOnly = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--compile") == 0) {
+      compileOnly = true;
+    } else if (compileOnly && argv[i][0] != '-') {
+      // Everything from the first path on is a file to compile.
+      firstPath = i;
+      break;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      vm.lazyCompile = true;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      vm.jitEnabled = false;
+    } else if (strncmp(argv[i], "-O", 2) == 0) {
+      if (argv[i][2] < '0' || argv[i][2] > '0' + OPTIMIZE_MAX ||
+          argv[i][3] != '\0') {
+        usage();
+      }
+      vm.optimizationLevel = argv[i][2] - '0';
+    } else if (strcmp(argv[i], "--gc-pause") == 0 && i + 1 < argc) {
+      vm.gcPauseBudget = parseCount(argv[++i], 0);
+    } else if (strcmp(argv[i], "--gc-thread") == 0) {
+      vm.backgroundSweep = true;
+    } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      vm.maxFrames = parseCount(argv[++i], 1);
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  if (compileOnly) {
+    if (firstPath == 0) usage();
+
+    // Caches only hold compiled code.
+    vm.lazyCompile = false;
+    for (int i = firstPath; i < argc; i++) compileFile(argv[i]);
+  } else if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(path);
   }
   
   freeVM();
@@ -1,14 +1,24 @@
+// For clock_gettime() under -std=c99.
+#define _DEFAULT_SOURCE
 
+#include <pthread.h>
 #include <stdlib.h>
 
 
+#include "cache.h"
+
 #include "compiler.h"
 
+#include "jit.h"
+
 #include "memory.h"
 
+#include "slab.h"
+
 #include "vm.h"
 
 #include <stdio.h>
+#include <time.h>
 
 
 #ifdef DEBUG_LOG_GC
@@ -20,24 +30,100 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// Bytes allocated between the steps of a full collection.
+#define GC_STEP_SIZE (64 * 1024)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-
-  vm.bytesAllocated += newSize - oldSize;
+#ifdef DEBUG_STRESS_GC
+#define GC_STEP_MIN_WORK 1
+#define GC_WORK_CHECK 1
+#define GC_THREAD_MIN_HEAP 0
+#else
+// Work done in a step however small the pause budget, so that a
+// collection keeps up with allocation.
+#define GC_STEP_MIN_WORK 1024
+
+// How often a step looks at the clock.
+#define GC_WORK_CHECK 64
+
+// Heaps up to this size are swept here even with vm.backgroundSweep set.
+// Waking the sweeper thread costs more than sweeping them.
+#define GC_THREAD_MIN_HEAP GC_NURSERY_SIZE
+#endif
 
 
+#ifdef GENERATIONAL_GC
+static void collectNursery();
+#endif
+static void gcStep(bool finish);
+static void startCollection();
+#ifdef GENERATIONAL_GC
+// Set on the sweeper thread only, which counts what it frees here.
+static __thread bool onSweeper;
+static size_t sweeperFreed;
+static void countSweptBytes();
+#endif
 
-  if (newSize > oldSize) {
+// Starts or advances a collection if allocation has reached the point
+// for one.
+static void collectIfDue() {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+#ifdef GENERATIONAL_GC
+  // Mostly minor collections, with a full one now and then.
+  static int stressCount = 0;
+  if (vm.gcPhase != GC_IDLE) {
+    gcStep(vm.gcPauseBudget == 0);
+  } else if (++stressCount % 8 == 0) {
+    startCollection();
+  } else {
+    collectNursery();
+  }
+#else
+  if (vm.gcPhase != GC_IDLE) {
+    gcStep(vm.gcPauseBudget == 0);
+  } else {
+    startCollection();
+  }
+#endif
 #endif
 
+#ifdef GENERATIONAL_GC
+  if (vm.gcPhase == GC_IDLE && (vm.bytesAllocated > vm.nextGC ||
+                                vm.bytesAllocated > vm.nextMinorGC)) {
+    countSweptBytes();
+  }
+#endif
 
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
+  if (vm.gcPhase != GC_IDLE) {
+    // Finish at once if the collection falls too far behind.
+    if (vm.bytesAllocated > vm.nextGCStep) {
+      gcStep(vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR);
     }
+  } else if (vm.bytesAllocated > vm.nextGC) {
+    startCollection();
+  }
+#ifdef GENERATIONAL_GC
+  else if (vm.bytesAllocated > vm.nextMinorGC) {
+    collectNursery();
+  }
+#endif
+}
+
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 
+#ifdef GENERATIONAL_GC
+  // The sweeper thread keeps its own count, which the main thread takes
+  // in when it next needs vm.bytesAllocated to be right.
+  if (newSize == 0 && onSweeper) {
+    sweeperFreed += oldSize;
+    free(pointer);
+    return NULL;
   }
+#endif
+
+  vm.bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize) collectIfDue();
 
 
   if (newSize == 0) {
@@ -52,6 +138,55 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+
+#if defined(SLAB_ALLOCATOR) && defined(GENERATIONAL_GC)
+// Cells the sweeper thread has freed in its current batch.
+static CellLists sweeperCells;
+#endif
+
+void* allocateCell(size_t size) {
+#ifdef SLAB_ALLOCATOR
+  if (size <= SLAB_MAX_SIZE) {
+    vm.bytesAllocated += size;
+    collectIfDue();
+    return slabAllocate(size);
+  }
+#endif
+
+  return reallocate(NULL, 0, size);
+}
+
+
+void freeCell(void* cell, size_t size) {
+#ifdef SLAB_ALLOCATOR
+  if (size <= SLAB_MAX_SIZE) {
+#ifdef GENERATIONAL_GC
+    if (onSweeper) {
+      sweeperFreed += size;
+      slabFree(&sweeperCells, cell, size);
+      return;
+    }
+#endif
+
+    vm.bytesAllocated -= size;
+    slabFree(NULL, cell, size);
+    return;
+  }
+#endif
+
+  reallocate(cell, size, 0);
+}
+
+#ifdef SLAB_ALLOCATOR
+// Gives back the slab pages a full collection emptied, but for as many as
+// the heap may grow into before the next one.
+static void releaseEmptyPages() {
+  size_t keep = vm.nextGC > vm.bytesAllocated
+      ? vm.nextGC - vm.bytesAllocated : 0;
+  slabReleaseEmptyPages(keep);
+}
+#endif
+
 void markObject(Obj* object) {
   if (object == NULL) return;
 
@@ -84,6 +219,44 @@ void markObject(Obj* object) {
 }
 
 
+static void rememberObject(Obj* object) {
+  if (object->isRemembered) return;
+  object->isRemembered = true;
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = (Obj**)realloc(vm.remembered,
+                                   sizeof(Obj*) * vm.rememberedCapacity);
+
+    if (vm.remembered == NULL) exit(1);
+  }
+
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+
+void recordWrite(Obj* object, Obj* value) {
+  // During marking, [object] may already be black. Shading [value] keeps
+  // black objects from pointing at white ones.
+  if (vm.gcPhase == GC_MARK) {
+    markObject(value);
+  } else {
+    rememberObject(object);
+  }
+}
+
+
+// Functions, classes and enums take new references in too many places to
+// put a write barrier on each (constants, inline caches, method tables,
+// shape trees), and there are few of them. So once old they are traced by
+// every minor collection, and a full collection traces the ones it has
+// blackened again at the end of marking.
+static bool isAlwaysRemembered(Obj* object) {
+  return object->type == OBJ_FUNCTION || object->type == OBJ_CLASS ||
+         object->type == OBJ_ENUM;
+}
+
+
 void markValue(Value value) {
   if (!IS_OBJ(value)) return;
   markObject(AS_OBJ(value));
@@ -96,6 +269,18 @@ static void markArray(ValueArray* array) {
   }
 }
 
+// Cached receivers are kept alive so a dead class can never be confused
+// with a new one allocated at the same address.
+static void markInlineCaches(Chunk* chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache* cache = &chunk->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      markObject((Obj*)cache->entries[j].klass);
+      markObject((Obj*)cache->entries[j].method);
+    }
+  }
+}
+
 void markDict(ObjDict *dict) {
   for (int i = 0; i <= dict->capacityMask; i++) {
     DictItem *entry = &dict->entries[i];
@@ -106,6 +291,9 @@ void markDict(ObjDict *dict) {
 
 
 static void blackenObject(Obj* object) {
+  if (vm.gcPhase == GC_MARK && isAlwaysRemembered(object)) {
+    rememberObject(object);
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
@@ -130,6 +318,7 @@ static void blackenObject(Obj* object) {
       markObject((Obj*)klass->name);
 
       markTable(&klass->methods);
+      markShapeTree(&klass->rootShape);
 
       break;
     }
@@ -156,6 +345,8 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(&function->chunk.constants);
+      markInlineCaches(&function->chunk);
+      if (function->lazy != NULL) markLazyBody(function->lazy);
       break;
     }
 
@@ -164,7 +355,13 @@ static void blackenObject(Obj* object) {
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
-      markTable(&instance->fields);
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          markValue(instance->fields[i]);
+        }
+      } else {
+        markTable(instance->dictionary);
+      }
       break;
     }
 
@@ -194,6 +391,8 @@ static void blackenObject(Obj* object) {
 }
 
 
+#define FREE_OBJ(type, object) freeCell(object, sizeof(type))
+
 static void freeObject(Obj* object) {
 
 #ifdef DEBUG_LOG_GC
@@ -204,7 +403,7 @@ static void freeObject(Obj* object) {
   switch (object->type) {
 
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+      FREE_OBJ(ObjBoundMethod, object);
       break;
 
 
@@ -212,8 +411,10 @@ static void freeObject(Obj* object) {
 
       ObjClass *klass = (ObjClass *) object;
       freeTable(&klass->methods);
+      FREE_ARRAY(ObjClosure*, klass->vtable, klass->vtableCount);
+      freeShapeTree(&klass->rootShape);
 
-      FREE(ObjClass, object);
+      FREE_OBJ(ObjClass, object);
       break;
     }
 
@@ -221,7 +422,7 @@ static void freeObject(Obj* object) {
       ObjEnum *_enum = (ObjEnum *) object;
       freeTable(&_enum->variables);
 
-      FREE(ObjEnum, object);
+      FREE_OBJ(ObjEnum, object);
       break;
     }
 
@@ -231,55 +432,67 @@ static void freeObject(Obj* object) {
       FREE_ARRAY(ObjUpvalue*, closure->upvalues,
                  closure->upvalueCount);
 
-      FREE(ObjClosure, object);
+      FREE_OBJ(ObjClosure, object);
       break;
     }
 
 
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction *) object;
+#ifdef JIT
+      jitFree(function);
+#endif
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      if (function->lazy != NULL) freeLazyBody(function->lazy);
+      FREE_OBJ(ObjFunction, object);
       break;
     }
 
 
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *) object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      if (instance->shape == NULL) {
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
+      } else if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      }
+      freeCell(object, sizeof(ObjInstance) +
+               sizeof(Value) * instance->inlineCapacity);
       break;
     }
 
 
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE_OBJ(ObjNative, object);
       break;
 
 
     case OBJ_STRING: {
       ObjString *string = (ObjString *) object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      if (string->ownsChars) {
+        FREE_ARRAY(char, string->chars, string->length + 1);
+      }
+      FREE_OBJ(ObjString, object);
       break;
     }
 
 
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE_OBJ(ObjUpvalue, object);
       break;
 
     case OBJ_LIST: {
       ObjList *list = (ObjList *) object;
       freeValueArray(&list->values);
-      FREE(ObjList, list);
+      FREE_OBJ(ObjList, list);
       break;
     }
 
     case OBJ_DICT: {
       ObjDict *dict = (ObjDict *) object;
       FREE_ARRAY(DictItem, dict->entries, dict->capacityMask + 1);
-      FREE(ObjDict, dict);
+      FREE_OBJ(ObjDict, dict);
       break;
     }
 
@@ -311,6 +524,7 @@ static void markRoots() {
 
 
   markCompilerRoots();
+  markCacheRoots();
 
 
   markObject((Obj*)vm.initString);
@@ -326,81 +540,482 @@ static void traceReferences() {
 }
 
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
+// Drops everything from the remembered set at the end of marking but the
+// functions, classes and enums that survive, which marking remembered
+// as it blackened them. Sweeping then never has to touch the set.
+static void pruneRemembered() {
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+#ifdef GENERATIONAL_GC
+    if (object->isMarked && isAlwaysRemembered(object)) {
+      vm.remembered[count++] = object;
+      continue;
+    }
+#endif
+    object->isRemembered = false;
+  }
+
+  vm.rememberedCount = count;
+}
 
-      object->isMarked = false;
 
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
+#ifdef GENERATIONAL_GC
+// Traces the old objects that may refer to young ones. Once the young
+// ones are promoted, only the objects that are always remembered need to
+// stay.
+static void traceRemembered() {
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+    blackenObject(object);
 
-      freeObject(unreached);
+    if (isAlwaysRemembered(object)) {
+      vm.remembered[count++] = object;
+    } else {
+      object->isRemembered = false;
     }
   }
+
+  vm.rememberedCount = count;
 }
 
 
-void collectGarbage() {
+// Collects only the objects allocated since the last collection. Old
+// objects are still marked, so tracing stops at them, except for those
+// in the remembered set.
+static void collectNursery() {
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  printf("-- minor gc begin\n");
 
   size_t before = vm.bytesAllocated;
 
 #endif
 
+  markRoots();
+  traceRemembered();
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+
+  Obj* object = vm.nursery;
+  vm.nursery = NULL;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->isMarked) {
+      // It stays marked, which is what makes it old.
+      if (isAlwaysRemembered(object)) rememberObject(object);
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      freeObject(object);
+    }
+    object = next;
+  }
 
+  vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
 
-  markRoots();
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
 
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
 
-  traceReferences();
+#endif
 
+}
+#endif
 
-  tableRemoveWhite(&vm.strings);
 
+#ifdef DEBUG_LOG_GC
+static size_t cycleStartBytes;
+#endif
+
+// Whether the mutator has run since the full collection in progress
+// started marking.
+static bool markingPaused;
 
-  sweep();
+// Where the sweep links the next survivor. Appending them keeps the old
+// objects in the order they were promoted, as sweeping in place did,
+// which later walks over them are a lot faster for.
+static Obj** sweepTail;
 
+// Frees [object] if it was not reached, or links it at [tail]. Returns
+// where to link the next survivor.
+static Obj** sweepObject(Obj* object, Obj** tail) {
+  if (!object->isMarked) {
+    freeObject(object);
+    return tail;
+  }
 
+  // Under the generational collector it stays marked, which is what
+  // makes it old.
+#ifndef GENERATIONAL_GC
+  object->isMarked = false;
+#endif
+  object->next = NULL;
+  *tail = object;
+  return &object->next;
+}
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
+#ifdef GENERATIONAL_GC
+// With vm.backgroundSweep set, a full collection hands the objects it is
+// done marking to a helper thread, which frees the dead ones and links
+// the live ones into a list of its own. The main thread takes that list
+// back before the next full collection clears marks. Until then nothing
+// reads the links of the handed over objects, survivors stay marked, and
+// the remembered set no longer holds dead ones, so the threads never
+// write the same memory.
+static bool sweeperStarted;
+static pthread_t sweeper;
+static pthread_mutex_t sweepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweepChanged = PTHREAD_COND_INITIALIZER;
+
+// Guarded by sweepLock.
+static bool sweepPending;
+static bool sweeperExiting;
+static Obj* sweepOld;
+static Obj* sweepYoung;
+static Obj* sweptObjects;
+static Obj** sweptTail;
+static size_t sweptBytes;
+#ifdef SLAB_ALLOCATOR
+static CellLists sweptCells;
+#endif
+
+// Whether vm.nextGC was set before the sweeper freed what it was handed.
+static bool nextGCEarly;
+
+
+static Obj** sweepList(Obj* object, Obj** tail) {
+  while (object != NULL) {
+    Obj* next = object->next;
+    tail = sweepObject(object, tail);
+    object = next;
+  }
+  return tail;
+}
+
+
+static void* runSweeper(void* unused) {
+  onSweeper = true;
+
+  pthread_mutex_lock(&sweepLock);
+  for (;;) {
+    while (!sweepPending && !sweeperExiting) {
+      pthread_cond_wait(&sweepChanged, &sweepLock);
+    }
+    if (!sweepPending) break;
+
+    Obj* old = sweepOld;
+    Obj* young = sweepYoung;
+    pthread_mutex_unlock(&sweepLock);
+
+    Obj* survivors = NULL;
+    Obj** tail = sweepList(old, &survivors);
+    tail = sweepList(young, tail);
+
+    pthread_mutex_lock(&sweepLock);
+    sweptObjects = survivors;
+    sweptTail = tail;
+    sweptBytes += sweeperFreed;
+    sweeperFreed = 0;
+#ifdef SLAB_ALLOCATOR
+    slabMoveCells(&sweeperCells, &sweptCells);
+#endif
+    sweepPending = false;
+    pthread_cond_broadcast(&sweepChanged);
+  }
+  pthread_mutex_unlock(&sweepLock);
+  return NULL;
+}
+
+
+// Hands the unswept objects to the sweeper thread, starting it the first
+// time. If it can't be started, they are swept here as usual.
+static void sweepInBackground() {
+  if (!sweeperStarted) {
+    if (pthread_create(&sweeper, NULL, runSweeper, NULL) != 0) return;
+    sweeperStarted = true;
+  }
+
+  pthread_mutex_lock(&sweepLock);
+  sweepOld = vm.unswept;
+  sweepYoung = vm.unsweptYoung;
+  sweepPending = true;
+  pthread_cond_broadcast(&sweepChanged);
+  pthread_mutex_unlock(&sweepLock);
+
+  vm.unswept = NULL;
+  vm.unsweptYoung = NULL;
+  nextGCEarly = true;
+}
+
+
+// Takes in what the sweeper has freed. Called with sweepLock held.
+static void takeSweptBytes() {
+  vm.bytesAllocated -= sweptBytes;
+  vm.nextMinorGC -= sweptBytes;
+  sweptBytes = 0;
+#ifdef SLAB_ALLOCATOR
+  slabMoveCells(&sweptCells, NULL);
+#endif
+
+  if (nextGCEarly && !sweepPending) {
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    nextGCEarly = false;
+#ifdef SLAB_ALLOCATOR
+    releaseEmptyPages();
+#endif
+  }
+}
+
+
+static void countSweptBytes() {
+  if (!sweeperStarted) return;
+
+  pthread_mutex_lock(&sweepLock);
+  takeSweptBytes();
+  pthread_mutex_unlock(&sweepLock);
+}
+
+
+// Waits for the sweeper to finish, and takes back the objects it kept.
+static void finishBackgroundSweep() {
+  if (!sweeperStarted) return;
+
+  pthread_mutex_lock(&sweepLock);
+  while (sweepPending) pthread_cond_wait(&sweepChanged, &sweepLock);
+
+  if (sweptObjects != NULL) {
+    *sweptTail = vm.objects;
+    vm.objects = sweptObjects;
+    sweptObjects = NULL;
+  }
+  takeSweptBytes();
+  pthread_mutex_unlock(&sweepLock);
+}
+
+
+static void stopSweeper() {
+  if (!sweeperStarted) return;
+
+  finishBackgroundSweep();
+
+  pthread_mutex_lock(&sweepLock);
+  sweeperExiting = true;
+  pthread_cond_broadcast(&sweepChanged);
+  pthread_mutex_unlock(&sweepLock);
+
+  pthread_join(sweeper, NULL);
+  sweeperStarted = false;
+  sweeperExiting = false;
+}
+#endif
+
+// Starts a full collection. It is carried out by gcStep().
+static void startCycle() {
+#ifdef GENERATIONAL_GC
+  finishBackgroundSweep();
+#endif
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+
+  cycleStartBytes = vm.bytesAllocated;
+
+#endif
+
+  markingPaused = false;
+
+#ifdef GENERATIONAL_GC
+  // Old objects are still marked, so they are made white first.
+  vm.gcPhase = GC_CLEAR;
+  vm.gcCursor = vm.objects;
+#else
+  vm.gcPhase = GC_MARK;
+  markRoots();
+#endif
+}
+
+
+// The part of marking that is not split up. Roots take no write barrier,
+// so if the mutator ran in between steps they are marked again, and so
+// are the functions, classes and enums blackened so far, which don't
+// either. The objects there are now get swept, and allocation starts over
+// with an empty nursery.
+static void finishMarking() {
+  if (markingPaused) {
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+      if (vm.remembered[i]->isMarked) blackenObject(vm.remembered[i]);
+    }
+    traceReferences();
+  }
 
+  tableRemoveWhite(&vm.strings);
+  pruneRemembered();
+
+  vm.unswept = vm.objects;
+  vm.unsweptYoung = vm.nursery;
+  vm.objects = NULL;
+  vm.nursery = NULL;
+  sweepTail = &vm.objects;
+  vm.gcPhase = GC_SWEEP;
+}
+
+
+static void finishCycle() {
+  vm.gcPhase = GC_IDLE;
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+
+#ifdef SLAB_ALLOCATOR
+  // If the sweeper thread has the objects, takeSweptBytes() does this
+  // once it is done with them.
+#ifdef GENERATIONAL_GC
+  if (!nextGCEarly) releaseEmptyPages();
+#else
+  releaseEmptyPages();
+#endif
+#endif
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
 
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
+         cycleStartBytes - vm.bytesAllocated, cycleStartBytes,
+         vm.bytesAllocated, vm.nextGC);
 
 #endif
+}
+
 
+static int64_t stepDeadline;
+static int stepWork;
+
+// Wall time in microseconds. Pauses are measured with it rather than with
+// clock(), which counts the CPU time of every thread, the sweeper's too.
+static int64_t nowMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Counts one unit of work, which clears, blackens or sweeps one object,
+// and tells whether the step is out of time. A step that finishes the
+// collection never is.
+static bool stepOverBudget(bool finish) {
+  if (finish) return false;
+  stepWork++;
+  return stepWork >= GC_STEP_MIN_WORK && stepWork % GC_WORK_CHECK == 0 &&
+         nowMicros() >= stepDeadline;
 }
 
 
-void freeObjects() {
-  Obj* object = vm.objects;
+// Does the next part of the full collection in progress, for as long as
+// vm.gcPauseBudget allows, or all of it if [finish] is set.
+static void gcStep(bool finish) {
+  if (!finish) {
+    stepDeadline = nowMicros() + vm.gcPauseBudget;
+    stepWork = 0;
+  }
+
+  if (vm.gcPhase == GC_CLEAR) {
+    while (vm.gcCursor != NULL) {
+      if (stepOverBudget(finish)) {
+        markingPaused = true;
+        vm.nextGCStep = vm.bytesAllocated + GC_STEP_SIZE;
+        return;
+      }
+      vm.gcCursor->isMarked = false;
+      vm.gcCursor = vm.gcCursor->next;
+    }
+
+    vm.gcPhase = GC_MARK;
+    markRoots();
+  }
+
+  if (vm.gcPhase == GC_MARK) {
+    while (vm.grayCount > 0) {
+      if (stepOverBudget(finish)) {
+        markingPaused = true;
+        vm.nextGCStep = vm.bytesAllocated + GC_STEP_SIZE;
+        return;
+      }
+      blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+
+    finishMarking();
+#ifdef GENERATIONAL_GC
+    if (vm.backgroundSweep && vm.bytesAllocated > GC_THREAD_MIN_HEAP) {
+      sweepInBackground();
+    }
+#endif
+  }
+
+  for (;;) {
+    if (vm.unswept == NULL) {
+      if (vm.unsweptYoung == NULL) break;
+      vm.unswept = vm.unsweptYoung;
+      vm.unsweptYoung = NULL;
+    }
+
+    if (stepOverBudget(finish)) {
+      vm.nextGCStep = vm.bytesAllocated + GC_STEP_SIZE;
+      return;
+    }
+
+    Obj* object = vm.unswept;
+    vm.unswept = object->next;
+    sweepTail = sweepObject(object, sweepTail);
+  }
+
+  finishCycle();
+}
+
+
+// Starts a full collection, and runs all of it unless it is to be done
+// in steps.
+static void startCollection() {
+  startCycle();
+  gcStep(vm.gcPauseBudget == 0);
+}
+
+
+void collectGarbage() {
+  if (vm.gcPhase == GC_IDLE) startCycle();
+  gcStep(true);
+}
+
+
+static void freeList(Obj* object) {
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+
+void freeObjects() {
+#ifdef GENERATIONAL_GC
+  stopSweeper();
+#endif
+
+  freeList(vm.objects);
+  freeList(vm.nursery);
+  freeList(vm.unswept);
+  freeList(vm.unsweptYoung);
 
 
   free(vm.grayStack);
+  free(vm.remembered);
+
+#ifdef SLAB_ALLOCATOR
+  freeSlabs();
+#endif
 
 }
 
@@ -28,9 +28,17 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Bytes allocated between minor collections.
+#define GC_NURSERY_SIZE (1024 * 1024)
+
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+// Memory for an object of [size] bytes, counted the same way as by
+// reallocate(). Small objects come from the pages in slab.c.
+void* allocateCell(size_t size);
+void freeCell(void* cell, size_t size);
+
 
 void markObject(Obj* object);
 
@@ -40,6 +48,23 @@ void markValue(Value value);
 
 void collectGarbage();
 
+// The slow path of writeBarrier().
+void recordWrite(Obj* object, Obj* value);
+
+// Has to follow every store of [value] into [object], unless nothing was
+// allocated since [object] was. A minor collection only traces the old
+// objects recorded here, so an old object that gets its first reference to
+// a young one has to be among them. Old objects are the marked ones,
+// which between collections can only be objects that survived one.
+//
+// While a full collection is marking in steps, the same test finds black
+// or gray objects getting a white one, and the white one is shaded.
+static inline void writeBarrier(Obj* object, Value value) {
+  if (object->isMarked && IS_OBJ(value) && !AS_OBJ(value)->isMarked) {
+    recordWrite(object, AS_OBJ(value));
+  }
+}
+
 
 void freeObjects();
 
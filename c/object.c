@@ -14,14 +14,15 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = (Obj*)allocateCell(size);
   object->type = type;
 
   object->isMarked = false;
+  object->isRemembered = false;
 
   
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm.nursery;
+  vm.nursery = object;
 
 
 #ifdef DEBUG_LOG_GC
@@ -44,10 +45,76 @@ ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods);
+  klass->vtable = NULL;
+  klass->vtableCount = 0;
+  klass->sparseMethods = false;
+  klass->initializer = NULL;
+  initShape(&klass->rootShape, NULL, NULL);
+  klass->shapeCount = 1;
+  klass->fieldHint = 0;
 
   return klass;
 }
 
+// Method slots are numbered across every class, so a class whose method
+// names were first bound late in the program needs a long vtable for only a
+// few methods. Past this many entries per method it keeps none.
+#define VTABLE_MAX_SPREAD 4
+#define VTABLE_MIN_SIZE 64
+
+static void dropVtable(ObjClass* klass) {
+  FREE_ARRAY(ObjClosure*, klass->vtable, klass->vtableCount);
+  klass->vtable = NULL;
+  klass->vtableCount = 0;
+  klass->sparseMethods = true;
+}
+
+static void growVtable(ObjClass* klass, int count) {
+  if (klass->sparseMethods || count <= klass->vtableCount) return;
+
+  if (count > VTABLE_MIN_SIZE &&
+      count > klass->methods.count * VTABLE_MAX_SPREAD) {
+    dropVtable(klass);
+    return;
+  }
+
+  klass->vtable = GROW_ARRAY(ObjClosure*, klass->vtable,
+                             klass->vtableCount, count);
+  for (int i = klass->vtableCount; i < count; i++) {
+    klass->vtable[i] = NULL;
+  }
+  klass->vtableCount = count;
+}
+
+void classSetMethod(ObjClass* klass, ObjString* name, ObjClosure* method) {
+  tableSet(&klass->methods, name, OBJ_VAL(method));
+
+  if (name->methodSlot == -1) name->methodSlot = vm.methodSlotCount++;
+  growVtable(klass, name->methodSlot + 1);
+  if (!klass->sparseMethods) klass->vtable[name->methodSlot] = method;
+
+  if (name == vm.initString) klass->initializer = method;
+}
+
+void classInherit(ObjClass* subclass, ObjClass* superclass) {
+  tableAddAll(&superclass->methods, &subclass->methods);
+  subclass->initializer = superclass->initializer;
+
+  if (superclass->sparseMethods) {
+    dropVtable(subclass);
+    return;
+  }
+
+  growVtable(subclass, superclass->vtableCount);
+  if (subclass->sparseMethods) return;
+
+  for (int i = 0; i < superclass->vtableCount; i++) {
+    if (superclass->vtable[i] != NULL) {
+      subclass->vtable[i] = superclass->vtable[i];
+    }
+  }
+}
+
 ObjEnum *newEnum(ObjString* name) {
     ObjEnum* _enum = ALLOCATE_OBJ(ObjEnum, OBJ_ENUM);
     _enum->name = name;
@@ -78,17 +145,99 @@ ObjFunction* newFunction() {
   function->arity = 0;
   function->upvalueCount = 0;
   function->name = NULL;
+  function->maxSlots = 0;
+  function->hotness = 0;
+  function->jit = NULL;
+  function->lazy = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  int capacity = klass->fieldHint;
+  ObjInstance* instance = (ObjInstance*)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = &klass->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = capacity;
+  instance->dictionary = NULL;
+  instance->inlineCapacity = capacity;
   return instance;
 }
 
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dictionary, name, value);
+  }
+
+  int slot = shapeFieldSlot(instance->shape, name);
+  if (slot == -1) return false;
+
+  *value = instance->fields[slot];
+  return true;
+}
+
+static void toDictionaryMode(ObjInstance* instance) {
+  Table* dictionary = ALLOCATE(Table, 1);
+  initTable(dictionary);
+
+  // Build the table before switching over so the fields stay reachable if
+  // filling it triggers a collection.
+  for (Shape* shape = instance->shape; shape->parent != NULL;
+       shape = shape->parent) {
+    tableSet(dictionary, shape->name, instance->fields[shape->fieldCount - 1]);
+  }
+
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  }
+
+  instance->shape = NULL;
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->dictionary = dictionary;
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeFieldSlot(instance->shape, name);
+    if (slot != -1) {
+      instance->fields[slot] = value;
+      writeBarrier((Obj*)instance, value);
+      return;
+    }
+
+    Shape* shape = shapeTransition(instance->klass, instance->shape, name);
+    if (shape != NULL) {
+      if (shape->fieldCount > instance->fieldCapacity) {
+        int capacity = GROW_CAPACITY(instance->fieldCapacity);
+        Value* fields = ALLOCATE(Value, capacity);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          fields[i] = instance->fields[i];
+        }
+
+        if (instance->fields != instance->inlineFields) {
+          FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+        }
+        instance->fields = fields;
+        instance->fieldCapacity = capacity;
+      }
+
+      instance->fields[shape->fieldCount - 1] = value;
+      instance->shape = shape;
+      writeBarrier((Obj*)instance, value);
+      return;
+    }
+
+    toDictionaryMode(instance);
+  }
+
+  tableSet(instance->dictionary, name, value);
+  writeBarrier((Obj*)instance, OBJ_VAL(name));
+  writeBarrier((Obj*)instance, value);
+}
+
 ObjNative* newNative(NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
@@ -100,7 +249,9 @@ static ObjString* allocateString(char* chars, int length,
   ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
+  string->ownsChars = true;
   string->hash = hash;
+  string->methodSlot = -1;
 
   push(OBJ_VAL(string));
 
@@ -148,6 +299,18 @@ ObjString* copyString(const char* chars, int length) {
   return allocateString(heapChars, length, hash);
 }
 
+ObjString* borrowString(const char* chars, int length) {
+  uint32_t hash = hashString(chars, length);
+
+  ObjString* interned = tableFindString(&vm.strings, chars, length,
+                                        hash);
+  if (interned != NULL) return interned;
+
+  ObjString* string = allocateString((char*)chars, length, hash);
+  string->ownsChars = false;
+  return string;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
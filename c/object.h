@@ -6,6 +6,8 @@
 
 #include "chunk.h"
 
+#include "shape.h"
+
 
 #include "table.h"
 
@@ -91,7 +93,10 @@ typedef enum {
 struct Obj {
   ObjType type;
 
+  // With the generational collector, objects that survived a collection
+  // stay marked until the next full one. See memory.c.
   bool isMarked;
+  bool isRemembered;
 
 
   struct Obj* next;
@@ -99,6 +104,29 @@ struct Obj {
 };
 
 
+typedef struct JitCode JitCode;
+
+// The body of a function that is compiled on its first call, and what
+// compiling it needs from the code around it. See compileLazily().
+typedef struct {
+  // Copy of the whole script, kept alive while any of its bodies is still
+  // uncompiled, and where the parameter list of this one starts in it.
+  ObjString* source;
+  int start;
+  int line;
+
+  // The compiler's FunctionType for the function, and whether it sits in
+  // a class, and one with a superclass, for `this` and `super`.
+  uint8_t type;
+  bool inClass;
+  bool hasSuperclass;
+
+  // Names of the variables the function captures, in upvalue order.
+  ObjString** upvalueNames;
+  int upvalueCount;
+  int upvalueCapacity;
+} LazyBody;
+
 typedef struct {
   Obj obj;
   int arity;
@@ -107,6 +135,18 @@ typedef struct {
 
   Chunk chunk;
   ObjString* name;
+
+  // Stack slots a call needs, from the callee slot up. The VM makes room
+  // for them once per call instead of checking each push.
+  int maxSlots;
+
+  // Calls and loop iterations so far, or -1 once the JIT has given up on
+  // the function. See jit.h.
+  int hotness;
+  JitCode* jit;
+
+  // Set until the body is compiled, for functions compiled lazily.
+  LazyBody* lazy;
 } ObjFunction;
 
 
@@ -125,8 +165,15 @@ struct ObjString {
   int length;
   char* chars;
 
+  // False when [chars] belongs to a mapped bytecode image instead.
+  bool ownsChars;
+
   uint32_t hash;
 
+  // Index into every class's method vector when this string names a
+  // method, or -1. Assigned the first time a method by this name is bound.
+  int methodSlot;
+
 };
 
 
@@ -142,24 +189,46 @@ typedef struct ObjUpvalue {
 } ObjUpvalue;
 
 
-typedef struct {
+struct ObjClosure {
   Obj obj;
   ObjFunction* function;
 
   ObjUpvalue** upvalues;
   int upvalueCount;
 
-} ObjClosure;
+};
 
 
 
-typedef struct {
+struct ObjClass {
   Obj obj;
   ObjString* name;
 
   Table methods;
 
-} ObjClass;
+  // The same methods indexed by ObjString.methodSlot. Entries for names the
+  // class does not define are NULL.
+  ObjClosure** vtable;
+  int vtableCount;
+
+  // Set once the slots of the class's method names are spread too thinly
+  // for a vtable to pay off. The class then has none and methods are
+  // looked up in [methods].
+  bool sparseMethods;
+
+  // The class's "init" method, or NULL. Kept in sync with [methods] so
+  // constructing an instance needs no lookup.
+  ObjClosure* initializer;
+
+  // Root of the class's shape tree: the shape of a new instance.
+  Shape rootShape;
+  int shapeCount;
+
+  // Most fields any shape of this class has. New instances reserve this
+  // many inline slots.
+  int fieldHint;
+
+};
 
 typedef struct {
     Obj obj;
@@ -172,7 +241,18 @@ typedef struct {
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields; 
+
+  // Field values indexed by the slots in [shape]. Points at [inlineFields]
+  // until the instance outgrows them.
+  Shape* shape;
+  Value* fields;
+  int fieldCapacity;
+
+  // Fields of an instance in dictionary mode, where [shape] is NULL.
+  Table* dictionary;
+
+  int inlineCapacity;
+  Value inlineFields[];
 } ObjInstance;
 
 
@@ -209,6 +289,12 @@ ObjBoundMethod* newBoundMethod(Value receiver,
 
 ObjClass* newClass(ObjString* name);
 
+
+void classSetMethod(ObjClass* klass, ObjString* name, ObjClosure* method);
+
+
+void classInherit(ObjClass* subclass, ObjClass* superclass);
+
 ObjEnum* newEnum(ObjString* name);
 
 ObjClosure* newClosure(ObjFunction* function);
@@ -220,6 +306,12 @@ ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 
 
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+
+
 ObjNative* newNative(NativeFn function);
 
 
@@ -228,6 +320,10 @@ ObjString* takeString(char* chars, int length);
 
 ObjString* copyString(const char* chars, int length);
 
+// Interns [chars] without copying them. They must be NUL-terminated and
+// outlive the VM.
+ObjString* borrowString(const char* chars, int length);
+
 ObjUpvalue* newUpvalue(Value* slot);
 
 ObjList* newList();
@@ -252,5 +348,15 @@ static inline ObjType getObjType(Value value) {
   return AS_OBJ(value)->type;
 }
 
+static inline ObjClosure* findMethod(ObjClass* klass, ObjString* name) {
+  int slot = name->methodSlot;
+  if (slot >= 0 && slot < klass->vtableCount) return klass->vtable[slot];
+  if (!klass->sparseMethods) return NULL;
+
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) return NULL;
+  return AS_CLOSURE(method);
+}
+
 
 #endif
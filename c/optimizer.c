@@ -0,0 +1,381 @@
+#include "memory.h"
+#include "optimizer.h"
+
+// A superinstruction replaces a run of instructions starting at some offset.
+// The run may only be fused if nothing jumps into the middle of it.
+typedef struct {
+  OpCode op;
+  int oldLength;
+  int newLength;
+} Fusion;
+
+static bool isJump(Chunk* chunk, int offset) {
+  uint8_t instruction = chunk->code[offset];
+  if (instruction == OP_WIDE) instruction = chunk->code[offset + 1];
+
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP || instruction == OP_GUARD_CALL ||
+         instruction == OP_GUARD_INVOKE;
+}
+
+static bool isBackward(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  return (code[0] == OP_WIDE ? code[1] : code[0]) == OP_LOOP;
+}
+
+// Decodes up to [max] instructions starting at [offset] into [starts] and
+// returns how many could be used for fusion: decoding stops at the end of
+// the chunk and before any instruction that is a jump target.
+static int decodeRun(Chunk* chunk, bool* isTarget, int offset,
+                     int* starts, int max) {
+  int count = 0;
+
+  while (count < max && offset < chunk->count) {
+    if (count > 0 && isTarget[offset]) break;
+    starts[count++] = offset;
+    offset += instructionLength(chunk, offset);
+  }
+
+  return count;
+}
+
+#ifdef REGISTER_OPS
+// Returns the register form of arithmetic [instruction] with a slot or
+// constant second operand, or -1 if it has none.
+static int registerOp(uint8_t instruction, bool constant) {
+  int base = constant ? OP_ADD_RRK : OP_ADD_RRR;
+
+  switch (instruction) {
+    case OP_ADD:      return base;
+    case OP_SUBTRACT: return base + 1;
+    case OP_MULTIPLY: return base + 2;
+    case OP_DIVIDE:   return base + 3;
+    default:          return -1;
+  }
+}
+#endif
+
+static Fusion matchFusion(Chunk* chunk, bool* isTarget, int offset) {
+  Fusion fusion = {OP_POP, 0, 0};
+
+  int starts[5];
+  int count = decodeRun(chunk, isTarget, offset, starts, 5);
+
+  uint8_t ops[5];
+  for (int i = 0; i < count; i++) {
+    ops[i] = chunk->code[starts[i]];
+  }
+
+#ifdef REGISTER_OPS
+  // local = local <op> (local | constant);
+  if (count == 5 && ops[0] == OP_GET_LOCAL &&
+      (ops[1] == OP_GET_LOCAL || ops[1] == OP_CONSTANT) &&
+      ops[3] == OP_SET_LOCAL && ops[4] == OP_POP) {
+    int op = registerOp(ops[2], ops[1] == OP_CONSTANT);
+    if (op != -1) {
+      fusion.op = (OpCode)op;
+      fusion.oldLength = starts[4] + 1 - offset;
+      fusion.newLength = 4;
+      return fusion;
+    }
+  }
+#endif
+
+  if (count >= 3 && ops[0] == OP_GET_LOCAL && ops[1] == OP_CONSTANT) {
+    if (count == 5 && ops[2] == OP_LESS && ops[3] == OP_JUMP_IF_FALSE &&
+        ops[4] == OP_POP) {
+      fusion.op = OP_LESS_LOCAL_CONST_JUMP;
+      fusion.oldLength = starts[4] + 1 - offset;
+      fusion.newLength = 5;
+      return fusion;
+    }
+
+    if (ops[2] == OP_ADD || ops[2] == OP_SUBTRACT) {
+      fusion.op = ops[2] == OP_ADD ? OP_ADD_LOCAL_CONST
+                                   : OP_SUBTRACT_LOCAL_CONST;
+      fusion.oldLength = starts[2] + 1 - offset;
+      fusion.newLength = 3;
+      return fusion;
+    }
+  }
+
+  if (count >= 2 && ops[0] == OP_GET_LOCAL && ops[1] == OP_GET_LOCAL) {
+    fusion.op = OP_GET_LOCAL_2;
+    fusion.oldLength = 4;
+    fusion.newLength = 3;
+    return fusion;
+  }
+
+  if (count >= 2 && ops[0] == OP_SET_LOCAL && ops[1] == OP_POP) {
+    fusion.op = OP_SET_LOCAL_POP;
+    fusion.oldLength = 3;
+    fusion.newLength = 2;
+    return fusion;
+  }
+
+  return fusion;
+}
+
+static void writeByte(Chunk* chunk, int* offset, uint8_t byte, int line) {
+  chunk->code[*offset] = byte;
+  addLine(chunk, *offset, line);
+  (*offset)++;
+}
+
+static void writeJumpOffset(Chunk* chunk, int* offset, int jump,
+                            int line) {
+  writeByte(chunk, offset, (jump >> 8) & 0xff, line);
+  writeByte(chunk, offset, jump & 0xff, line);
+}
+
+// Copies the jump at [offset] in [from] to [*write] in [to], aimed at
+// [target]. [widen] puts it behind OP_WIDE; otherwise it keeps its width.
+static void writeJump(Chunk* from, int offset, Chunk* to, int* write,
+                      int target, bool widen) {
+  uint8_t* code = &from->code[offset];
+  int line = getLine(from, offset);
+  int length = instructionLength(from, offset);
+  bool wide = code[0] == OP_WIDE;
+
+  int end = *write + length + (widen ? 2 : 0);
+  int jump = isBackward(from, offset) ? end - target : target - end;
+
+  if (widen) writeByte(to, write, OP_WIDE, line);
+  for (int i = 0; i < length - (wide ? 3 : 2); i++) {
+    writeByte(to, write, code[i], line);
+  }
+  if (wide || widen) writeByte(to, write, (jump >> 16) & 0xff, line);
+  writeJumpOffset(to, write, jump, line);
+}
+
+// Peephole pass that fuses hot instruction sequences into the
+// superinstructions declared at the end of OpCode. Fusing only ever
+// shrinks the code, so the chunk is rewritten in place and every jump is
+// re-targeted afterwards.
+void optimizeChunk(Chunk* chunk) {
+  int count = chunk->count;
+  if (count == 0) return;
+
+  bool* isTarget = ALLOCATE(bool, count + 1);
+  int* newOffsets = ALLOCATE(int, count + 1);
+
+  for (int i = 0; i <= count; i++) {
+    isTarget[i] = false;
+  }
+
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    if (isJump(chunk, offset)) {
+      isTarget[jumpTarget(chunk, offset)] = true;
+    }
+  }
+
+  // Lay out the optimized code so jumps can be patched as it is written.
+  int newOffset = 0;
+  for (int offset = 0; offset < count;) {
+    Fusion fusion = matchFusion(chunk, isTarget, offset);
+    newOffsets[offset] = newOffset;
+
+    if (fusion.oldLength > 0) {
+      offset += fusion.oldLength;
+      newOffset += fusion.newLength;
+    } else {
+      int length = instructionLength(chunk, offset);
+      offset += length;
+      newOffset += length;
+    }
+  }
+  newOffsets[count] = newOffset;
+
+  // The line table is rebuilt as the code is written, so lines are read
+  // from the old one through [old].
+  Chunk old = *chunk;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
+  chunk->lines = NULL;
+
+  int write = 0;
+  for (int offset = 0; offset < count;) {
+    Fusion fusion = matchFusion(chunk, isTarget, offset);
+    uint8_t* code = &chunk->code[offset];
+    int line = getLine(&old, offset);
+
+    if (fusion.oldLength == 0) {
+      int length = instructionLength(chunk, offset);
+
+      // Fusion only shortens the code, so every jump keeps its width.
+      if (isJump(chunk, offset)) {
+        writeJump(&old, offset, chunk, &write,
+                  newOffsets[jumpTarget(chunk, offset)], false);
+      } else {
+        for (int i = 0; i < length; i++) {
+          writeByte(chunk, &write, code[i], line);
+        }
+      }
+
+      offset += length;
+      continue;
+    }
+
+    switch (fusion.op) {
+      case OP_LESS_LOCAL_CONST_JUMP: {
+        uint8_t slot = code[1];
+        uint8_t constant = code[3];
+        int target = newOffsets[jumpTarget(chunk, offset + 5)];
+
+        writeByte(chunk, &write, fusion.op, line);
+        writeByte(chunk, &write, slot, line);
+        writeByte(chunk, &write, constant, line);
+        writeJumpOffset(chunk, &write, target - (write + 2), line);
+        break;
+      }
+
+      case OP_ADD_LOCAL_CONST:
+      case OP_SUBTRACT_LOCAL_CONST:
+      case OP_GET_LOCAL_2: {
+        uint8_t first = code[1];
+        uint8_t second = code[3];
+
+        writeByte(chunk, &write, fusion.op, line);
+        writeByte(chunk, &write, first, line);
+        writeByte(chunk, &write, second, line);
+        break;
+      }
+
+      case OP_ADD_RRR:
+      case OP_SUBTRACT_RRR:
+      case OP_MULTIPLY_RRR:
+      case OP_DIVIDE_RRR:
+      case OP_ADD_RRK:
+      case OP_SUBTRACT_RRK:
+      case OP_MULTIPLY_RRK:
+      case OP_DIVIDE_RRK: {
+        uint8_t left = code[1];
+        uint8_t right = code[3];
+        uint8_t dest = code[6];
+
+        writeByte(chunk, &write, fusion.op, line);
+        writeByte(chunk, &write, dest, line);
+        writeByte(chunk, &write, left, line);
+        writeByte(chunk, &write, right, line);
+        break;
+      }
+
+      case OP_SET_LOCAL_POP: {
+        uint8_t slot = code[1];
+
+        writeByte(chunk, &write, fusion.op, line);
+        writeByte(chunk, &write, slot, line);
+        break;
+      }
+
+      default:
+        break;
+    }
+
+    offset += fusion.oldLength;
+  }
+
+  chunk->count = write;
+  FREE_ARRAY(LineStart, old.lines, old.lineCapacity);
+
+  FREE_ARRAY(bool, isTarget, count + 1);
+  FREE_ARRAY(int, newOffsets, count + 1);
+}
+
+// Widens every jump whose offset no longer fits in two bytes into its
+// OP_WIDE form. That moves the code after it, which can push other jumps
+// out of range in turn, so the layout is redone until nothing changes.
+void relaxJumps(Chunk* chunk, LongJump* longJumps, int longJumpCount) {
+  int count = chunk->count;
+  int* targets = ALLOCATE(int, count + 1);
+  int* newOffsets = ALLOCATE(int, count + 1);
+  bool* widen = ALLOCATE(bool, count + 1);
+
+  // Long jumps are keyed by their operand, which ends the instruction.
+  int* longTargets = ALLOCATE(int, count + 1);
+  for (int i = 0; i <= count; i++) longTargets[i] = -1;
+  for (int i = 0; i < longJumpCount; i++) {
+    longTargets[longJumps[i].operand] = longJumps[i].target;
+  }
+
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    targets[offset] = -1;
+    widen[offset] = false;
+    if (!isJump(chunk, offset)) continue;
+
+    int operand = offset + instructionLength(chunk, offset) - 2;
+    targets[offset] = longTargets[operand] != -1 ? longTargets[operand]
+                                                 : jumpTarget(chunk, offset);
+    widen[offset] = longTargets[operand] != -1;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    int newOffset = 0;
+    for (int offset = 0; offset < count;) {
+      int length = instructionLength(chunk, offset);
+      newOffsets[offset] = newOffset;
+      newOffset += length + (widen[offset] ? 2 : 0);
+      offset += length;
+    }
+    newOffsets[count] = newOffset;
+
+    for (int offset = 0; offset < count;
+         offset += instructionLength(chunk, offset)) {
+      uint8_t instruction = chunk->code[offset];
+      if (targets[offset] == -1 || widen[offset] ||
+          (instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE &&
+           instruction != OP_LOOP)) {
+        continue;
+      }
+
+      int end = newOffsets[offset] + 3;
+      int target = newOffsets[targets[offset]];
+      int jump = instruction == OP_LOOP ? end - target : target - end;
+      if (jump > UINT16_MAX) {
+        widen[offset] = true;
+        changed = true;
+      }
+    }
+  }
+
+  // The old code stays readable through [old] while the chunk is rewritten
+  // into arrays of the new size.
+  Chunk old = *chunk;
+  int newCount = newOffsets[count];
+  chunk->code = ALLOCATE(uint8_t, newCount);
+  chunk->capacity = newCount;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
+  chunk->lines = NULL;
+
+  int write = 0;
+  for (int offset = 0; offset < count;) {
+    int length = instructionLength(&old, offset);
+
+    if (targets[offset] != -1) {
+      writeJump(&old, offset, chunk, &write, newOffsets[targets[offset]],
+                widen[offset]);
+    } else {
+      for (int i = 0; i < length; i++) {
+        writeByte(chunk, &write, old.code[offset + i],
+                  getLine(&old, offset));
+      }
+    }
+
+    offset += length;
+  }
+  chunk->count = write;
+
+  FREE_ARRAY(uint8_t, old.code, old.capacity);
+  FREE_ARRAY(LineStart, old.lines, old.lineCapacity);
+
+  FREE_ARRAY(int, targets, count + 1);
+  FREE_ARRAY(int, newOffsets, count + 1);
+  FREE_ARRAY(bool, widen, count + 1);
+  FREE_ARRAY(int, longTargets, count + 1);
+}
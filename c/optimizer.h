@@ -0,0 +1,16 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// A forward jump whose offset did not fit in two bytes. The compiler
+// leaves its operand unpatched and records where it lands instead.
+typedef struct {
+  int operand;
+  int target;
+} LongJump;
+
+void optimizeChunk(Chunk* chunk);
+void relaxJumps(Chunk* chunk, LongJump* longJumps, int longJumpCount);
+
+#endif
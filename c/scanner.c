@@ -14,9 +14,13 @@ typedef struct {
 Scanner scanner;
 
 void initScanner(const char* source) {
+  initScannerAt(source, 1);
+}
+
+void initScannerAt(const char* source, int line) {
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
 }
 
 
@@ -43,6 +43,9 @@ typedef struct {
 
 void initScanner(const char* source);
 
+// Starts scanning [source] as if it began on [line].
+void initScannerAt(const char* source, int line);
+
 Token scanToken();
 
 
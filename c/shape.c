@@ -0,0 +1,73 @@
+#include "memory.h"
+#include "object.h"
+#include "shape.h"
+
+void initShape(Shape* shape, Shape* parent, ObjString* name) {
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->slots);
+  shape->transitions = NULL;
+  shape->transitionCount = 0;
+  shape->transitionCapacity = 0;
+}
+
+// Frees every shape below [root]. The root itself is embedded in its class.
+void freeShapeTree(Shape* root) {
+  for (int i = 0; i < root->transitionCount; i++) {
+    Shape* child = root->transitions[i];
+    freeShapeTree(child);
+    FREE(Shape, child);
+  }
+
+  FREE_ARRAY(Shape*, root->transitions, root->transitionCapacity);
+  freeTable(&root->slots);
+}
+
+void markShapeTree(Shape* root) {
+  markObject((Obj*)root->name);
+
+  for (int i = 0; i < root->transitionCount; i++) {
+    markShapeTree(root->transitions[i]);
+  }
+}
+
+// Returns the slot of field [name] in [shape], or -1 if it has none.
+int shapeFieldSlot(Shape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+// Returns the shape reached by adding field [name] to [shape], creating it
+// if needed. Returns NULL when the instance should go to dictionary mode.
+Shape* shapeTransition(ObjClass* klass, Shape* shape, ObjString* name) {
+  for (int i = 0; i < shape->transitionCount; i++) {
+    if (shape->transitions[i]->name == name) return shape->transitions[i];
+  }
+
+  if (shape->fieldCount == SHAPE_MAX_FIELDS ||
+      klass->shapeCount == CLASS_MAX_SHAPES) {
+    return NULL;
+  }
+
+  Shape* child = ALLOCATE(Shape, 1);
+  initShape(child, shape, name);
+  tableAddAll(&shape->slots, &child->slots);
+  tableSet(&child->slots, name, NUMBER_VAL(shape->fieldCount));
+
+  if (shape->transitionCapacity < shape->transitionCount + 1) {
+    int oldCapacity = shape->transitionCapacity;
+    shape->transitionCapacity = GROW_CAPACITY(oldCapacity);
+    shape->transitions = GROW_ARRAY(Shape*, shape->transitions,
+        oldCapacity, shape->transitionCapacity);
+  }
+
+  shape->transitions[shape->transitionCount++] = child;
+  klass->shapeCount++;
+  if (child->fieldCount > klass->fieldHint) {
+    klass->fieldHint = child->fieldCount;
+  }
+
+  return child;
+}
@@ -0,0 +1,49 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+// Largest number of fields an instance stores by shape. Past this, or once
+// its class has grown CLASS_MAX_SHAPES shapes, an instance falls back to a
+// hash table of its own ("dictionary mode").
+#define SHAPE_MAX_FIELDS 64
+#define CLASS_MAX_SHAPES 256
+
+// A shape describes which fields an instance has and the slot each one
+// lives in. Shapes form a transition tree rooted in each class: adding a
+// field moves an instance from its shape to the child for that name, so
+// instances that gain the same fields in the same order share a shape.
+// Shapes are owned by their class rather than the GC.
+struct Shape {
+  Shape* parent;
+
+  // The field this shape adds to its parent, or NULL for the root.
+  ObjString* name;
+  int fieldCount;
+
+  // Field name -> slot, for every field in the shape.
+  Table slots;
+
+  Shape** transitions;
+  int transitionCount;
+  int transitionCapacity;
+};
+
+
+void initShape(Shape* shape, Shape* parent, ObjString* name);
+
+
+void freeShapeTree(Shape* root);
+
+
+void markShapeTree(Shape* root);
+
+
+int shapeFieldSlot(Shape* shape, ObjString* name);
+
+
+Shape* shapeTransition(ObjClass* klass, Shape* shape, ObjString* name);
+
+#endif
@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+typedef struct Page {
+  struct Page* next;
+
+  // The size class the page is carved into.
+  int32_t index;
+
+  // How many of its cells are on the free lists. Only counted while
+  // releasing pages.
+  int32_t freeCount;
+} Page;
+
+// Cells start one granule into a page, after its header, so that they
+// are as aligned as malloc() would have made them.
+#define PAGE_HEADER_SIZE SLAB_GRANULE
+
+static Page* pages = NULL;
+static size_t pageCount = 0;
+static CellLists freeCells;
+
+// The unused end of the page each class is carving cells from.
+static char* bumpNext[SLAB_CLASS_COUNT];
+static char* bumpEnd[SLAB_CLASS_COUNT];
+
+static int sizeClass(size_t size) {
+  return (int)((size - 1) / SLAB_GRANULE);
+}
+
+static void newPage(int index) {
+  Page* page = (Page*)malloc(SLAB_PAGE_SIZE);
+  if (page == NULL) exit(1);
+
+  page->next = pages;
+  page->index = index;
+  page->freeCount = 0;
+  pages = page;
+  pageCount++;
+
+  bumpNext[index] = (char*)page + PAGE_HEADER_SIZE;
+  bumpEnd[index] = (char*)page + SLAB_PAGE_SIZE;
+}
+
+void* slabAllocate(size_t size) {
+  int index = sizeClass(size);
+
+  Cell* cell = freeCells.first[index];
+  if (cell != NULL) {
+    freeCells.first[index] = cell->next;
+    if (cell->next == NULL) freeCells.last[index] = NULL;
+    return cell;
+  }
+
+  size_t cellSize = (size_t)(index + 1) * SLAB_GRANULE;
+  if (bumpEnd[index] - bumpNext[index] < (ptrdiff_t)cellSize) {
+    newPage(index);
+  }
+
+  void* result = bumpNext[index];
+  bumpNext[index] += cellSize;
+  return result;
+}
+
+void slabFree(CellLists* lists, void* cell, size_t size) {
+  if (lists == NULL) lists = &freeCells;
+
+  int index = sizeClass(size);
+  Cell* freed = (Cell*)cell;
+  freed->next = lists->first[index];
+  lists->first[index] = freed;
+  if (lists->last[index] == NULL) lists->last[index] = freed;
+  lists->bytes += size;
+}
+
+void slabMoveCells(CellLists* from, CellLists* to) {
+  if (to == NULL) to = &freeCells;
+
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    if (from->first[i] == NULL) continue;
+
+    from->last[i]->next = to->first[i];
+    to->first[i] = from->first[i];
+    if (to->last[i] == NULL) to->last[i] = from->last[i];
+
+    from->first[i] = NULL;
+    from->last[i] = NULL;
+  }
+
+  to->bytes += from->bytes;
+  from->bytes = 0;
+}
+
+// Whether [page] has no cells in use. The page a class is carving fresh
+// cells from never counts, or the next allocation would only get a new
+// one.
+static bool isEmpty(Page* page) {
+  if (bumpEnd[page->index] == (char*)page + SLAB_PAGE_SIZE) return false;
+
+  // A page is only left for a new one once no other cell fits.
+  size_t cellSize = (size_t)(page->index + 1) * SLAB_GRANULE;
+  size_t cells = (SLAB_PAGE_SIZE - PAGE_HEADER_SIZE) / cellSize;
+  return (size_t)page->freeCount == cells;
+}
+
+static int comparePages(const void* a, const void* b) {
+  uintptr_t left = (uintptr_t)*(Page* const*)a;
+  uintptr_t right = (uintptr_t)*(Page* const*)b;
+  return left < right ? -1 : left > right;
+}
+
+// The page in [sorted], ordered by address, that [cell] was carved from.
+static Page* pageOf(Page** sorted, size_t count, Cell* cell) {
+  size_t start = 0;
+  size_t end = count - 1;
+  while (start < end) {
+    size_t mid = (start + end + 1) / 2;
+    if ((uintptr_t)sorted[mid] <= (uintptr_t)cell) {
+      start = mid;
+    } else {
+      end = mid - 1;
+    }
+  }
+  return sorted[start];
+}
+
+// Marks a page that slabReleaseEmptyPages() is about to free.
+#define PAGE_RELEASED -1
+
+void slabReleaseEmptyPages(size_t keep) {
+  // Counting free cells means walking all of them, so it waits until as
+  // much has been freed as the pages hold. The walk then costs no more
+  // than the frees did.
+  if (pageCount == 0 || freeCells.bytes < pageCount * SLAB_PAGE_SIZE) {
+    return;
+  }
+
+  Page** sorted = (Page**)malloc(sizeof(Page*) * pageCount);
+  if (sorted == NULL) return;
+  freeCells.bytes = 0;
+
+  size_t count = 0;
+  for (Page* page = pages; page != NULL; page = page->next) {
+    page->freeCount = 0;
+    sorted[count++] = page;
+  }
+  qsort(sorted, count, sizeof(Page*), comparePages);
+
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    for (Cell* cell = freeCells.first[i]; cell != NULL; cell = cell->next) {
+      pageOf(sorted, count, cell)->freeCount++;
+    }
+  }
+
+  bool anyReleased = false;
+  for (Page* page = pages; page != NULL; page = page->next) {
+    if (!isEmpty(page)) continue;
+
+    if (keep >= SLAB_PAGE_SIZE) {
+      keep -= SLAB_PAGE_SIZE;
+    } else {
+      page->freeCount = PAGE_RELEASED;
+      anyReleased = true;
+    }
+  }
+
+  for (int i = 0; i < SLAB_CLASS_COUNT && anyReleased; i++) {
+    Cell** link = &freeCells.first[i];
+    freeCells.last[i] = NULL;
+    while (*link != NULL) {
+      if (pageOf(sorted, count, *link)->freeCount == PAGE_RELEASED) {
+        *link = (*link)->next;
+      } else {
+        freeCells.last[i] = *link;
+        link = &(*link)->next;
+      }
+    }
+  }
+  free(sorted);
+
+  Page** link = &pages;
+  while (*link != NULL) {
+    Page* page = *link;
+    if (page->freeCount == PAGE_RELEASED) {
+      *link = page->next;
+      free(page);
+      pageCount--;
+    } else {
+      link = &page->next;
+    }
+  }
+}
+
+void freeSlabs() {
+  while (pages != NULL) {
+    Page* next = pages->next;
+    free(pages);
+    pages = next;
+  }
+  pageCount = 0;
+  freeCells.bytes = 0;
+
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    freeCells.first[i] = NULL;
+    freeCells.last[i] = NULL;
+    bumpNext[i] = NULL;
+    bumpEnd[i] = NULL;
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+
+// Objects up to SLAB_MAX_SIZE bytes are carved out of pages that each hold
+// cells of one size class, in steps of SLAB_GRANULE bytes. Freed cells go
+// on a free list for their class and are handed out again first, so the
+// objects of a class stay packed together instead of being scattered
+// through the malloc heap. A page whose cells are all free again goes back
+// to the system after the next full collection, unless the heap is
+// expected to grow back into it.
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+typedef struct Cell {
+  struct Cell* next;
+} Cell;
+
+// Free cells of each size class. Another thread can free into a set of
+// its own and hand it over with slabMoveCells().
+typedef struct {
+  Cell* first[SLAB_CLASS_COUNT];
+  Cell* last[SLAB_CLASS_COUNT];
+
+  // How much has been freed onto them.
+  size_t bytes;
+} CellLists;
+
+void* slabAllocate(size_t size);
+
+// Puts [cell] on [lists], or on the allocator's own free lists if NULL.
+void slabFree(CellLists* lists, void* cell, size_t size);
+
+// Moves every cell in [from] onto [to], or onto the allocator's own free
+// lists if NULL.
+void slabMoveCells(CellLists* from, CellLists* to);
+
+// Returns the pages with no cells in use to the system, save for [keep]
+// bytes of them that are about to be filled again. Cells freed onto other
+// lists must have been moved back with slabMoveCells() first, and nothing
+// may be freeing meanwhile.
+void slabReleaseEmptyPages(size_t keep);
+
+// Returns every page to the system. Only safe once the objects are freed.
+void freeSlabs();
+
+#endif
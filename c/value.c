@@ -169,8 +169,10 @@ bool valuesEqual(Value a, Value b) {
 
 #ifdef NAN_BOXING
 
-  if (IS_NUMBER(a) && IS_NUMBER(b)) {
-    return AS_NUMBER(a) == AS_NUMBER(b);
+  // Ints and everything else compare by bits. A double has to compare
+  // numerically, against an int too.
+  if (IS_DOUBLE(a) || IS_DOUBLE(b)) {
+    return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
   }
 
   return a == b;
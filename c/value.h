@@ -12,6 +12,12 @@ typedef struct Obj Obj;
 
 typedef struct ObjString ObjString;
 
+typedef struct ObjClass ObjClass;
+
+typedef struct ObjClosure ObjClosure;
+
+typedef struct Shape Shape;
+
 
 
 
@@ -30,6 +36,11 @@ typedef struct ObjString ObjString;
 #define TAG_TRUE  3 
 #define TAG_EMPTY 4
 
+// Integers that fit in 32 bits live in the low half of a quiet NaN with
+// this bit set. They are numbers like any other; only arithmetic and
+// indexing look at the representation.
+#define TAG_INT   ((uint64_t)0x0001000000000000)
+
 typedef uint64_t Value;
 
 
@@ -39,7 +50,12 @@ typedef uint64_t Value;
 
 #define IS_NIL(value)       ((value) == NIL_VAL)
 
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
 
 #define IS_EMPTY(v)   ((v) == EMPTY_VAL)
 
@@ -56,6 +72,10 @@ typedef uint64_t Value;
 
 #define AS_NUMBER(value)    valueToNum(value)
 
+#define AS_DOUBLE(value)    valueToDouble(value)
+
+#define AS_INT(value)       ((int32_t)(uint32_t)(value))
+
 
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -74,18 +94,25 @@ typedef uint64_t Value;
 
 #define NUMBER_VAL(num) numToValue(num)
 
+#define INT_VAL(i)      ((Value)(QNAN | TAG_INT | (uint32_t)(int32_t)(i)))
+
 
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 
 
-static inline double valueToNum(Value value) {
+static inline double valueToDouble(Value value) {
   double num;
   memcpy(&num, &value, sizeof(Value));
   return num;
 }
 
+static inline double valueToNum(Value value) {
+  if (IS_INT(value)) return (double)AS_INT(value);
+  return valueToDouble(value);
+}
+
 
 
 static inline Value numToValue(double num) {
@@ -127,6 +154,8 @@ typedef struct {
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value)  IS_NUMBER(value)
+#define IS_INT(value)     false
 
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
@@ -138,12 +167,15 @@ typedef struct {
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_DOUBLE(value)  ((value).as.number)
+#define AS_INT(value)     ((int32_t)(value).as.number)
 
 
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    NUMBER_VAL((double)(value))
 
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
@@ -177,4 +209,97 @@ char *valueToString(Value value);
 
 
 
+// Arithmetic and comparisons on two numbers, storing into [result]. They
+// return false if either operand is not a number. Two integers give an
+// integer as long as the result is exact, fits in 32 bits and is not a
+// zero that would be negative as a double; anything else is computed on
+// doubles.
+#define NUMBER_OPERANDS(a, b, intCase)                                  \
+    do {                                                                \
+      if (IS_INT(a) && IS_INT(b)) {                                     \
+        intCase                                                         \
+      } else if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                      \
+        return false;                                                   \
+      }                                                                 \
+    } while (false)
+
+static inline bool addNumbers(Value a, Value b, Value* result) {
+  NUMBER_OPERANDS(a, b, {
+    int64_t sum = (int64_t)AS_INT(a) + AS_INT(b);
+    if (sum == (int32_t)sum) {
+      *result = INT_VAL(sum);
+      return true;
+    }
+  });
+  *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+  return true;
+}
+
+static inline bool subtractNumbers(Value a, Value b, Value* result) {
+  NUMBER_OPERANDS(a, b, {
+    int64_t difference = (int64_t)AS_INT(a) - AS_INT(b);
+    if (difference == (int32_t)difference) {
+      *result = INT_VAL(difference);
+      return true;
+    }
+  });
+  *result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+  return true;
+}
+
+static inline bool multiplyNumbers(Value a, Value b, Value* result) {
+  NUMBER_OPERANDS(a, b, {
+    int64_t product = (int64_t)AS_INT(a) * AS_INT(b);
+    if (product == (int32_t)product &&
+        (product != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0))) {
+      *result = INT_VAL(product);
+      return true;
+    }
+  });
+  *result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+  return true;
+}
+
+static inline bool divideNumbers(Value a, Value b, Value* result) {
+  NUMBER_OPERANDS(a, b, {
+    int32_t dividend = AS_INT(a);
+    int32_t divisor = AS_INT(b);
+    if (divisor > 0 && dividend % divisor == 0) {
+      *result = INT_VAL(dividend / divisor);
+      return true;
+    }
+  });
+  *result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+  return true;
+}
+
+static inline bool greaterNumbers(Value a, Value b, Value* result) {
+  NUMBER_OPERANDS(a, b, {
+    *result = BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return true;
+  });
+  *result = BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+  return true;
+}
+
+static inline bool lessNumbers(Value a, Value b, Value* result) {
+  NUMBER_OPERANDS(a, b, {
+    *result = BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return true;
+  });
+  *result = BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+  return true;
+}
+
+#undef NUMBER_OPERANDS
+
+static inline Value negateNumber(Value value) {
+  if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN) {
+    return INT_VAL(-AS_INT(value));
+  }
+  return NUMBER_VAL(-AS_NUMBER(value));
+}
+
+
+
 #endif
@@ -1,6 +1,7 @@
 #include <stdarg.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <string.h>
 
@@ -9,9 +10,11 @@
 
 
 
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 
 
 #include "object.h"
@@ -60,7 +63,7 @@ static void runtimeError(const char* format, ...) {
     
     size_t instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+            getLine(&function->chunk, instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -84,6 +87,11 @@ static uint32_t hashValue(Value value) {
     return hashObject(AS_OBJ(value));
   }
 
+  // 1 and 1.0 are the same key, so integers hash as their double.
+  if (IS_INT(value)) {
+    return hashBits(NUMBER_VAL((double)AS_INT(value)));
+  }
+
   return hashBits(value);
 }
 
@@ -209,6 +217,8 @@ bool dictSet(ObjDict* dict, Value key, Value value) {
   }
 
   *bucket = entry;
+  writeBarrier((Obj*)dict, key);
+  writeBarrier((Obj*)dict, value);
   if (isNewKey) dict->count++;
   return isNewKey;
 }
@@ -222,13 +232,65 @@ bool isValidKey(Value value) {
   return false;
 }
 
+// Moves the value stack to an array of at least [needed] slots, rebasing
+// every pointer into it.
+static void growStack(int needed) {
+  int capacity = vm.stackCapacity;
+  while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+
+  Value* stack = ALLOCATE(Value, capacity);
+  Value* old = vm.stack;
+  if (old != NULL) memcpy(stack, old, sizeof(Value) * vm.stackCapacity);
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - old);
+  }
+
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - old);
+  }
+
+  vm.stackTop = stack + (vm.stackTop - old);
+  vm.stack = stack;
+
+  FREE_ARRAY(Value, old, vm.stackCapacity);
+  vm.stackCapacity = capacity;
+}
+
+
+// Makes room for a frame starting at [slots] that runs [function]. This is
+// the only overflow check on the value stack; push() relies on it.
+static inline void reserveStack(Value* slots, ObjFunction* function) {
+  int needed = (int)(slots - vm.stack) + function->maxSlots + STACK_RESERVE;
+  if (needed > vm.stackCapacity) growStack(needed);
+}
+
+
 void initVM() {
+  vm.frames = NULL;
+  vm.frameCapacity = 0;
+  vm.maxFrames = FRAMES_MAX;
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
   resetStack();
 
   vm.objects = NULL;
+  vm.nursery = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
 
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.nextMinorGC = GC_NURSERY_SIZE;
+  vm.nextGCStep = 0;
+  vm.gcPauseBudget = 0;
+  vm.backgroundSweep = false;
+  vm.gcPhase = GC_IDLE;
+  vm.gcCursor = NULL;
+  vm.unswept = NULL;
+  vm.unsweptYoung = NULL;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
@@ -236,12 +298,29 @@ void initVM() {
 
   initTable(&vm.globals);
   initTable(&vm.strings);
+
+  vm.frames = GROW_ARRAY(CallFrame, NULL, 0, FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  growStack(STACK_INITIAL);
+
+  vm.methodSlotCount = 0;
+  vm.jitEnabled = true;
+  vm.optimizationLevel = OPTIMIZE_DEFAULT;
+  vm.lazyCompile = false;
+  vm.jitDepth = 0;
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
   defineNative("clock", clockNative);
 }
 
 void freeVM() {
+  FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+  vm.frames = NULL;
+  vm.frameCapacity = 0;
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
+  resetStack();
 
   freeTable(&vm.globals);
 
@@ -253,6 +332,7 @@ void freeVM() {
 
 
   freeObjects();
+  freeBytecodeImages();
 
 }
 
@@ -272,6 +352,16 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
+// Compiles the body of [function] if that was put off until its first
+// call. Reports a runtime error if it does not compile.
+static inline bool ensureCompiled(ObjFunction* function) {
+  if (function->lazy == NULL) return true;
+  if (compileLazily(function)) return true;
+
+  runtimeError("Could not compile %s().", function->name->chars);
+  return false;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
 
 
@@ -286,11 +376,19 @@ static bool call(ObjClosure* closure, int argCount) {
 
 
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm.frameCount >= vm.maxFrames) {
     runtimeError("Stack overflow.");
     return false;
   }
 
+  if (vm.frameCount == vm.frameCapacity) {
+    int capacity = GROW_CAPACITY(vm.frameCapacity);
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, vm.frameCapacity, capacity);
+    vm.frameCapacity = capacity;
+  }
+
+  if (!ensureCompiled(closure->function)) return false;
+  reserveStack(vm.stackTop - argCount - 1, closure->function);
 
   CallFrame* frame = &vm.frames[vm.frameCount++];
 
@@ -300,6 +398,30 @@ static bool call(ObjClosure* closure, int argCount) {
 
 
   frame->slots = vm.stackTop - argCount - 1;
+
+#ifdef JIT
+  // Compiled code runs the callee until it returns or leaves a frame for
+  // the interpreter. Either way the caller picks up from whatever frame is
+  // now on top.
+  if (jitCallReady(closure->function)) return jitRun(frame) != JIT_ERROR;
+#endif
+
+  return true;
+}
+
+
+// Replaces the class in the callee slot with a new instance and runs the
+// initializer on it, if the class has one.
+static inline bool construct(ObjClass* klass, int argCount) {
+  vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+
+  if (klass->initializer != NULL) {
+    return call(klass->initializer, argCount);
+  } else if (argCount != 0) {
+    runtimeError("Expected 0 arguments but got %d.", argCount);
+    return false;
+  }
+
   return true;
 }
 
@@ -316,25 +438,8 @@ static bool callValue(Value callee, int argCount) {
         return call(bound->method, argCount);
       }
 
-      case OBJ_CLASS: {
-        ObjClass* klass = AS_CLASS(callee);
-        vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-
-        Value initializer;
-        if (tableGet(&klass->methods, vm.initString,
-                     &initializer)) {
-          return call(AS_CLOSURE(initializer), argCount);
-
-        } else if (argCount != 0) {
-          runtimeError("Expected 0 arguments but got %d.",
-                       argCount);
-          return false;
-
-        }
-
-
-        return true;
-      }
+      case OBJ_CLASS:
+        return construct(AS_CLASS(callee), argCount);
 
 
       case OBJ_CLOSURE:
@@ -365,13 +470,13 @@ static bool callValue(Value callee, int argCount) {
 
 static bool invokeFromClass(ObjClass* klass, ObjString* name,
                             int argCount) {
-  Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
+  ObjClosure* method = findMethod(klass, name);
+  if (method == NULL) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
 
-  return call(AS_CLOSURE(method), argCount);
+  return call(method, argCount);
 }
 
 
@@ -379,16 +484,17 @@ static bool invoke(ObjString* name, int argCount) {
   Value receiver = peek(argCount);
 
   if (isObjType(receiver, OBJ_CLASS)) {
-      ObjInstance* instance = AS_INSTANCE(receiver);
+      ObjClass* klass = AS_CLASS(receiver);
 
 
       Value value;
-      if (tableGet(&instance->fields, name, &value)) {
+      if (tableGet(&klass->methods, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
       }
 
-      return invokeFromClass(instance->klass, name, argCount);
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
 
   } else if (isObjType(receiver, OBJ_ENUM)) {
       ObjEnum* _enum = AS_ENUM(receiver);
@@ -402,11 +508,11 @@ static bool invoke(ObjString* name, int argCount) {
       return false;
     } else if (isObjType(receiver, OBJ_INSTANCE)) {
       ObjInstance* instance = AS_INSTANCE(receiver);
+      ObjClosure* method = findMethod(instance->klass, name);
+      if (method != NULL) return call(method, argCount);
+
       Value value;
-      if (tableGet(&instance->klass->methods, name, &value)) {
-        return call(AS_CLOSURE(value), argCount);
-      }
-      if (tableGet(&instance->fields, name, &value)) {
+      if (instanceGetField(instance, name, &value)) {
         return callValue(value, argCount);
       }
 
@@ -419,15 +525,120 @@ static bool invoke(ObjString* name, int argCount) {
 }
 
 
+// Returns a fresh entry in [cache], or NULL if the site is megamorphic.
+static CacheEntry* addCacheEntry(InlineCache* cache, ObjClass* klass) {
+  if (cache->megamorphic) return NULL;
+
+  if (cache->count == INLINE_CACHE_WAYS) {
+    // Too many receivers seen here; stop caching and always look up.
+    cache->megamorphic = true;
+    cache->count = 0;
+    return NULL;
+  }
+
+  CacheEntry* entry = &cache->entries[cache->count++];
+  entry->klass = klass;
+  entry->shape = NULL;
+  entry->slot = 0;
+  entry->transition = NULL;
+  entry->method = NULL;
+  return entry;
+}
+
+
+static void cacheField(InlineCache* cache, ObjInstance* instance,
+                       Shape* shape, int slot, Shape* transition) {
+  CacheEntry* entry = addCacheEntry(cache, instance->klass);
+  if (entry == NULL) return;
+
+  entry->shape = shape;
+  entry->slot = slot;
+  entry->transition = transition;
+}
+
+
+static inline bool getField(InlineCache* cache, ObjInstance* instance,
+                            ObjString* name, Value* value) {
+  Shape* shape = instance->shape;
+
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) {
+      *value = instance->fields[cache->entries[i].slot];
+      return true;
+    }
+  }
+
+  if (shape == NULL) return tableGet(instance->dictionary, name, value);
+
+  int slot = shapeFieldSlot(shape, name);
+  if (slot == -1) return false;
+
+  cacheField(cache, instance, shape, slot, NULL);
+  *value = instance->fields[slot];
+  return true;
+}
+
+
+// Stores [value] in field [name]. A cached transition moves the instance
+// to its new shape directly, as long as the field storage has room.
+static inline void setField(InlineCache* cache, ObjInstance* instance,
+                            ObjString* name, Value value) {
+  Shape* shape = instance->shape;
+
+  for (int i = 0; i < cache->count; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->shape != shape) continue;
+
+    if (entry->transition == NULL) {
+      instance->fields[entry->slot] = value;
+      writeBarrier((Obj*)instance, value);
+      return;
+    }
+
+    if (entry->transition->fieldCount <= instance->fieldCapacity) {
+      instance->fields[entry->slot] = value;
+      instance->shape = entry->transition;
+      writeBarrier((Obj*)instance, value);
+      return;
+    }
+  }
+
+  instanceSetField(instance, name, value);
+
+  if (shape == NULL || instance->shape == NULL) return;
+
+  if (instance->shape == shape) {
+    cacheField(cache, instance, shape, shapeFieldSlot(shape, name), NULL);
+  } else {
+    cacheField(cache, instance, shape, shape->fieldCount, instance->shape);
+  }
+}
+
+
+// Returns the method [name] on [klass], or NULL if the class has none.
+static inline ObjClosure* cachedMethod(InlineCache* cache, ObjClass* klass,
+                                       ObjString* name) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].klass == klass) return cache->entries[i].method;
+  }
+
+  ObjClosure* method = findMethod(klass, name);
+  if (method == NULL) return NULL;
+
+  CacheEntry* entry = addCacheEntry(cache, klass);
+  if (entry != NULL) entry->method = method;
+  return method;
+}
+
+
 static bool bindMethod(ObjClass* klass, ObjString* name) {
-  Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
+  ObjClosure* method = findMethod(klass, name);
+  if (method == NULL) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
 
-  ObjBoundMethod* bound = newBoundMethod(peek(0),
-                                         AS_CLOSURE(method));
+  ObjBoundMethod* bound = newBoundMethod(peek(0), method);
   pop();
   push(OBJ_VAL(bound));
   return true;
@@ -470,15 +681,51 @@ static void closeUpvalues(Value* last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
 
 
+// Runs [callee] in place of the current frame, which has nothing left to
+// do but return its result. Callees other than closures get an ordinary
+// call, and the OP_RETURN after OP_TAIL_CALL returns what they produce.
+static bool tailCall(Value callee, int argCount) {
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    callee = OBJ_VAL(bound->method);
+  }
+
+  if (!IS_CLOSURE(callee)) return callValue(callee, argCount);
+
+  ObjClosure* closure = AS_CLOSURE(callee);
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.",
+        closure->function->arity, argCount);
+    return false;
+  }
+
+  if (!ensureCompiled(closure->function)) return false;
+
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  reserveStack(frame->slots, closure->function);
+  closeUpvalues(frame->slots);
+
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
+}
+
+
 static void defineMethod(ObjString* name) {
-  Value method = peek(0);
+  ObjClosure* method = AS_CLOSURE(peek(0));
   ObjClass* klass = AS_CLASS(peek(1));
-  tableSet(&klass->methods, name, method);
+  classSetMethod(klass, name, method);
   pop();
 }
 
@@ -515,40 +762,119 @@ static void concatenate() {
 }
 
 
-static InterpretResult run() {
+static void concatenateLists() {
+  ObjList* list2 = AS_LIST(peek(0));
+  ObjList* list1 = AS_LIST(peek(1));
 
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
-  register uint8_t* ip = frame->ip;
+  ObjList* result = newList();
+  push(OBJ_VAL(result));
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+  for (int i = 0; i < list1->values.count; ++i) {
+    writeValueArray(&result->values, list1->values.values[i]);
+    writeBarrier((Obj*)result, list1->values.values[i]);
+  }
 
+  for (int i = 0; i < list2->values.count; ++i) {
+    writeValueArray(&result->values, list2->values.values[i]);
+    writeBarrier((Obj*)result, list2->values.values[i]);
+  }
 
+  pop();
+  pop();
+  pop();
 
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  push(OBJ_VAL(result));
+}
 
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// List and string index. Callers have checked that it is a number.
+static inline int toIndex(Value value) {
+  return IS_INT(value) ? AS_INT(value) : (int)AS_NUMBER(value);
+}
 
+// Whether the callee of a call the compiler inlined is still the function
+// it inlined into the call site.
+static inline bool isInlinedCall(Value callee, ObjFunction* function) {
+  return IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function;
+}
 
-#define BINARY_OP(valueType, op) \
-    do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
-      } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+// The same for an inlined method. Methods come before fields in invoke(),
+// so a field of the same name does not matter.
+static inline bool isInlinedMethod(Value receiver, ObjString* name,
+                                   ObjFunction* function) {
+  if (!IS_INSTANCE(receiver)) return false;
+
+  ObjClosure* method = findMethod(AS_INSTANCE(receiver)->klass, name);
+  return method != NULL && method->function == function;
+}
+
+// Slow path of OP_ADD for everything but two numbers.
+static bool addValues() {
+  Value result;
+  if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    concatenate();
+  } else if (IS_LIST(peek(0)) && IS_LIST(peek(1))) {
+    concatenateLists();
+  } else if (addNumbers(peek(1), peek(0), &result)) {
+    pop();
+    pop();
+    push(result);
+  } else {
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+  }
+  return true;
+}
+
+
+static InterpretResult run() {
+
+  CallFrame* frame;
+  register uint8_t* ip;
+  register Value* stackTop;
+  register Value* slots;
+  register Value* constants;
+
+// The hot interpreter state lives in locals. It is written back with
+// STORE_FRAME before anything that can allocate, inspect the stack, push a
+// frame or report an error, and re-read with LOAD_FRAME once that returns.
+#define STORE_FRAME                                                   \
+    do {                                                              \
+      frame->ip = ip;                                                 \
+      vm.stackTop = stackTop;                                         \
     } while (false)
 
+#define LOAD_FRAME                                                    \
+    do {                                                              \
+      frame = &vm.frames[vm.frameCount - 1];                          \
+      ip = frame->ip;                                                 \
+      slots = frame->slots;                                           \
+      constants = frame->closure->function->chunk.constants.values;   \
+      stackTop = vm.stackTop;                                         \
+    } while (false)
+
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*(--stackTop))
+#define DROP() (stackTop--)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+
 
-  for (;;) {
 
-#define STORE_FRAME frame->ip = ip
+#define READ_24() \
+    (ip += 3, \
+    (int)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+
+#define READ_CONSTANT() (constants[READ_BYTE()])
+
+
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
 
 #define R_ERROR(...)                                              \
         do {                                                                \
@@ -566,36 +892,224 @@ static InterpretResult run() {
             FREE_ARRAY(char, val, valLength + 1);                              \
             return INTERPRET_RUNTIME_ERROR;                                        \
         } while (0)
+
+
+// Rewrites the instruction just read into a quickened form: [intForm] if
+// two ints gave an int or boolean, [doubleForm] for two doubles. Mixed
+// operands leave it generic.
+#ifdef QUICKENING
+#define QUICKEN(a, b, result, intForm, doubleForm)                      \
+    do {                                                                \
+      if (IS_INT(a) && IS_INT(b)) {                                     \
+        if (!IS_DOUBLE(result)) ip[-1] = intForm;                       \
+      } else if (IS_DOUBLE(a) && IS_DOUBLE(b)) {                        \
+        ip[-1] = doubleForm;                                            \
+      }                                                                 \
+    } while (false)
+#else
+#define QUICKEN(a, b, result, intForm, doubleForm) do { } while (false)
+#endif
+
+// Turns a quickened instruction whose operands no longer match back into
+// [generic] and backs up so the next DISPATCH() runs that instead.
+#define DEOPTIMIZE(generic)                                             \
+    do {                                                                \
+      ip[-1] = generic;                                                 \
+      ip--;                                                             \
+    } while (false)
+
+#define BINARY_OP(function, intForm, doubleForm) \
+    do { \
+      Value a = PEEK(1); \
+      Value b = PEEK(0); \
+      Value result; \
+      if (!function(a, b, &result)) { \
+        R_ERROR("Operands must be numbers."); \
+      } \
+      DROP(); \
+      PEEK(0) = result; \
+      QUICKEN(a, b, result, intForm, doubleForm); \
+    } while (false)
+
+#define QUICK_INT_OP(generic, function)                                 \
+    do {                                                                \
+      Value a = PEEK(1);                                                \
+      Value b = PEEK(0);                                                \
+      Value result;                                                     \
+      if (IS_INT(a) && IS_INT(b) && function(a, b, &result) &&          \
+          !IS_DOUBLE(result)) {                                         \
+        DROP();                                                         \
+        PEEK(0) = result;                                               \
+      } else {                                                          \
+        DEOPTIMIZE(generic);                                            \
+      }                                                                 \
+    } while (false)
+
+#define QUICK_DOUBLE_OP(generic, valueType, op)                         \
+    do {                                                                \
+      Value a = PEEK(1);                                                \
+      Value b = PEEK(0);                                                \
+      if (IS_DOUBLE(a) && IS_DOUBLE(b)) {                               \
+        DROP();                                                         \
+        PEEK(0) = valueType(AS_DOUBLE(a) op AS_DOUBLE(b));              \
+      } else {                                                          \
+        DEOPTIMIZE(generic);                                            \
+      }                                                                 \
+    } while (false)
+
+// slots[dest] = slots[left] op (slots or constants)[right], in place.
+#define REGISTER_OP(function, source)                                   \
+    do {                                                                \
+      uint8_t dest = READ_BYTE();                                       \
+      Value a = slots[READ_BYTE()];                                     \
+      Value b = source[READ_BYTE()];                                    \
+      if (!function(a, b, &slots[dest])) {                              \
+        R_ERROR("Operands must be numbers.");                           \
+      }                                                                 \
+    } while (false)
+
+#define REGISTER_ADD(source)                                            \
+    do {                                                                \
+      uint8_t dest = READ_BYTE();                                       \
+      Value a = slots[READ_BYTE()];                                     \
+      Value b = source[READ_BYTE()];                                    \
+      if (!addNumbers(a, b, &slots[dest])) {                            \
+        PUSH(a);                                                        \
+        PUSH(b);                                                        \
+        STORE_FRAME;                                                    \
+        if (!addValues()) return INTERPRET_RUNTIME_ERROR;               \
+        LOAD_FRAME;                                                     \
+        slots[dest] = POP();                                            \
+      }                                                                 \
+    } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-    #define DISPATCH()                                                                        \
-            do                                                                                    \
-            {                                                                                     \
-                printf("          ");                                                             \
-                for (Value *stackValue = vm->stack; stackValue < vm->stackTop; stackValue++) {    \
-                    printf("[ ");                                                                 \
-                    printValue(*stackValue);                                                      \
-                    printf(" ]");                                                                 \
-                }                                                                                 \
-                printf("\n");                                                                     \
-                disassembleInstruction(&frame->closure->function->chunk,                          \
-                        (int) (ip - frame->closure->function->chunk.code));                \
-                goto *dispatchTable[instruction = READ_BYTE()];                                   \
-            }                                                                                     \
-            while (false)
+#define TRACE_EXECUTION()                                                     \
+        do {                                                                  \
+            printf("          ");                                             \
+            for (Value* slot = vm.stack; slot < stackTop; slot++) {           \
+                printf("[ ");                                                 \
+                printValue(*slot);                                            \
+                printf(" ]");                                                 \
+            }                                                                 \
+            printf("\n");                                                     \
+            disassembleInstruction(&frame->closure->function->chunk,          \
+                    (int)(ip - frame->closure->function->chunk.code));        \
+        } while (false)
 #else
+#define TRACE_EXECUTION() do { } while (false)
 #endif
 
+#ifdef COMPUTED_GOTO
+
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&op_CONSTANT,
+        [OP_CONSTANT_LONG] = &&op_CONSTANT_LONG,
+        [OP_NIL] = &&op_NIL,
+        [OP_TRUE] = &&op_TRUE,
+        [OP_FALSE] = &&op_FALSE,
+        [OP_POP] = &&op_POP,
+        [OP_GET_LOCAL] = &&op_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&op_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&op_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&op_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&op_SET_PROPERTY,
+        [OP_GET_SUPER] = &&op_GET_SUPER,
+        [OP_EQUAL] = &&op_EQUAL,
+        [OP_GREATER] = &&op_GREATER,
+        [OP_LESS] = &&op_LESS,
+        [OP_ADD] = &&op_ADD,
+        [OP_SUBTRACT] = &&op_SUBTRACT,
+        [OP_MULTIPLY] = &&op_MULTIPLY,
+        [OP_DIVIDE] = &&op_DIVIDE,
+        [OP_NOT] = &&op_NOT,
+        [OP_NEGATE] = &&op_NEGATE,
+        [OP_PRINT] = &&op_PRINT,
+        [OP_JUMP] = &&op_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_LOOP,
+        [OP_CALL] = &&op_CALL,
+        [OP_TAIL_CALL] = &&op_TAIL_CALL,
+        [OP_INVOKE] = &&op_INVOKE,
+        [OP_SUPER_INVOKE] = &&op_SUPER_INVOKE,
+        [OP_CLOSURE] = &&op_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&op_CLOSE_UPVALUE,
+        [OP_RETURN] = &&op_RETURN,
+        [OP_CLASS] = &&op_CLASS,
+        [OP_ENUM] = &&op_ENUM,
+        [OP_SET_ENUM_VALUE] = &&op_SET_ENUM_VALUE,
+        [OP_INHERIT] = &&op_INHERIT,
+        [OP_METHOD] = &&op_METHOD,
+        [OP_UNPACK_LIST] = &&op_UNPACK_LIST,
+        [OP_SUBSCRIPT] = &&op_SUBSCRIPT,
+        [OP_NEW_LIST] = &&op_NEW_LIST,
+        [OP_SUBSCRIPT_ASSIGN] = &&op_SUBSCRIPT_ASSIGN,
+        [OP_SUBSCRIPT_PUSH] = &&op_SUBSCRIPT_PUSH,
+        [OP_ADD_LIST] = &&op_ADD_LIST,
+        [OP_NEW_DICT] = &&op_NEW_DICT,
+        [OP_WIDE] = &&op_WIDE,
+        [OP_GUARD_CALL] = &&op_GUARD_CALL,
+        [OP_GUARD_INVOKE] = &&op_GUARD_INVOKE,
+        [OP_GET_LOCAL_2] = &&op_GET_LOCAL_2,
+        [OP_SET_LOCAL_POP] = &&op_SET_LOCAL_POP,
+        [OP_ADD_LOCAL_CONST] = &&op_ADD_LOCAL_CONST,
+        [OP_SUBTRACT_LOCAL_CONST] = &&op_SUBTRACT_LOCAL_CONST,
+        [OP_LESS_LOCAL_CONST_JUMP] = &&op_LESS_LOCAL_CONST_JUMP,
+        [OP_ADD_RRR] = &&op_ADD_RRR,
+        [OP_SUBTRACT_RRR] = &&op_SUBTRACT_RRR,
+        [OP_MULTIPLY_RRR] = &&op_MULTIPLY_RRR,
+        [OP_DIVIDE_RRR] = &&op_DIVIDE_RRR,
+        [OP_ADD_RRK] = &&op_ADD_RRK,
+        [OP_SUBTRACT_RRK] = &&op_SUBTRACT_RRK,
+        [OP_MULTIPLY_RRK] = &&op_MULTIPLY_RRK,
+        [OP_DIVIDE_RRK] = &&op_DIVIDE_RRK,
+        [OP_ADD_INT] = &&op_ADD_INT,
+        [OP_ADD_DOUBLE] = &&op_ADD_DOUBLE,
+        [OP_ADD_STRING] = &&op_ADD_STRING,
+        [OP_SUBTRACT_INT] = &&op_SUBTRACT_INT,
+        [OP_SUBTRACT_DOUBLE] = &&op_SUBTRACT_DOUBLE,
+        [OP_MULTIPLY_INT] = &&op_MULTIPLY_INT,
+        [OP_MULTIPLY_DOUBLE] = &&op_MULTIPLY_DOUBLE,
+        [OP_DIVIDE_DOUBLE] = &&op_DIVIDE_DOUBLE,
+        [OP_GREATER_INT] = &&op_GREATER_INT,
+        [OP_GREATER_DOUBLE] = &&op_GREATER_DOUBLE,
+        [OP_LESS_INT] = &&op_LESS_INT,
+        [OP_LESS_DOUBLE] = &&op_LESS_DOUBLE,
+    };
+
+#define INTERPRET_LOOP    DISPATCH();
+#define CASE_CODE(name)   op_##name
+
+#define DISPATCH()                                                  \
+        do {                                                        \
+            TRACE_EXECUTION();                                      \
+            goto *dispatchTable[instruction = READ_BYTE()];         \
+        } while (false)
+
+#else
+
 #define INTERPRET_LOOP                                        \
             loop:                                                 \
+                TRACE_EXECUTION();                                \
                 switch (instruction = READ_BYTE())
 
-#define DISPATCH() goto loop
-
 #define CASE_CODE(name) case OP_##name
 
+#define DISPATCH() goto loop
+
+#endif
 
+    LOAD_FRAME;
 
     uint8_t instruction;
+
+    // First operand of the instructions OP_WIDE can prefix. Each reads it
+    // and then reaches its wide_ label, where OP_WIDE joins it.
+    int arg;
     INTERPRET_LOOP
     {
 
@@ -603,70 +1117,74 @@ static InterpretResult run() {
         Value constant = READ_CONSTANT();
 
 
-        push(constant);
+        PUSH(constant);
         DISPATCH();
       }
 
-
-      CASE_CODE(NIL): push(NIL_VAL); DISPATCH();
-      CASE_CODE(TRUE): push(BOOL_VAL(true)); DISPATCH();
-      CASE_CODE(FALSE): push(BOOL_VAL(false)); DISPATCH();
+      CASE_CODE(CONSTANT_LONG):
+        PUSH(constants[READ_24()]);
+        DISPATCH();
 
 
-      CASE_CODE(POP): pop(); DISPATCH();
+      CASE_CODE(NIL): PUSH(NIL_VAL); DISPATCH();
+      CASE_CODE(TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+      CASE_CODE(FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
 
 
+      CASE_CODE(POP): DROP(); DISPATCH();
 
-      CASE_CODE(GET_LOCAL): {
-        uint8_t slot = READ_BYTE();
 
 
-        push(frame->slots[slot]);
-
+      CASE_CODE(GET_LOCAL):
+        arg = READ_BYTE();
+      wide_GET_LOCAL:
+        PUSH(slots[arg]);
         DISPATCH();
-      }
 
 
 
-      CASE_CODE(SET_LOCAL): {
-        uint8_t slot = READ_BYTE();
-
-
-        frame->slots[slot] = peek(0);
-
+      CASE_CODE(SET_LOCAL):
+        arg = READ_BYTE();
+      wide_SET_LOCAL:
+        slots[arg] = PEEK(0);
         DISPATCH();
-      }
 
 
 
-      CASE_CODE(GET_GLOBAL): {
-        ObjString* name = READ_STRING();
+      CASE_CODE(GET_GLOBAL):
+        arg = READ_BYTE();
+      wide_GET_GLOBAL: {
+        ObjString* name = AS_STRING(constants[arg]);
         Value value;
         if (!tableGet(&vm.globals, name, &value)) {
           R_ERROR("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
         }
-        push(value);
+        PUSH(value);
         DISPATCH();
       }
 
 
 
-      CASE_CODE(DEFINE_GLOBAL): {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
+      CASE_CODE(DEFINE_GLOBAL):
+        arg = READ_BYTE();
+      wide_DEFINE_GLOBAL: {
+        ObjString* name = AS_STRING(constants[arg]);
+        STORE_FRAME;
+        tableSet(&vm.globals, name, PEEK(0));
+        DROP();
         DISPATCH();
       }
 
 
 
-      CASE_CODE(SET_GLOBAL): {
-        ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
+      CASE_CODE(SET_GLOBAL):
+        arg = READ_BYTE();
+      wide_SET_GLOBAL: {
+        ObjString* name = AS_STRING(constants[arg]);
+        STORE_FRAME;
+        if (tableSet(&vm.globals, name, PEEK(0))) {
           tableDelete(&vm.globals, name); 
           R_ERROR("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
         }
         DISPATCH();
       }
@@ -675,22 +1193,25 @@ static InterpretResult run() {
 
       CASE_CODE(GET_UPVALUE): {
         uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
+        PUSH(*frame->closure->upvalues[slot]->location);
         DISPATCH();
       }
 
 
 
       CASE_CODE(SET_UPVALUE): {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+        ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+        *upvalue->location = PEEK(0);
+        writeBarrier((Obj*)upvalue, PEEK(0));
         DISPATCH();
       }
 
 
 
-      CASE_CODE(GET_PROPERTY): {
-        Value receiver = peek(0);
+      CASE_CODE(GET_PROPERTY):
+        arg = READ_BYTE();
+      wide_GET_PROPERTY: {
+        Value receiver = PEEK(0);
 
         if (!IS_OBJ(receiver)) {
           R_ERROR("Object has no properties.");
@@ -698,34 +1219,35 @@ static InterpretResult run() {
 
         switch (getObjType(receiver)) {
           case OBJ_INSTANCE: {
-            ObjInstance* instance = AS_INSTANCE(peek(0));
-            ObjString* name = READ_STRING();
+            ObjInstance* instance = AS_INSTANCE(receiver);
+            ObjString* name = AS_STRING(constants[arg]);
+            InlineCache* cache = READ_CACHE();
 
             Value value;
-            if (tableGet(&instance->fields, name, &value)) {
-              pop();
-              push(value);
+            if (getField(cache, instance, name, &value)) {
+              PEEK(0) = value;
               DISPATCH();
             }
 
+            STORE_FRAME;
             if (!bindMethod(instance->klass, name)) {
               return INTERPRET_RUNTIME_ERROR;
             }
+            LOAD_FRAME;
             DISPATCH();
           }
 
           case OBJ_ENUM: {
             ObjEnum* _enum = AS_ENUM(receiver);
-            ObjString* name = READ_STRING();
+            ObjString* name = AS_STRING(constants[arg]);
+            ip += 2; // Enum lookups skip the inline cache.
             Value value;
 
             if (tableGet(&_enum->variables, name, &value)) {
-              pop();
-              push(value);
+              PEEK(0) = value;
               DISPATCH();
             }
             R_ERROR("'%s' enum has no property '%s'.", _enum->name->chars, name->chars);
-            DISPATCH();
           }
           default: {
             R_ERROR("Only instances have properties.");
@@ -735,201 +1257,256 @@ static InterpretResult run() {
 
 
 
-      CASE_CODE(SET_PROPERTY): {
+      CASE_CODE(SET_PROPERTY):
+        arg = READ_BYTE();
+      wide_SET_PROPERTY: {
 
-        if (!IS_INSTANCE(peek(1))) {
+        if (!IS_INSTANCE(PEEK(1))) {
           R_ERROR("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
         }
 
 
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
-        
-        Value value = pop();
-        pop();
-        push(value);
+        ObjInstance* instance = AS_INSTANCE(PEEK(1));
+        ObjString* name = AS_STRING(constants[arg]);
+        InlineCache* cache = READ_CACHE();
+
+        STORE_FRAME;
+        setField(cache, instance, name, PEEK(0));
+
+        Value value = POP();
+        PEEK(0) = value;
         DISPATCH();
       }
 
 
 
-      CASE_CODE(GET_SUPER): {
-        ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(pop());
+      CASE_CODE(GET_SUPER):
+        arg = READ_BYTE();
+      wide_GET_SUPER: {
+        ObjString* name = AS_STRING(constants[arg]);
+        ObjClass* superclass = AS_CLASS(POP());
+        STORE_FRAME;
         if (!bindMethod(superclass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+        LOAD_FRAME;
         DISPATCH();
       }
 
 
 
       CASE_CODE(EQUAL): {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
+        Value b = POP();
+        Value a = POP();
+        PUSH(BOOL_VAL(valuesEqual(a, b)));
         DISPATCH();
       }
 
 
 
-      CASE_CODE(GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
-      CASE_CODE(LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+      CASE_CODE(GREATER):
+        BINARY_OP(greaterNumbers, OP_GREATER_INT, OP_GREATER_DOUBLE);
+        DISPATCH();
+      CASE_CODE(LESS):
+        BINARY_OP(lessNumbers, OP_LESS_INT, OP_LESS_DOUBLE);
+        DISPATCH();
 
 
 
 
 
       CASE_CODE(ADD): {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else if (IS_LIST(peek(0)) && IS_LIST(peek(1))) {
-          ObjList* list1 = AS_LIST(peek(1));
-          ObjList* list2 = AS_LIST(peek(0));
-
-          ObjList* listx = newList();
-          push(OBJ_VAL(listx));
-
-          for (int i = 0; i < list1->values.count; ++i) {
-            writeValueArray(&listx->values, list1->values.values[i]);
-          }
-
-          for (int i = 0; i < list2->values.count; ++i) {
-            writeValueArray(&listx->values, list2->values.values[i]);
-          }
-          pop();
-          pop();
-          pop();
-
-          push(OBJ_VAL(listx));
+        Value a = PEEK(1);
+        Value b = PEEK(0);
+        Value result;
+        if (addNumbers(a, b, &result)) {
+          DROP();
+          PEEK(0) = result;
+          QUICKEN(a, b, result, OP_ADD_INT, OP_ADD_DOUBLE);
         } else {
-          R_ERROR(
-              "Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+#ifdef QUICKENING
+          if (IS_STRING(a) && IS_STRING(b)) ip[-1] = OP_ADD_STRING;
+#endif
+          STORE_FRAME;
+          if (!addValues()) return INTERPRET_RUNTIME_ERROR;
+          LOAD_FRAME;
         }
         DISPATCH();
       }
 
 
-      CASE_CODE(SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
-      CASE_CODE(MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
-      CASE_CODE(DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+      CASE_CODE(SUBTRACT):
+        BINARY_OP(subtractNumbers, OP_SUBTRACT_INT, OP_SUBTRACT_DOUBLE);
+        DISPATCH();
+      CASE_CODE(MULTIPLY):
+        BINARY_OP(multiplyNumbers, OP_MULTIPLY_INT, OP_MULTIPLY_DOUBLE);
+        DISPATCH();
+      // Int division is left generic, since whether it stays an int
+      // depends on the values rather than the types.
+      CASE_CODE(DIVIDE):
+        BINARY_OP(divideNumbers, OP_DIVIDE, OP_DIVIDE_DOUBLE);
+        DISPATCH();
 
 
       CASE_CODE(NOT):
-        push(BOOL_VAL(isFalsey(pop())));
+        PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
         DISPATCH();
 
 
       CASE_CODE(NEGATE):
-        if (!IS_NUMBER(peek(0))) {
+        if (!IS_NUMBER(PEEK(0))) {
           R_ERROR("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
         }
 
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        PEEK(0) = negateNumber(PEEK(0));
         DISPATCH();
 
 
 
       CASE_CODE(PRINT): {
-        printValue(pop());
+        printValue(POP());
         printf("\n");
         DISPATCH();
       }
 
 
 
-      CASE_CODE(JUMP): {
-        uint16_t offset = READ_SHORT();
+      CASE_CODE(JUMP):
+        arg = READ_SHORT();
+      wide_JUMP:
+        ip += arg;
+        DISPATCH();
 
 
-        frame->ip += offset;
 
+      CASE_CODE(JUMP_IF_FALSE):
+        arg = READ_SHORT();
+      wide_JUMP_IF_FALSE:
+        if (isFalsey(PEEK(0))) ip += arg;
         DISPATCH();
-      }
 
 
 
-      CASE_CODE(JUMP_IF_FALSE): {
-        uint16_t offset = READ_SHORT();
+      CASE_CODE(LOOP):
+        arg = READ_SHORT();
+      wide_LOOP: {
+        ip -= arg;
 
-
-        if (isFalsey(peek(0))) frame->ip += offset;
+#ifdef JIT
+        if (jitReady(frame->closure->function)) {
+          STORE_FRAME;
+          if (jitRun(frame) == JIT_ERROR) return INTERPRET_RUNTIME_ERROR;
+          if (vm.frameCount == 0) return INTERPRET_OK;
+          LOAD_FRAME;
+        }
+#endif
 
         DISPATCH();
       }
 
 
 
-      CASE_CODE(LOOP): {
-        uint16_t offset = READ_SHORT();
+      CASE_CODE(CALL): {
+        int argCount = READ_BYTE();
+        Value callee = PEEK(argCount);
+        STORE_FRAME;
+
+        // Closures and classes are by far the most common callees, so they
+        // skip the dispatch in callValue().
+        bool ok;
+        if (IS_CLOSURE(callee)) {
+          ok = call(AS_CLOSURE(callee), argCount);
+        } else if (IS_CLASS(callee)) {
+          ok = construct(AS_CLASS(callee), argCount);
+        } else {
+          ok = callValue(callee, argCount);
+        }
 
+        if (!ok) return INTERPRET_RUNTIME_ERROR;
 
-        frame->ip -= offset;
+        LOAD_FRAME;
 
         DISPATCH();
       }
 
 
 
-      CASE_CODE(CALL): {
+      CASE_CODE(TAIL_CALL): {
         int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        frame = &vm.frames[vm.frameCount - 1];
-
+        Value callee = PEEK(argCount);
+        STORE_FRAME;
+        if (!tailCall(callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME;
         DISPATCH();
       }
 
 
 
-      CASE_CODE(INVOKE): {
-        ObjString* method = READ_STRING();
+      CASE_CODE(INVOKE):
+        arg = READ_BYTE();
+      wide_INVOKE: {
+        ObjString* method = AS_STRING(constants[arg]);
         int argCount = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+        Value receiver = PEEK(argCount);
+        STORE_FRAME;
+
+        if (IS_INSTANCE(receiver)) {
+          ObjClosure* closure =
+              cachedMethod(cache, AS_INSTANCE(receiver)->klass, method);
+          if (closure != NULL) {
+            if (!call(closure, argCount)) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME;
+            DISPATCH();
+          }
+        }
+
         if (!invoke(method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
+        LOAD_FRAME;
         DISPATCH();
       }
       
 
 
-      CASE_CODE(SUPER_INVOKE): {
-        ObjString* method = READ_STRING();
+      CASE_CODE(SUPER_INVOKE):
+        arg = READ_BYTE();
+      wide_SUPER_INVOKE: {
+        ObjString* method = AS_STRING(constants[arg]);
         int argCount = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(pop());
+        ObjClass* superclass = AS_CLASS(POP());
+        STORE_FRAME;
         if (!invokeFromClass(superclass, method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
+        LOAD_FRAME;
         DISPATCH();
       }
 
 
 
-      CASE_CODE(CLOSURE): {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      CASE_CODE(CLOSURE):
+        arg = READ_BYTE();
+      wide_CLOSURE: {
+        ObjFunction* function = AS_FUNCTION(constants[arg]);
+        STORE_FRAME;
         ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
+        PUSH(OBJ_VAL(closure));
+        STORE_FRAME;
 
         for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
+          uint8_t flags = READ_BYTE();
+          int index = flags & UPVALUE_WIDE ? READ_SHORT() : READ_BYTE();
+          if (flags & UPVALUE_LOCAL) {
             closure->upvalues[i] =
-                captureUpvalue(frame->slots + index);
+                captureUpvalue(slots + index);
           } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
+          writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
         }
 
         DISPATCH();
@@ -938,8 +1515,8 @@ static InterpretResult run() {
 
 
       CASE_CODE(CLOSE_UPVALUE):
-        closeUpvalues(vm.stackTop - 1);
-        pop();
+        closeUpvalues(stackTop - 1);
+        DROP();
         DISPATCH();
 
 
@@ -948,93 +1525,115 @@ static InterpretResult run() {
 
 
 
-        Value result = pop();
+        Value result = POP();
 
 
-        closeUpvalues(frame->slots);
+        closeUpvalues(slots);
 
 
         vm.frameCount--;
         if (vm.frameCount == 0) {
-          pop();
+          vm.stackTop = slots;
           return INTERPRET_OK;
         }
 
-        vm.stackTop = frame->slots;
-        push(result);
+        stackTop = slots;
+        PUSH(result);
 
         frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        slots = frame->slots;
+        constants = frame->closure->function->chunk.constants.values;
         DISPATCH();
 
       }
 
 
       CASE_CODE(CLASS):
-        push(OBJ_VAL(newClass(READ_STRING())));
+        arg = READ_BYTE();
+      wide_CLASS: {
+        ObjString* name = AS_STRING(constants[arg]);
+        STORE_FRAME;
+        PUSH(OBJ_VAL(newClass(name)));
         DISPATCH();
+      }
 
-      CASE_CODE(ENUM): {
-        ObjEnum *_enum = newEnum(READ_STRING());
-        push(OBJ_VAL(_enum));
+      CASE_CODE(ENUM):
+        arg = READ_BYTE();
+      wide_ENUM: {
+        ObjString* name = AS_STRING(constants[arg]);
+        STORE_FRAME;
+        ObjEnum *_enum = newEnum(name);
+        PUSH(OBJ_VAL(_enum));
         DISPATCH();
       }
 
-      CASE_CODE(SET_ENUM_VALUE): {
-        Value value = peek(0);
-        ObjEnum* _enum = AS_ENUM(peek(1));
+      CASE_CODE(SET_ENUM_VALUE):
+        arg = READ_BYTE();
+      wide_SET_ENUM_VALUE: {
+        Value value = PEEK(0);
+        ObjEnum* _enum = AS_ENUM(PEEK(1));
+        ObjString* name = AS_STRING(constants[arg]);
 
-        tableSet(&_enum->variables, READ_STRING(), value);
-        pop();
+        STORE_FRAME;
+        tableSet(&_enum->variables, name, value);
+        DROP();
         DISPATCH();
       }
 
       CASE_CODE(INHERIT): {
-        Value superclass = peek(1);
+        Value superclass = PEEK(1);
 
         if (!IS_CLASS(superclass)) {
           R_ERROR("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
         }
 
 
-        ObjClass* subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods,
-                    &subclass->methods);
-        pop();
+        ObjClass* subclass = AS_CLASS(PEEK(0));
+        STORE_FRAME;
+        classInherit(subclass, AS_CLASS(superclass));
+        DROP();
         DISPATCH();
       }
 
 
 
       CASE_CODE(METHOD):
-        defineMethod(READ_STRING());
+        arg = READ_BYTE();
+      wide_METHOD: {
+        ObjString* name = AS_STRING(constants[arg]);
+        STORE_FRAME;
+        defineMethod(name);
+        LOAD_FRAME;
         DISPATCH();
+      }
 
       CASE_CODE(NEW_LIST): {
+        STORE_FRAME;
         ObjList* list = newList();
-        push(OBJ_VAL(list));
-        break;
+        PUSH(OBJ_VAL(list));
+        DISPATCH();
       }
 
       CASE_CODE(ADD_LIST): {
-        Value addValue = pop();
-        Value listValue = pop();
+        Value addValue = PEEK(0);
+        ObjList* list = AS_LIST(PEEK(1));
 
-        ObjList* list = AS_LIST(listValue);
+        STORE_FRAME;
         writeValueArray(&list->values, addValue);
-
-        push(OBJ_VAL(list));
-        break;
+        writeBarrier((Obj*)list, addValue);
+        DROP();
+        DISPATCH();
       }
 
       CASE_CODE(UNPACK_LIST): {
         int varCount = READ_BYTE();
 
-        if (!IS_LIST(peek(0))) {
+        if (!IS_LIST(PEEK(0))) {
           R_ERROR("Cannot unpack a value which is not of type list.");
         }
 
-        ObjList* list = AS_LIST(pop());
+        ObjList* list = AS_LIST(POP());
 
         if (varCount != list->values.count) {
           if (varCount >= list->values.count) {
@@ -1045,15 +1644,15 @@ static InterpretResult run() {
         }
 
         for (int i = 0; i < list->values.count; ++i) {
-          push(list->values.values[i]);
+          PUSH(list->values.values[i]);
         }
 
         DISPATCH();
       }
 
       CASE_CODE(SUBSCRIPT): {
-        Value indexValue = peek(0);
-        Value subscriptValue = peek(1);
+        Value indexValue = PEEK(0);
+        Value subscriptValue = PEEK(1);
 
         if (!IS_OBJ(subscriptValue)) {
           R_ERROR_T("'%s' is not subscriptable", 1);
@@ -1066,16 +1665,15 @@ static InterpretResult run() {
             }
 
             ObjList* list = AS_LIST(subscriptValue);
-            int index = AS_NUMBER(indexValue);
+            int index = toIndex(indexValue);
 
             if (index < 0) {
               index = list->values.count + index;
             }
 
             if (index >= 0 && index < list->values.count) {
-              pop();
-              pop();
-              push(list->values.values[index]);
+              DROP();
+              PEEK(0) = list->values.values[index];
               DISPATCH();
             }
 
@@ -1089,10 +1687,10 @@ static InterpretResult run() {
             }
 
             Value value;
-            pop();
-            pop();
+            DROP();
+            DROP();
             if (dictGet(dict, indexValue, &value)) {
-              push(value);
+              PUSH(value);
               DISPATCH();
             }
 
@@ -1104,9 +1702,9 @@ static InterpretResult run() {
       }
 
       CASE_CODE(SUBSCRIPT_ASSIGN): {
-        Value assignValue = peek(0);
-        Value indexValue = peek(1);
-        Value subscriptValue = peek(2);
+        Value assignValue = PEEK(0);
+        Value indexValue = PEEK(1);
+        Value subscriptValue = PEEK(2);
 
         if (!IS_OBJ(subscriptValue)) {
           R_ERROR_T("'%s' does not support item assignment", 2);
@@ -1119,22 +1717,20 @@ static InterpretResult run() {
             }
 
             ObjList *list = AS_LIST(subscriptValue);
-            int index = AS_NUMBER(indexValue);
+            int index = toIndex(indexValue);
 
             if (index < 0)
               index = list->values.count + index;
 
             if (index >= 0 && index < list->values.count) {
               list->values.values[index] = assignValue;
-              pop();
-              pop();
-              pop();
-              push(NIL_VAL);
+              writeBarrier((Obj*)list, assignValue);
+              stackTop -= 2;
+              PEEK(0) = NIL_VAL;
               DISPATCH();
             }
 
             R_ERROR("List index out of bounds.");
-            return INTERPRET_RUNTIME_ERROR;
           }
 
           case OBJ_DICT: {
@@ -1143,11 +1739,10 @@ static InterpretResult run() {
               R_ERROR("Type of Dictionary key must be immutable");
             }
 
+            STORE_FRAME;
             dictSet(dict, indexValue, assignValue);
-            pop();
-            pop();
-            pop();
-            push(NIL_VAL);
+            stackTop -= 2;
+            PEEK(0) = NIL_VAL;
             DISPATCH();
           }
 
@@ -1158,9 +1753,9 @@ static InterpretResult run() {
       }
 
       CASE_CODE(SUBSCRIPT_PUSH): {
-        Value value = peek(0);
-        Value indexValue = peek(1);
-        Value subscriptValue = peek(2);
+        Value value = PEEK(0);
+        Value indexValue = PEEK(1);
+        Value subscriptValue = PEEK(2);
 
         if (!IS_OBJ(subscriptValue)) {
           R_ERROR_T("'%s' does not support item assignment.", 2);
@@ -1173,19 +1768,18 @@ static InterpretResult run() {
             }
 
             ObjList* list = AS_LIST(subscriptValue);
-            int index = AS_NUMBER(indexValue);
+            int index = toIndex(indexValue);
 
             if (index < 0) {
               index = list->values.count + index;
             }
 
             if (index >= 0 && index < list->values.count) {
-              vm.stackTop[-1] = list->values.values[index];
-              push(value);
+              stackTop[-1] = list->values.values[index];
+              PUSH(value);
               DISPATCH();
             }
             R_ERROR("List index out of range.");
-            return INTERPRET_RUNTIME_ERROR;
           }
 
           case OBJ_DICT: {
@@ -1199,8 +1793,8 @@ static InterpretResult run() {
               R_ERROR("Key '%s' does not exist inside dictionary.", valueToString(indexValue));
             }
 
-            vm.stackTop[-1] = dictValue;
-            push(value);
+            stackTop[-1] = dictValue;
+            PUSH(value);
 
             DISPATCH();
           }
@@ -1212,25 +1806,186 @@ static InterpretResult run() {
 
       CASE_CODE(NEW_DICT): {
         int count = READ_BYTE();
+        STORE_FRAME;
         ObjDict *dict = newDict();
-        push(OBJ_VAL(dict));
+        PUSH(OBJ_VAL(dict));
+        STORE_FRAME;
 
         for (int i = count * 2; i > 0; i -= 2) {
-          if (!isValidKey(peek(i))) {
+          if (!isValidKey(PEEK(i))) {
             R_ERROR("Type of Dictionary key must be immutable.");
           }
 
-          dictSet(dict, peek(i), peek(i - 1));
+          dictSet(dict, PEEK(i), PEEK(i - 1));
         }
 
-        vm.stackTop -= count * 2 + 1;
-        push(OBJ_VAL(dict));
+        stackTop -= count * 2 + 1;
+        PUSH(OBJ_VAL(dict));
 
         DISPATCH();
       }
 
+      CASE_CODE(WIDE):
+        instruction = READ_BYTE();
+        arg = READ_24();
+        switch (instruction) {
+          case OP_GET_LOCAL:      goto wide_GET_LOCAL;
+          case OP_SET_LOCAL:      goto wide_SET_LOCAL;
+          case OP_GET_GLOBAL:     goto wide_GET_GLOBAL;
+          case OP_DEFINE_GLOBAL:  goto wide_DEFINE_GLOBAL;
+          case OP_SET_GLOBAL:     goto wide_SET_GLOBAL;
+          case OP_GET_PROPERTY:   goto wide_GET_PROPERTY;
+          case OP_SET_PROPERTY:   goto wide_SET_PROPERTY;
+          case OP_GET_SUPER:      goto wide_GET_SUPER;
+          case OP_INVOKE:         goto wide_INVOKE;
+          case OP_SUPER_INVOKE:   goto wide_SUPER_INVOKE;
+          case OP_CLOSURE:        goto wide_CLOSURE;
+          case OP_CLASS:          goto wide_CLASS;
+          case OP_ENUM:           goto wide_ENUM;
+          case OP_SET_ENUM_VALUE: goto wide_SET_ENUM_VALUE;
+          case OP_METHOD:         goto wide_METHOD;
+          case OP_JUMP:           goto wide_JUMP;
+          case OP_JUMP_IF_FALSE:  goto wide_JUMP_IF_FALSE;
+          case OP_LOOP:           goto wide_LOOP;
+        }
+        R_ERROR("Invalid wide instruction.");
+
+      CASE_CODE(GUARD_CALL): {
+        int argCount = READ_BYTE();
+        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+        uint16_t offset = READ_SHORT();
+
+        if (isInlinedCall(PEEK(argCount), function)) {
+          // The inlined body finds the arguments where the callee was.
+          Value* callee = &PEEK(argCount);
+          memmove(callee, callee + 1, sizeof(Value) * argCount);
+          DROP();
+        } else {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+      CASE_CODE(GUARD_INVOKE): {
+        ObjString* method = READ_STRING();
+        int argCount = READ_BYTE();
+        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+        uint16_t offset = READ_SHORT();
+
+        if (!isInlinedMethod(PEEK(argCount), method, function)) {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+
+
+      CASE_CODE(GET_LOCAL_2): {
+        uint8_t first = READ_BYTE();
+        uint8_t second = READ_BYTE();
+        PUSH(slots[first]);
+        PUSH(slots[second]);
+        DISPATCH();
+      }
+
+
+      CASE_CODE(SET_LOCAL_POP): {
+        uint8_t slot = READ_BYTE();
+        slots[slot] = POP();
+        DISPATCH();
+      }
+
+
+      CASE_CODE(ADD_LOCAL_CONST): {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        Value result;
+        if (addNumbers(a, b, &result)) {
+          PUSH(result);
+        } else {
+          PUSH(a);
+          PUSH(b);
+          STORE_FRAME;
+          if (!addValues()) return INTERPRET_RUNTIME_ERROR;
+          LOAD_FRAME;
+        }
+        DISPATCH();
+      }
+
+
+      CASE_CODE(SUBTRACT_LOCAL_CONST): {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        Value result;
+        if (!subtractNumbers(a, b, &result)) {
+          R_ERROR("Operands must be numbers.");
+        }
+        PUSH(result);
+        DISPATCH();
+      }
+
+
+      // Fused GET_LOCAL, CONSTANT, LESS, JUMP_IF_FALSE, POP. The comparison
+      // result is only materialized on the jump path, where the target
+      // still expects to pop it.
+      CASE_CODE(LESS_LOCAL_CONST_JUMP): {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        Value less;
+        if (!lessNumbers(a, b, &less)) {
+          R_ERROR("Operands must be numbers.");
+        }
+        if (!AS_BOOL(less)) {
+          PUSH(less);
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+
+      CASE_CODE(ADD_RRR):      REGISTER_ADD(slots); DISPATCH();
+      CASE_CODE(SUBTRACT_RRR): REGISTER_OP(subtractNumbers, slots); DISPATCH();
+      CASE_CODE(MULTIPLY_RRR): REGISTER_OP(multiplyNumbers, slots); DISPATCH();
+      CASE_CODE(DIVIDE_RRR):   REGISTER_OP(divideNumbers, slots); DISPATCH();
+      CASE_CODE(ADD_RRK):      REGISTER_ADD(constants); DISPATCH();
+      CASE_CODE(SUBTRACT_RRK): REGISTER_OP(subtractNumbers, constants); DISPATCH();
+      CASE_CODE(MULTIPLY_RRK): REGISTER_OP(multiplyNumbers, constants); DISPATCH();
+      CASE_CODE(DIVIDE_RRK):   REGISTER_OP(divideNumbers, constants); DISPATCH();
+
+      CASE_CODE(ADD_INT):      QUICK_INT_OP(OP_ADD, addNumbers); DISPATCH();
+      CASE_CODE(SUBTRACT_INT): QUICK_INT_OP(OP_SUBTRACT, subtractNumbers); DISPATCH();
+      CASE_CODE(MULTIPLY_INT): QUICK_INT_OP(OP_MULTIPLY, multiplyNumbers); DISPATCH();
+      CASE_CODE(GREATER_INT):  QUICK_INT_OP(OP_GREATER, greaterNumbers); DISPATCH();
+      CASE_CODE(LESS_INT):     QUICK_INT_OP(OP_LESS, lessNumbers); DISPATCH();
+
+      CASE_CODE(ADD_DOUBLE):      QUICK_DOUBLE_OP(OP_ADD, NUMBER_VAL, +); DISPATCH();
+      CASE_CODE(SUBTRACT_DOUBLE): QUICK_DOUBLE_OP(OP_SUBTRACT, NUMBER_VAL, -); DISPATCH();
+      CASE_CODE(MULTIPLY_DOUBLE): QUICK_DOUBLE_OP(OP_MULTIPLY, NUMBER_VAL, *); DISPATCH();
+      CASE_CODE(DIVIDE_DOUBLE):   QUICK_DOUBLE_OP(OP_DIVIDE, NUMBER_VAL, /); DISPATCH();
+      CASE_CODE(GREATER_DOUBLE):  QUICK_DOUBLE_OP(OP_GREATER, BOOL_VAL, >); DISPATCH();
+      CASE_CODE(LESS_DOUBLE):     QUICK_DOUBLE_OP(OP_LESS, BOOL_VAL, <); DISPATCH();
+
+      CASE_CODE(ADD_STRING):
+        if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
+        }
+        STORE_FRAME;
+        concatenate();
+        LOAD_FRAME;
+        DISPATCH();
+
     }
-  }
+
+  return INTERPRET_RUNTIME_ERROR;
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
 
 #undef READ_BYTE
 
@@ -1241,6 +1996,13 @@ static InterpretResult run() {
 
 
 #undef READ_STRING
+#undef READ_CACHE
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef QUICK_INT_OP
+#undef QUICK_DOUBLE_OP
 
 
 #undef BINARY_OP
@@ -1258,6 +2020,123 @@ void hack(bool b) {
 
 
 
+#ifdef JIT
+
+bool jitGetGlobal(ObjString* name) {
+  Value value;
+  if (!tableGet(&vm.globals, name, &value)) {
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  push(value);
+  return true;
+}
+
+void jitDefineGlobal(ObjString* name) {
+  tableSet(&vm.globals, name, peek(0));
+  pop();
+}
+
+bool jitSetGlobal(ObjString* name) {
+  if (tableSet(&vm.globals, name, peek(0))) {
+    tableDelete(&vm.globals, name);
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  return true;
+}
+
+// Compiled code only calls the property helpers with an instance receiver.
+bool jitGetProperty(ObjString* name, InlineCache* cache) {
+  ObjInstance* instance = AS_INSTANCE(peek(0));
+
+  Value value;
+  if (getField(cache, instance, name, &value)) {
+    vm.stackTop[-1] = value;
+    return true;
+  }
+
+  return bindMethod(instance->klass, name);
+}
+
+void jitSetProperty(ObjString* name, InlineCache* cache) {
+  setField(cache, AS_INSTANCE(peek(1)), name, peek(0));
+  Value value = pop();
+  vm.stackTop[-1] = value;
+}
+
+void jitSetUpvalue(int slot) {
+  ObjUpvalue* upvalue = vm.frames[vm.frameCount - 1].closure->upvalues[slot];
+  *upvalue->location = peek(0);
+  writeBarrier((Obj*)upvalue, peek(0));
+}
+
+bool jitAdd() {
+  return addValues();
+}
+
+void jitNot() {
+  vm.stackTop[-1] = BOOL_VAL(isFalsey(vm.stackTop[-1]));
+}
+
+bool jitIsFalsey(Value value) {
+  return isFalsey(value);
+}
+
+void jitPrint() {
+  printValue(pop());
+  printf("\n");
+}
+
+CallFrame* jitCall(int argCount) {
+  if (!callValue(peek(argCount), argCount)) return NULL;
+  return &vm.frames[vm.frameCount - 1];
+}
+
+// Compiled code only calls jitInvoke with an instance receiver.
+CallFrame* jitInvoke(ObjString* name, int argCount, InlineCache* cache) {
+  ObjInstance* instance = AS_INSTANCE(peek(argCount));
+  ObjClosure* closure = cachedMethod(cache, instance->klass, name);
+  if (closure != NULL ? !call(closure, argCount) : !invoke(name, argCount)) {
+    return NULL;
+  }
+  return &vm.frames[vm.frameCount - 1];
+}
+
+bool jitGuardCall(int argCount, ObjFunction* function) {
+  if (!isInlinedCall(peek(argCount), function)) return false;
+
+  Value* callee = vm.stackTop - argCount - 1;
+  memmove(callee, callee + 1, sizeof(Value) * argCount);
+  vm.stackTop--;
+  return true;
+}
+
+bool jitGuardInvoke(ObjString* name, int argCount, ObjFunction* function) {
+  return isInlinedMethod(peek(argCount), name, function);
+}
+
+bool jitTailCall(int argCount) {
+  return tailCall(peek(argCount), argCount);
+}
+
+void jitCloseUpvalue() {
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+}
+
+void jitReturn() {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  Value result = pop();
+  closeUpvalues(frame->slots);
+
+  vm.frameCount--;
+  vm.stackTop = frame->slots;
+  if (vm.frameCount > 0) push(result);
+}
+
+#endif
+
 InterpretResult interpret(const char* source) {
 
 
@@ -1265,6 +2144,10 @@ InterpretResult interpret(const char* source) {
   ObjFunction* function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
 
 
@@ -1273,12 +2156,10 @@ InterpretResult interpret(const char* source) {
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
-  callValue(OBJ_VAL(closure), 0);
-
-
-
-
+  if (!callValue(OBJ_VAL(closure), 0)) return INTERPRET_RUNTIME_ERROR;
 
+  // Compiled code may have run the whole script already.
+  if (vm.frameCount == 0) return INTERPRET_OK;
 
   return run();
 
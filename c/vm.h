@@ -17,8 +17,25 @@
 
 
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Default for vm.maxFrames, the deepest the call stack may get.
+#define FRAMES_MAX 10000
+
+// Default and highest vm.optimizationLevel. Level 0 compiles straight from
+// the parser to bytecode; from level 1 on, each expression is first built
+// as IR (see ir.h), rewritten by the passes enabled at that level and then
+// emitted. Build with -DOPTIMIZE_DEFAULT=2 (or `make OPTIMIZE=2`) to run
+// everything, the tests included, with inlining on.
+#ifndef OPTIMIZE_DEFAULT
+#define OPTIMIZE_DEFAULT 1
+#endif
+#define OPTIMIZE_MAX 2
+
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+
+// Room left above every frame's own slots for values the runtime pushes
+// to keep them reachable while it allocates.
+#define STACK_RESERVE 8
 
 
 
@@ -32,17 +49,29 @@ typedef struct {
 } CallFrame;
 
 
+typedef enum {
+  GC_IDLE,
+  GC_CLEAR,
+  GC_MARK,
+  GC_SWEEP
+} GCPhase;
+
+
 typedef struct {
 
 
 
-  CallFrame frames[FRAMES_MAX];
+  // Both stacks grow when a call needs more room, so a CallFrame* or a
+  // pointer into the stack must be re-read after anything that calls.
+  CallFrame* frames;
   int frameCount;
-  
+  int frameCapacity;
+  int maxFrames;
 
 
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
+  int stackCapacity;
 
 
   Table globals;
@@ -54,16 +83,61 @@ typedef struct {
   ObjString* initString;
 
 
+  // Number of method slots handed out so far. See ObjString.methodSlot.
+  int methodSlotCount;
+
+
+  // Whether hot functions are compiled to machine code. Only meaningful
+  // when the JIT is built in.
+  bool jitEnabled;
+
+  // Selected with -O<level>. See OPTIMIZE_DEFAULT.
+  int optimizationLevel;
+
+  // Whether function bodies are compiled on their first call rather than
+  // with the script. Selected with --lazy.
+  bool lazyCompile;
+
+  // Compiled code activations currently on the C stack.
+  int jitDepth;
+
+
   ObjUpvalue* openUpvalues;
 
 
 
   size_t bytesAllocated;
   size_t nextGC;
+  size_t nextMinorGC;
+  size_t nextGCStep;
+
+  // Longest pause, in microseconds, that a step of a full collection aims
+  // for. Full collections run all at once when it is zero, the default.
+  // Embedders can change it at any time. Selected with --gc-pause.
+  int gcPauseBudget;
 
+  // Whether full collections leave freeing the objects they find dead to
+  // a helper thread, so that their pauses only depend on the live ones.
+  // Selected with --gc-thread. Only the generational collector does so.
+  bool backgroundSweep;
 
+  // How far the full collection in progress has got, and where it is in
+  // the old objects while clearing them, or sweeping.
+  GCPhase gcPhase;
+  Obj* gcCursor;
+  Obj* unswept;
+  Obj* unsweptYoung;
 
+
+
+  // Objects that survived a collection, and the ones allocated since.
   Obj* objects;
+  Obj* nursery;
+
+  // Old objects that may refer to young ones. See writeBarrier().
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
 
 
   int grayCount;
@@ -90,6 +164,9 @@ void freeVM();
 
 InterpretResult interpret(const char* source);
 
+// Runs [function] as a script, for code that was compiled earlier.
+InterpretResult interpretFunction(ObjFunction* function);
+
 void push(Value value);
 Value pop();
 